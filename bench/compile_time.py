@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+#
+# Copyright 2015 Michael Rodler <contact@f0rki.at>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""
+Compile-time benchmark of the LLTap pass. Generates a corpus of large C translation units,
+similar to an amalgamation build, with thousands of printf-style varargs calls of varying
+argument types, calls between the generated functions and stored function pointers. They are
+compiled to bitcode once and then the wall time of running opt with and without the LLTap pass
+is reported for every module.
+"""
+
+import argparse
+import os
+import random
+import subprocess
+import sys
+import time
+
+ARG_TYPES = [
+    ("int", "i"),
+    ("long", "(long)i"),
+    ("double", "(double)i"),
+    ("const char*", "\"x\""),
+    ("void*", "(void*)&i"),
+    ("struct pair", "p"),
+]
+
+
+def generate_module(path, index, functions, calls, rnd):
+    with open(path, "w") as f:
+        f.write("#include <stdio.h>\n#include <string.h>\n\n")
+        f.write("struct pair { long a, b; };\n")
+        f.write("int log_message(int level, const char* fmt, ...);\n")
+        f.write("typedef long (*fn_t)(long, struct pair);\n")
+        f.write("fn_t table_{0}[{1}];\n\n".format(index, functions))
+        for fn in range(functions):
+            f.write("long m{0}_f{1}(long i, struct pair p) {{\n".format(index, fn))
+            f.write("  long r = i;\n")
+            for c in range(calls):
+                nargs = rnd.randint(0, 6)
+                args = [rnd.choice(ARG_TYPES)[1] for _ in range(nargs)]
+                callee = rnd.choice(["printf(\"%d\"", "fprintf(stderr, \"%d\"",
+                                     "log_message(1, \"%d\"", "snprintf(0, 0, \"%d\""])
+                f.write("  r += {0}{1});\n".format(callee, "".join(", " + a for a in args)))
+                if fn > 0 and c % 4 == 0:
+                    f.write("  r += m{0}_f{1}(r, p);\n".format(index, rnd.randrange(fn)))
+                if c % 8 == 0:
+                    f.write("  r += strlen(\"abc\") + (long)memchr(\"abc\", (int)r, 3);\n")
+            f.write("  table_{0}[{1}] = m{0}_f{1};\n".format(index, fn))
+            f.write("  return r;\n}\n\n")
+
+
+def run(cmd):
+    subprocess.check_call(cmd, stdout=subprocess.DEVNULL)
+
+
+def best_time(cmd, repetitions):
+    best = None
+    for _ in range(repetitions):
+        start = time.perf_counter()
+        run(cmd)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--pass-lib", required=True, help="path to the LLTap pass plugin")
+    parser.add_argument("--llvm-bin", default="", help="directory containing clang and opt")
+    parser.add_argument("--workdir", default="lltap-bench-compile",
+                        help="where the generated corpus is stored")
+    parser.add_argument("--modules", type=int, default=4, help="number of translation units")
+    parser.add_argument("--functions", type=int, default=500, help="functions per module")
+    parser.add_argument("--calls", type=int, default=16, help="varargs calls per function")
+    parser.add_argument("--repetitions", type=int, default=3,
+                        help="the best of this many runs is reported")
+    parser.add_argument("--pass-args", default="",
+                        help="additional arguments passed to opt, e.g. LLTap options")
+    args = parser.parse_args()
+
+    clang = os.path.join(args.llvm_bin, "clang")
+    opt = os.path.join(args.llvm_bin, "opt")
+    os.makedirs(args.workdir, exist_ok=True)
+    rnd = random.Random(42)
+
+    print("{:<12} {:>10} {:>10} {:>10}".format("module", "calls", "opt [s]", "lltap [s]"))
+    for m in range(args.modules):
+        src = os.path.join(args.workdir, "corpus{}.c".format(m))
+        bc = os.path.join(args.workdir, "corpus{}.bc".format(m))
+        out = os.path.join(args.workdir, "corpus{}.inst.bc".format(m))
+        generate_module(src, m, args.functions, args.calls, rnd)
+        run([clang, "-O0", "-w", "-emit-llvm", "-c", "-o", bc, src])
+
+        base = best_time([opt, "-o", out, bc], args.repetitions)
+        inst = best_time([opt, "-load", args.pass_lib, "-load-pass-plugin", args.pass_lib,
+                          "-passes=lltap-inst"] + args.pass_args.split() + ["-o", out, bc],
+                         args.repetitions)
+        print("{:<12} {:>10} {:>10.3f} {:>10.3f}".format(
+            "corpus{}".format(m), args.functions * args.calls, base, inst))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/**
+ * Microbenchmark of the hook lookup in the LLTap runtime. For a growing number of hooked targets
+ * it measures the latency of __lltap_inst_get_hooks for hooked and unhooked targets and compares
+ * it to a lookup in a std::map, which the runtime used before.
+ */
+
+#include <liblltap.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const size_t LOOKUPS = 10000000;
+
+static void dummy_hook(void) {}
+
+template<typename Fn>
+static double ns_per_lookup(const vector<void*>& order, Fn lookup) {
+  uintptr_t sink = 0;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < LOOKUPS; ++i) {
+    sink += lookup(order[i % order.size()]);
+  }
+  auto end = chrono::steady_clock::now();
+  // keep the compiler from dropping the lookups
+  volatile uintptr_t keep = sink;
+  (void)keep;
+  return chrono::duration<double, nano>(end - start).count() / LOOKUPS;
+}
+
+static void run(size_t count, mt19937& rng) {
+  // fake function addresses, spread like functions in a text segment
+  vector<char> text(count * 256);
+  vector<void*> hooked;
+  vector<void*> unhooked;
+  uniform_int_distribution<size_t> gap(1, 7);
+  size_t off = 0;
+  for (size_t i = 0; i < count; ++i) {
+    hooked.push_back(&text[off]);
+    unhooked.push_back(&text[off + 16]);
+    off += 32 * gap(rng);
+    off = min(off, text.size() - 32);
+  }
+
+  vector<string> names;
+  for (size_t i = 0; i < count; ++i) {
+    names.push_back("bench_" + to_string(count) + "_" + to_string(i));
+    __lltap_inst_add_hook_target(hooked[i], &names[i][0]);
+  }
+  vector<LLTapHookInfo> infos;
+  for (size_t i = 0; i < count; ++i) {
+    infos.push_back({&names[i][0], (LLTapHook)&dummy_hook, LLTAP_PRE_HOOK});
+  }
+  infos.push_back({nullptr, nullptr, LLTAP_PRE_HOOK});
+  lltap_register_hooks(infos.data());
+
+  map<void*, LLTapHookRegistry> baseline;
+  for (void* addr : hooked) {
+    baseline[addr].pre_hook = (LLTapHook)&dummy_hook;
+  }
+
+  shuffle(hooked.begin(), hooked.end(), rng);
+  shuffle(unhooked.begin(), unhooked.end(), rng);
+
+  double hit = ns_per_lookup(hooked, [](void* addr) {
+      return (uintptr_t)__lltap_inst_get_hooks(addr);
+  });
+  double miss = ns_per_lookup(unhooked, [](void* addr) {
+      return (uintptr_t)__lltap_inst_get_hooks(addr);
+  });
+  double map_hit = ns_per_lookup(hooked, [&baseline](void* addr) {
+      return (uintptr_t)baseline.find(addr)->second.pre_hook;
+  });
+
+  printf("%8zu targets: lltap hit %6.1f ns  miss %6.1f ns | std::map hit %6.1f ns\n",
+      count, hit, miss, map_hit);
+}
+
+int main() {
+  mt19937 rng(0x11a7);
+  for (size_t count : {10, 1000, 100000}) {
+    run(count, rng);
+  }
+  return 0;
+}
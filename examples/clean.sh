@@ -5,3 +5,5 @@ rm *.o
 rm *.s
 rm *.bin
 rm core.*
+rm *.trace
+rm *.ids
@@ -18,40 +18,28 @@ fi
 #export PATH=/path/to/src/llvm/build/bin/:$PATH
 
 CFLAGS="-Wall -pedantic"
-OPTS="$CFLAGS -emit-llvm $ADD_CFLAGS"
 LLTAPSO="../build/llvmpass/libLLTap.so"
+# -fpass-plugin runs the pass in clang's pipeline, -load makes its options available to -mllvm
+OPTS="$CFLAGS $ADD_CFLAGS -fpass-plugin=$LLTAPSO -Xclang -load -Xclang $LLTAPSO"
 LLTAPRTSO="../build/lib/liblltaprt.so"
 
 SRC=$(basename -s ".c" $1)
 HOOKSRC=$(basename -s ".c" $2)
 
-BCFILES="$SRC.inst.bc"
+OBJFILES="$SRC.inst.o"
 BINOUT="$SRC.exec.bin"
 
 echo "Using"
-which opt
-opt --version
 which clang
 clang --version
 
 ulimit -c unlimited
 set -x
-#clang $OPTS -I../include -c
-clang $OPTS -S $SRC.c
-clang $OPTS -c $SRC.c
-opt -verify -verify-each \
-    -load $LLTAPSO \
-    -LLTapInst \
-    "$SRC.bc" > "$SRC.inst.bc"
-llvm-dis "$SRC.inst.bc"
-clang $CFLAGS $ADD_CFLAGS -I../include/ -L ../build/lib/ "$HOOKSRC.c" $BCFILES -o "$BINOUT" $LINKLIBS
-
-#clang -Xclang -load -Xclang "$LLTAPSO" -LLTapInst \
-#    -L "../build/lib/" \
-#    -I "../include/" \
-#    "$1" "$2" \
-#    -o "$BINOUT" \
-#    $LINKLIBS
+# the instrumented IR, for reference
+clang $OPTS -emit-llvm -S -o "$SRC.inst.ll" $SRC.c
+clang $OPTS -c -o "$OBJFILES" $SRC.c
+# the hooks must not be instrumented themselves
+clang $CFLAGS $ADD_CFLAGS -I../include/ -L ../build/lib/ "$HOOKSRC.c" $OBJFILES -o "$BINOUT" $LINKLIBS
 
 echo "Executing instrumented binary $BINOUT"
 env LLTAP_LOGLEVEL=DEBUG LD_LIBRARY_PATH=../build/lib "./$BINOUT"
@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+/* instrumented at its definition, see test_debuginfo.sh */
+int work(int x) {
+  int y = x * 3;
+  return y + 1;
+}
+
+int main() {
+  printf("work(4) = %d\n", work(4));
+  return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+# With -callee-side the body of work is moved to __lltap_impl_work. Check that the moved body still
+# has the line table of work.
+set -eu -o pipefail
+
+./run.sh test_debuginfo.c test_debuginfo_hook.c "-g -O0 -mllvm -callee-side -mllvm -inst-func=work" ""
+
+addr=$(llvm-nm test_debuginfo.inst.o | awk '$3 == "__lltap_impl_work" { print $1 }')
+loc=$(llvm-symbolizer --obj=test_debuginfo.inst.o "0x$addr" | sed -n 2p)
+echo "__lltap_impl_work is at $loc"
+if [[ "$loc" != *test_debuginfo.c:[1-9]* ]]; then
+    echo "__lltap_impl_work has no line info"
+    exit 1
+fi
@@ -0,0 +1,8 @@
+#include <liblltap.h>
+#include <stdio.h>
+
+void work_hook(int* x) {
+  fprintf(stderr, "work(%d)\n", *x);
+}
+
+LLTAP_REGISTER_HOOK("work", work_hook, LLTAP_PRE_HOOK)
@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+/* passed byval on x86-64 */
+struct big {
+  long v[4];
+};
+
+/* the volatile pointer keeps the call indirect */
+static unsigned (*volatile fp)(struct big, unsigned char);
+
+static unsigned sum(struct big b, unsigned char c)
+{
+  unsigned r = (unsigned)b.v[3] + c;
+  b.v[3] = 0;
+  return r;
+}
+
+int main()
+{
+  struct big b = {{1, 2, 3, 1000}};
+  fp = sum;
+  unsigned r = fp(b, 200);
+  printf("sum returned %u, b.v[3] is %ld\n", r, b.v[3]);
+  return r != 1200 || b.v[3] != 1000;
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+# The hooked path of an indirect call must keep the byval and zeroext attributes of the call,
+# otherwise sum reads garbage and clobbers b of main.
+set -eu -o pipefail
+
+./run.sh test_indirect_byval.c test_indirect_byval_hook.c "-O1 -mllvm -inst-indirect-calls -mllvm -inst-func=sum" ""
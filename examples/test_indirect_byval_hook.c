@@ -0,0 +1,13 @@
+#include <liblltap.h>
+#include <stdio.h>
+
+struct big {
+  long v[4];
+};
+
+/* b is passed byval, so the pre hook gets a pointer to the pointer to the copy */
+void sum_hook(struct big** b, unsigned char* c) {
+  fprintf(stderr, "sum(b.v[3] = %ld, c = %u)\n", (*b)->v[3], *c);
+}
+
+LLTAP_REGISTER_HOOK("sum", sum_hook, LLTAP_PRE_HOOK)
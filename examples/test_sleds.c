@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+extern int work_hook_calls;
+void install_work_hook(void);
+void remove_work_hook(void);
+
+__attribute__((noinline)) int work(int x)
+{
+  return x + 1;
+}
+
+int main()
+{
+  /* no hooks yet, the sled falls through to work */
+  if (work(1) != 2 || work_hook_calls != 0) {
+    puts("work was hooked before any hook was installed");
+    return 1;
+  }
+
+  install_work_hook();
+  if (work(2) != 3 || work_hook_calls != 1) {
+    puts("the hook installed at runtime did not fire");
+    return 2;
+  }
+
+  remove_work_hook();
+  if (work(3) != 4 || work_hook_calls != 1) {
+    puts("the hook still fired after it was removed");
+    return 3;
+  }
+
+  puts("ok");
+  return 0;
+}
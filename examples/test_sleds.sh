@@ -0,0 +1,11 @@
+#!/bin/bash
+# Calls of work go through a patchable sled, which is only redirected to the hooks while a hook is
+# installed. The hook is installed and removed at runtime.
+set -eu -o pipefail
+
+./run.sh test_sleds.c test_sleds_hook.c "-O0 -mllvm -patchable-sleds -mllvm -inst-func=work" ""
+
+if ! grep -q '__lltap_sled_work' test_sleds.inst.ll; then
+    echo "work is not called through a sled"
+    exit 1
+fi
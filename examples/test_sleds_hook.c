@@ -0,0 +1,18 @@
+#include <liblltap.h>
+#include <stdio.h>
+
+int work_hook_calls = 0;
+
+void work_hook(int* x) {
+  fprintf(stderr, "work(%d)\n", *x);
+  work_hook_calls++;
+}
+
+/* installed after startup, which patches the sled of work */
+void install_work_hook(void) {
+  lltap_register_hook("work", (LLTapHook)work_hook, LLTAP_PRE_HOOK);
+}
+
+void remove_work_hook(void) {
+  lltap_deregister_hook("work", LLTAP_PRE_HOOK);
+}
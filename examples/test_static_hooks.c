@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+extern int lltap_static_hooks_enabled;
+
+__attribute__((noinline)) int work(int x)
+{
+  return x + 1;
+}
+
+int main()
+{
+  if (work(1) != 100) {
+    puts("the static replace hook was not called");
+    return 1;
+  }
+
+  lltap_static_hooks_enabled = 0;
+  if (work(1) != 2) {
+    puts("the kill switch did not disable the static hooks");
+    return 2;
+  }
+
+  puts("ok");
+  return 0;
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+# The replace hook of work is listed in a static hook manifest and called without the runtime
+# looking it up. The kill switch turns it off again.
+set -eu -o pipefail
+
+./run.sh test_static_hooks.c test_static_hooks_hook.c "-O0 -mllvm -static-hooks=test_static_hooks.manifest -mllvm -static-hooks-kill-switch -mllvm -inst-func=work" ""
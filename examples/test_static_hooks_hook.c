@@ -0,0 +1,7 @@
+#include <stdio.h>
+
+/* called directly by the wrapper of work, see test_static_hooks.manifest */
+int work_replace(int x) {
+  fprintf(stderr, "work_replace(%d)\n", x);
+  return 100;
+}
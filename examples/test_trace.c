@@ -0,0 +1,29 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+__attribute__((noinline)) int add(int a, int b)
+{
+  return a + b;
+}
+
+__attribute__((noinline)) int mul(int a, int b)
+{
+  return a * b;
+}
+
+int main(int argc, char** argv)
+{
+  int x = add(1, 2);
+  int y = add(3, 4);
+  printf("%d\n", mul(x, y));
+
+  if (argc > 1 && strcmp(argv[1], "kill") == 0) {
+    // give the tracer time to write the events, then die without closing the trace
+    fflush(stdout);
+    usleep(200 * 1000);
+    kill(getpid(), SIGKILL);
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Traces the calls of add and mul with the built-in tracer and checks that lltap-decode prints them
+# in every format, also from a trace which was never closed because the program was killed.
+set -eu -o pipefail
+
+DECODE=../build/lib/lltap-decode
+EXPECTED="add(0x1, 0x2) = 0x3
+add(0x3, 0x4) = 0x7
+mul(0x3, 0x7) = 0x15"
+
+check() {
+    if [[ "$2" != "$EXPECTED" ]]; then
+        echo "unexpected calls in the $1 output:"
+        echo "$2"
+        exit 1
+    fi
+}
+
+# the calls without the thread ID and the times
+decode_text() {
+    $DECODE "$@" | sed -e 's/^\[[0-9]*\] [0-9.]* //' -e 's/ <[0-9.]*>$//'
+}
+
+decode_csv() {
+    $DECODE -f csv "$@" | tail -n +2 \
+        | awk -F, '{ printf "%s(%s, %s) = %s\n", $5, $12, $13, $NF }'
+}
+
+decode_json() {
+    $DECODE -f json "$@" | python3 -c '
+import json, sys
+for ev in json.load(sys.stdin)["traceEvents"]:
+    print("%s(%s) = %s" % (ev["name"], ", ".join(ev["args"]["args"]), ev["args"]["ret"]))'
+}
+
+rm -f test_trace.ids test_trace.trace test_trace_killed.trace
+LLTAP_TRACE=test_trace.trace ./run.sh test_trace.c test_trace_hook.c "-O0 -mllvm -trace-calls -mllvm -target-ids=test_trace.ids -mllvm -inst-func=add -mllvm -inst-func=mul" ""
+
+check text "$(decode_text test_trace.trace)"
+check CSV "$(decode_csv test_trace.trace)"
+check JSON "$(decode_json test_trace.trace)"
+
+echo "Executing and killing test_trace.exec.bin"
+if env LD_LIBRARY_PATH=../build/lib LLTAP_TRACE=test_trace_killed.trace ./test_trace.exec.bin kill; then
+    echo "test_trace.exec.bin was not killed"
+    exit 1
+fi
+# the trace has no names, they are taken from the target IDs file of the pass
+if ! $DECODE test_trace_killed.trace 2>&1 >/dev/null | grep -q "incomplete"; then
+    echo "the trace of the killed run is not incomplete"
+    exit 1
+fi
+check "text (killed)" "$(decode_text -t test_trace.ids test_trace_killed.trace)"
+check "CSV (killed)" "$(decode_csv -t test_trace.ids test_trace_killed.trace)"
+check "JSON (killed)" "$(decode_json -t test_trace.ids test_trace_killed.trace)"
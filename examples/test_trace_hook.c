@@ -0,0 +1,2 @@
+/* no hooks, the calls are recorded by the built-in tracer */
+#include <liblltap.h>
@@ -32,6 +32,9 @@ enum LLTapHookType {
   LLTAP_PRE_HOOK = 1,
   LLTAP_REPLACE_HOOK = 2,
   LLTAP_POST_HOOK = 4,
+  /* post hook which receives pointers to the return value and all parameters,
+   * e.g. void posthook(int* ret, int* a, char** b); instead of copies */
+  LLTAP_POST_HOOK_BYREF = 8,
 };
 #ifndef __cplusplus
 typedef enum LLTapHookType LLTapHookType;
@@ -46,29 +49,248 @@ struct LLTapHookInfo {
 typedef struct LLTapHookInfo LLTapHookInfo;
 #endif
 
+/* The hooks installed for one target. Published by the runtime and never
+ * modified or released afterwards, so the instrumentation can read it without
+ * locking. Targets with the same hooks share a registry. */
+struct LLTapHookRegistry {
+  int bitmap;
+  LLTapHook pre_hook;
+  LLTapHook replace_hook;
+  LLTapHook post_hook;
+  /* ID of the target, which the tracer records */
+  unsigned target_id;
+};
+#ifndef __cplusplus
+typedef struct LLTapHookRegistry LLTapHookRegistry;
+#endif
+
+/* Bit in the bitmap of a registry: the built-in tracer records the calls of the
+ * target (see lltap_trace_start()). */
+#define LLTAP_TRACED 16
+
+/* Per-target dispatch slot emitted by the instrumentation pass. Points to the
+ * registry of the target while at least one hook is installed, NULL otherwise. */
+typedef const struct LLTapHookRegistry* LLTapHookSlot;
+
+/* Describes one hook target. The instrumentation pass emits these records into
+ * the LLTAP_TARGETS_SECTION section, which is registered with the runtime in
+ * one batch per linked image. */
+struct LLTapTargetRecord {
+  void* addr;
+  char* name;
+  LLTapHookSlot* slot;
+  unsigned id;
+  unsigned flags;
+  /* patchable sled the calls to the target go through and the wrapper the
+   * sled is patched to jump to while hooks are installed, or NULL */
+  void* sled;
+  void* dispatcher;
+};
+#ifndef __cplusplus
+typedef struct LLTapTargetRecord LLTapTargetRecord;
+#endif
+#define LLTAP_TARGETS_SECTION "__lltap_targets"
+
+/* The target itself calls the hooks (callee-side instrumentation), so calling
+ * it indirectly must not call them again. */
+#define LLTAP_TARGET_HOOKED_AT_ENTRY 1
+
+/* Hook slot of an address called from an instrumented indirect call site. It
+ * is never freed, so the per call site inline caches can keep pointers to it. */
+struct LLTapIndirectTarget {
+  void* addr;
+  LLTapHookSlot slot;
+};
+#ifndef __cplusplus
+typedef struct LLTapIndirectTarget LLTapIndirectTarget;
+#endif
+
+/* Targets are assigned dense IDs by the instrumentation pass, see the
+ * -target-ids and -target-id-header options of the pass. */
+#define LLTAP_NO_TARGET_ID ((unsigned)-1)
+/* The runtime numbers the targets without such an ID from here on, so the
+ * built-in tracer can name them. Hooks can't be registered by these IDs. */
+#define LLTAP_FIRST_RUNTIME_TARGET_ID 0x80000000u
+
+/* Describes one instrumented call site (see the -call-site-ids option of the
+ * instrumentation pass). The records of a linked image are kept in the
+ * LLTAP_CALL_SITES_SECTION section. When they are registered, the runtime
+ * numbers all call sites of the process densely in id. */
+struct LLTapCallSiteRecord {
+  void* target;
+  const char* caller;
+  /* source location from the debug info, or NULL and 0 */
+  const char* file;
+  unsigned line;
+  unsigned column;
+  unsigned target_id;
+  unsigned id;
+};
+#ifndef __cplusplus
+typedef struct LLTapCallSiteRecord LLTapCallSiteRecord;
+#endif
+#define LLTAP_CALL_SITES_SECTION "__lltap_call_sites"
+#define LLTAP_NO_CALL_SITE_ID ((unsigned)-1)
+
+/* The call site whose hooks or target currently run on this thread, or NULL
+ * outside of calls instrumented with -call-site-ids. Hooks can use
+ * __lltap_call_site->id to index per call site data. */
+extern __thread const struct LLTapCallSiteRecord* __lltap_call_site;
+
+/* Number of registered call sites and the call site with the given ID, or
+ * NULL if there is none. */
+unsigned lltap_num_call_sites(void);
+const LLTapCallSiteRecord* lltap_get_call_site(unsigned id);
+
+/* Number of 64 bit words the hooks of a call can use to pass state from the pre
+ * hook to the replace and post hook. */
+#define LLTAP_CALL_CONTEXT_WORDS 4
+
+/* Context of one instrumented call (see the -call-contexts option of the
+ * instrumentation pass). The wrapper of the call keeps it on its stack while
+ * the hooks and the target run. */
+struct LLTapCallContext {
+  /* scratch space of the hooks, zeroed before the pre hook */
+  unsigned long long data[LLTAP_CALL_CONTEXT_WORDS];
+  /* context of the instrumented call this one is nested in, or NULL */
+  struct LLTapCallContext* outer;
+  /* see lltap_thread_id() */
+  unsigned thread_id;
+  /* ID of the call site, or LLTAP_NO_CALL_SITE_ID without -call-site-ids */
+  unsigned call_site_id;
+};
+#ifndef __cplusplus
+typedef struct LLTapCallContext LLTapCallContext;
+#endif
+
+/* Context of the call whose hooks or target currently run on this thread, or
+ * NULL outside of calls instrumented with -call-contexts. It is restored when
+ * an exception unwinds a hooked call of a module that uses exceptions, but not
+ * by longjmp, after which it still points to the skipped frame. */
+extern __thread struct LLTapCallContext* __lltap_call_context;
+
+/* Small ID of the calling thread, starting at 1. Unlike pthread_self() the IDs
+ * of exited threads are never reused. */
+unsigned lltap_thread_id(void);
+
+/* Number of argument words the built-in tracer records per call. */
+#define LLTAP_TRACE_MAX_ARGS 6
+
+/* One call recorded by the built-in tracer. Arguments and the return value are
+ * recorded as raw words: integers zero extended, pointers as addresses and
+ * floating point values by their bits. Other types are recorded as 0. */
+struct LLTapTraceEvent {
+  /* CLOCK_MONOTONIC in ns before the pre hook and after the post hook */
+  unsigned long long start;
+  unsigned long long end;
+  unsigned target_id;
+  /* LLTAP_NO_CALL_SITE_ID without -call-site-ids */
+  unsigned call_site_id;
+  /* see lltap_thread_id() */
+  unsigned thread_id;
+  unsigned nargs;
+  unsigned long long args[LLTAP_TRACE_MAX_ARGS];
+  unsigned long long ret;
+};
+#ifndef __cplusplus
+typedef struct LLTapTraceEvent LLTapTraceEvent;
+#endif
+
+/* A trace file starts with this header, followed by num_events events. The
+ * events of each thread are in order, but the threads are interleaved in
+ * blocks. The events are followed by the names of the targets and call sites
+ * starting at names_offset, one per line with tab separated fields:
+ *   target <id> <name>
+ *   site <id> <target id> <caller> <file> <line> <column>
+ * names_offset is 0 while the trace is written, e.g. if the program crashed.
+ * The events end with the first one whose end is 0 then. lltap-decode decodes
+ * trace files. */
+struct LLTapTraceHeader {
+  char magic[8];
+  unsigned version;
+  unsigned event_size;
+  unsigned long long num_events;
+  unsigned long long names_offset;
+};
+#ifndef __cplusplus
+typedef struct LLTapTraceHeader LLTapTraceHeader;
+#endif
+#define LLTAP_TRACE_MAGIC "LLTAPTRC"
+#define LLTAP_TRACE_VERSION 1
+
+/* Record all calls instrumented with -trace-calls to the given file, which is
+ * only complete after lltap_trace_stop() or the exit of the program. Setting
+ * the LLTAP_TRACE environment variable to a file name starts the tracer when
+ * the runtime is loaded. Returns 0 if the file can't be created. */
+int lltap_trace_start(const char* path);
+void lltap_trace_stop(void);
+
+/* Kill switch of the hooks which the instrumentation pass compiled directly
+ * into the wrappers (-static-hooks together with -static-hooks-kill-switch).
+ * They are only called while this is non-zero. */
+extern int lltap_static_hooks_enabled;
+
+/* Incremented whenever the dispatch slots change. Loops versioned by the
+ * instrumentation pass (-version-hooked-loops) only check the slots of their
+ * targets again after it changed. */
+extern unsigned long long __lltap_hook_generation;
+
+/* Call site of the counters emitted by the instrumentation pass with
+ * -count-calls, one per caller and callee. The runtime writes the counts to
+ * the file named by the LLTAP_CALL_COUNTS environment variable at exit, which
+ * the pass reads back with -call-counts. */
+struct LLTapCallCountSite {
+  const char* callee;
+  const char* caller;
+};
+#ifndef __cplusplus
+typedef struct LLTapCallCountSite LLTapCallCountSite;
+#endif
+
 int lltap_register_hook(char* target, LLTapHook hook, LLTapHookType type);
 void lltap_deregister_hook(char* target, LLTapHookType type);
 int lltap_register_hook_i(LLTapHookInfo* reg);
+int lltap_register_hooks(LLTapHookInfo* regs);
+int lltap_register_hook_id(unsigned target, LLTapHook hook, LLTapHookType type);
+void lltap_deregister_hook_id(unsigned target, LLTapHookType type);
 
 #define LLTAP_REGISTER_HOOK(target, hookfunction, hooktype) \
 void __attribute__((constructor)) __LLTapHook_init(void) { \
   lltap_register_hook(target, (LLTapHook) &hookfunction, hooktype);\
 }
 
+#define LLTAP_REGISTER_HOOK_ID(target, hookfunction, hooktype) \
+void __attribute__((constructor)) __LLTapHook_init(void) { \
+  lltap_register_hook_id(target, (LLTapHook) &hookfunction, hooktype);\
+}
+
 #define LLTAP_HOOKSV LLTapHookInfo
 #define LLTAP_HOOKSV_END {NULL, NULL, 0}
 #define LLTAP_REGISTER_HOOKS(__lltap_hooks) \
 void __attribute__((constructor)) __LLTapHook_init(void) { \
-  for (size_t i = 0; __lltap_hooks[i].target != NULL; ++i) { \
-    lltap_register_hook(__lltap_hooks[i].target, \
-        __lltap_hooks[i].hook, __lltap_hooks[i].type); \
-  } \
+  lltap_register_hooks(__lltap_hooks); \
 } \
 
 
 void __lltap_inst_add_hook_target(void* addr, char* name);
+void __lltap_inst_add_hook_slot(void* addr, char* name, LLTapHookSlot* slot);
+void __lltap_inst_add_hook_targets(struct LLTapTargetRecord* begin,
+    struct LLTapTargetRecord* end);
 LLTapHook __lltap_inst_get_hook(void* target, LLTapHookType type);
+const LLTapHookRegistry* __lltap_inst_get_hooks(void* target);
+const struct LLTapIndirectTarget* __lltap_inst_lookup_indirect(void* addr,
+    const struct LLTapIndirectTarget** cache, unsigned size);
 int __lltap_inst_has_hooks(void* target);
+void __lltap_inst_add_call_sites(struct LLTapCallSiteRecord* begin,
+    struct LLTapCallSiteRecord* end);
+unsigned long long __lltap_trace_clock(void);
+void __lltap_trace_call(const struct LLTapHookRegistry* hooks,
+    unsigned call_site_id, unsigned long long start,
+    const unsigned long long* args, unsigned nargs, unsigned long long ret);
+extern __thread unsigned __lltap_thread_id;
+unsigned __lltap_inst_thread_id(void);
+void __lltap_inst_add_call_counts(unsigned long long* counts,
+    const struct LLTapCallCountSite* sites, size_t size);
 
 #ifdef __cplusplus
 }
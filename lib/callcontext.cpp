@@ -0,0 +1,49 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <liblltap.h>
+
+#include <atomic>
+
+namespace LLTap {
+
+  /**
+   * Thread IDs are only assigned when a thread first needs one, so 0 marks a thread without ID.
+   */
+  std::atomic<unsigned> next_thread_id(1);
+}
+
+extern "C" {
+
+__thread LLTapCallContext* __lltap_call_context = nullptr;
+__thread unsigned __lltap_thread_id __attribute__((tls_model("initial-exec"))) = 0;
+
+/**
+ * Called by the wrappers when __lltap_thread_id is still 0.
+ */
+unsigned __lltap_inst_thread_id(void) {
+  if (__lltap_thread_id == 0) {
+    __lltap_thread_id = LLTap::next_thread_id.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __lltap_thread_id;
+}
+
+unsigned lltap_thread_id(void) {
+  return __lltap_inst_thread_id();
+}
+
+}
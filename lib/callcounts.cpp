@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#include <liblltap.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace LLTap {
+
+  /**
+   * The call counters of one module, emitted by the instrumentation pass with -count-calls.
+   */
+  struct call_counters {
+    unsigned long long* counts;
+    const LLTapCallCountSite* sites;
+    size_t size;
+  };
+
+  /**
+   * Collects the call counters of all modules and writes them to the file named by
+   * LLTAP_CALL_COUNTS when the program exits.
+   */
+  class CallCounts {
+
+    public:
+      void add(unsigned long long* counts, const LLTapCallCountSite* sites, size_t size);
+      void write();
+
+    private:
+      std::mutex lock;
+      std::vector<call_counters> modules;
+  };
+
+  /**
+   * Modules register their counters from their constructors, which may run before the
+   * constructors of the runtime when it is linked statically.
+   */
+  CallCounts& callcounts() {
+    static CallCounts counts;
+    return counts;
+  }
+}
+
+/**
+ * CallCounts implementation
+ */
+
+void LLTap::CallCounts::add(unsigned long long* counts, const LLTapCallCountSite* sites,
+    size_t size) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (modules.empty()) {
+    // runs before the destructor of callcounts(), which was constructed first
+    atexit([]() { callcounts().write(); });
+  }
+  modules.push_back({counts, sites, size});
+}
+
+/**
+ * Write one line "<count> <callee> <caller>" per call site. The counters of a caller and callee
+ * present in several modules, e.g. of an inline function, are summed up.
+ */
+void LLTap::CallCounts::write() {
+  const char* path = getenv("LLTAP_CALL_COUNTS");
+  if (path == nullptr) {
+    return;
+  }
+
+  std::map<std::pair<std::string, std::string>, unsigned long long> totals;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for (const call_counters& m : modules) {
+      for (size_t i = 0; i < m.size; ++i) {
+        // other threads may still make counted calls
+        totals[std::make_pair(m.sites[i].callee, m.sites[i].caller)]
+          += __atomic_load_n(&m.counts[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  FILE* out = fopen(path, "w");
+  if (out == nullptr) {
+    fprintf(stderr, "[LLTAP-RT] Failed to write call counts to %s\n", path);
+    return;
+  }
+  fprintf(out, "# <count> <callee> <caller>\n");
+  for (auto& t : totals) {
+    fprintf(out, "%llu %s %s\n", t.second, t.first.first.c_str(), t.first.second.c_str());
+  }
+  fclose(out);
+}
+
+extern "C" {
+
+void __lltap_inst_add_call_counts(unsigned long long* counts,
+    const LLTapCallCountSite* sites, size_t size) {
+  LLTap::callcounts().add(counts, sites, size);
+}
+
+}
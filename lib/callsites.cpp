@@ -0,0 +1,96 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#include <liblltap.h>
+
+#include <mutex>
+#include <vector>
+
+namespace LLTap {
+
+  /**
+   * All registered call site records, indexed by their ID.
+   */
+  class CallSites {
+
+    public:
+      void add(LLTapCallSiteRecord* begin, LLTapCallSiteRecord* end);
+      const LLTapCallSiteRecord* get(unsigned id);
+      unsigned size();
+
+    private:
+      std::mutex lock;
+      std::vector<LLTapCallSiteRecord*> sites;
+  };
+
+  /**
+   * Modules register their call sites from their constructors, which may run before the
+   * constructors of the runtime when it is linked statically. Hooks may still look up call sites
+   * from destructors, so it is never destroyed.
+   */
+  CallSites& callsites() {
+    static CallSites* sites = new CallSites();
+    return *sites;
+  }
+}
+
+/**
+ * CallSites implementation
+ */
+
+/**
+ * Number the given records. A record which already has an ID was registered before, e.g. by
+ * another module of the same image when the section isn't used.
+ */
+void LLTap::CallSites::add(LLTapCallSiteRecord* begin, LLTapCallSiteRecord* end) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (LLTapCallSiteRecord* site = begin; site < end; ++site) {
+    if (site->id == LLTAP_NO_CALL_SITE_ID) {
+      site->id = sites.size();
+      sites.push_back(site);
+    }
+  }
+}
+
+const LLTapCallSiteRecord* LLTap::CallSites::get(unsigned id) {
+  std::lock_guard<std::mutex> guard(lock);
+  return (id < sites.size()) ? sites[id] : nullptr;
+}
+
+unsigned LLTap::CallSites::size() {
+  std::lock_guard<std::mutex> guard(lock);
+  return sites.size();
+}
+
+extern "C" {
+
+__thread const LLTapCallSiteRecord* __lltap_call_site = nullptr;
+
+void __lltap_inst_add_call_sites(LLTapCallSiteRecord* begin, LLTapCallSiteRecord* end) {
+  LLTap::callsites().add(begin, end);
+}
+
+unsigned lltap_num_call_sites(void) {
+  return LLTap::callsites().size();
+}
+
+const LLTapCallSiteRecord* lltap_get_call_site(unsigned id) {
+  return LLTap::callsites().get(id);
+}
+
+}
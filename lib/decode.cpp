@@ -0,0 +1,680 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/**
+ * lltap-decode decodes the trace files of the built-in tracer of the runtime (see
+ * lltap_trace_start()) into ltrace like text, CSV or the trace event JSON of Chrome and Perfetto.
+ * Traces are read in batches, whose events are formatted by several threads in parallel, so the
+ * memory needed doesn't depend on the size of the trace.
+ */
+
+#include <liblltap.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LLTap {
+
+  enum class Format {
+    text,
+    csv,
+    json,
+  };
+
+  /**
+   * How a raw argument word is printed, see the --signatures option of lltaptracergen.
+   */
+  struct ArgType {
+    enum Kind {
+      unknown,
+      none,
+      sint,
+      uint,
+      ptr,
+      f32,
+      f64,
+    };
+
+    Kind kind;
+    unsigned bits;
+  };
+
+  struct Signature {
+    ArgType ret;
+    std::vector<ArgType> args;
+    bool variadic;
+  };
+
+  struct SiteInfo {
+    std::string caller;
+    std::string file;
+    unsigned line;
+    unsigned column;
+  };
+
+  class Decoder {
+
+    public:
+      bool open(const char* path);
+      bool load_target_ids(const char* path);
+      bool load_signatures(const char* path);
+      bool decode(FILE* out, Format format, unsigned jobs);
+
+      ~Decoder() {
+        if (fd != -1) {
+          close(fd);
+        }
+      }
+
+    private:
+      static const size_t BATCH_EVENTS = 1 << 14;
+
+      int fd = -1;
+      LLTapTraceHeader header;
+      unsigned long long num_events = 0;
+      // the trace was not closed, its events end with the first empty one
+      bool incomplete = false;
+      // by target ID and call site ID. Target IDs assigned by the runtime are sparse.
+      std::map<unsigned, std::string> targets;
+      std::vector<SiteInfo> sites;
+      std::map<std::string, Signature> signatures;
+      std::map<unsigned, const Signature*> target_signatures;
+
+      bool load_names(off_t offset, off_t end);
+      bool decode_batch(unsigned long long first, size_t count, Format format,
+          std::string& out, size_t& decoded);
+      void format_event(std::string& out, const LLTapTraceEvent& ev, Format format, bool first);
+      const std::string* target_name(unsigned id);
+      const SiteInfo* site_info(unsigned id);
+  };
+
+  std::vector<std::string> split(const std::string& line, char sep) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+      size_t end = line.find(sep, start);
+      fields.push_back(line.substr(start, end - start));
+      if (end == std::string::npos) {
+        return fields;
+      }
+      start = end + 1;
+    }
+  }
+
+  bool read_lines(const char* path, std::vector<std::string>& lines) {
+    FILE* in = fopen(path, "r");
+    if (in == nullptr) {
+      fprintf(stderr, "lltap-decode: failed to open %s: %s\n", path, strerror(errno));
+      return false;
+    }
+    std::string line;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+      if (c == '\n') {
+        lines.push_back(line);
+        line.clear();
+      } else {
+        line += (char)c;
+      }
+    }
+    if (! line.empty()) {
+      lines.push_back(line);
+    }
+    fclose(in);
+    return true;
+  }
+
+  bool parse_arg_type(const std::string& s, ArgType& type) {
+    type.bits = 64;
+    if (s == "?") {
+      type.kind = ArgType::unknown;
+    } else if (s == "void") {
+      type.kind = ArgType::none;
+    } else if (s == "ptr") {
+      type.kind = ArgType::ptr;
+    } else if (s == "f32") {
+      type.kind = ArgType::f32;
+    } else if (s == "f64") {
+      type.kind = ArgType::f64;
+    } else if (s.size() > 1 && (s[0] == 'i' || s[0] == 'u')) {
+      type.kind = (s[0] == 'i') ? ArgType::sint : ArgType::uint;
+      type.bits = atoi(s.c_str() + 1);
+      if (type.bits == 0 || type.bits > 64) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  void append_format(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+  void append_format(std::string& out, const char* fmt, ...) {
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(buf)) {
+      std::vector<char> big(n + 1);
+      va_start(ap, fmt);
+      vsnprintf(big.data(), big.size(), fmt, ap);
+      va_end(ap);
+      out.append(big.data(), n);
+    } else if (n > 0) {
+      out.append(buf, n);
+    }
+  }
+
+  void append_word(std::string& out, unsigned long long word, const ArgType* type) {
+    switch ((type != nullptr) ? type->kind : ArgType::unknown) {
+      case ArgType::sint: {
+        unsigned shift = 64 - type->bits;
+        append_format(out, "%lld", (long long)(word << shift) >> shift);
+        break;
+      }
+      case ArgType::uint: {
+        unsigned shift = 64 - type->bits;
+        append_format(out, "%llu", (word << shift) >> shift);
+        break;
+      }
+      case ArgType::f32: {
+        uint32_t bits = (uint32_t)word;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        append_format(out, "%g", f);
+        break;
+      }
+      case ArgType::f64: {
+        double d;
+        memcpy(&d, &word, sizeof(d));
+        append_format(out, "%g", d);
+        break;
+      }
+      default:
+        append_format(out, "0x%llx", word);
+        break;
+    }
+  }
+
+  void append_csv(std::string& out, const std::string& s) {
+    if (s.find_first_of(",\"\n") == std::string::npos) {
+      out += s;
+      return;
+    }
+    out += '"';
+    for (char c : s) {
+      if (c == '"') {
+        out += '"';
+      }
+      out += c;
+    }
+    out += '"';
+  }
+
+  void append_json(std::string& out, const std::string& s) {
+    out += '"';
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if ((unsigned char)c < 0x20) {
+        append_format(out, "\\u%04x", (unsigned)c);
+      } else {
+        out += c;
+      }
+    }
+    out += '"';
+  }
+}
+
+/**
+ * Decoder implementation
+ */
+
+const size_t LLTap::Decoder::BATCH_EVENTS;
+
+bool LLTap::Decoder::open(const char* path) {
+  fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "lltap-decode: failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || memcmp(header.magic, LLTAP_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "lltap-decode: %s is not a LLTap trace\n", path);
+    return false;
+  }
+  if (header.version != LLTAP_TRACE_VERSION || header.event_size < sizeof(LLTapTraceEvent)) {
+    fprintf(stderr, "lltap-decode: unsupported trace version %u with events of %u bytes\n",
+        header.version, header.event_size);
+    return false;
+  }
+
+  unsigned long long in_file = (st.st_size - sizeof(header)) / header.event_size;
+  if (header.names_offset == 0) {
+    fprintf(stderr, "lltap-decode: %s is incomplete, names are missing\n", path);
+    incomplete = true;
+    num_events = in_file;
+    return true;
+  }
+  num_events = header.num_events;
+  if (header.names_offset < sizeof(header) + num_events * header.event_size
+      || header.names_offset > (unsigned long long)st.st_size) {
+    fprintf(stderr, "lltap-decode: %s is truncated, names are missing\n", path);
+    num_events = std::min(num_events, in_file);
+    return true;
+  }
+  return load_names(header.names_offset, st.st_size);
+}
+
+bool LLTap::Decoder::load_names(off_t offset, off_t end) {
+  std::string names(end - offset, '\0');
+  if (pread(fd, &names[0], names.size(), offset) != (ssize_t)names.size()) {
+    fprintf(stderr, "lltap-decode: failed to read the names: %s\n", strerror(errno));
+    return false;
+  }
+
+  for (const std::string& line : split(names, '\n')) {
+    // the block ends with a newline
+    if (line.empty()) {
+      continue;
+    }
+    std::vector<std::string> fields = split(line, '\t');
+    if (fields.size() == 3 && fields[0] == "target") {
+      targets[strtoul(fields[1].c_str(), nullptr, 10)] = fields[2];
+    } else if (fields.size() == 7 && fields[0] == "site") {
+      unsigned id = strtoul(fields[1].c_str(), nullptr, 10);
+      if (id >= sites.size()) {
+        sites.resize(id + 1);
+      }
+      sites[id] = SiteInfo{fields[3], fields[4], (unsigned)strtoul(fields[5].c_str(), nullptr, 10),
+        (unsigned)strtoul(fields[6].c_str(), nullptr, 10)};
+    }
+  }
+  return true;
+}
+
+/**
+ * Names of the targets missing from the trace, from the -target-ids file of the pass, which has
+ * the name of the target with ID n on line n.
+ */
+bool LLTap::Decoder::load_target_ids(const char* path) {
+  std::vector<std::string> lines;
+  if (! read_lines(path, lines)) {
+    return false;
+  }
+  for (size_t id = 0; id < lines.size(); ++id) {
+    // a trace has names for every target, but not an incomplete one
+    targets.insert(std::make_pair((unsigned)id, lines[id]));
+  }
+  return true;
+}
+
+/**
+ * Argument types written by lltaptracergen --signatures, one target per line:
+ * <name> <return type> <argument types...> with tab separated fields.
+ */
+bool LLTap::Decoder::load_signatures(const char* path) {
+  std::vector<std::string> lines;
+  if (! read_lines(path, lines)) {
+    return false;
+  }
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (lines[i].empty() || lines[i][0] == '#') {
+      continue;
+    }
+    std::vector<std::string> fields = split(lines[i], '\t');
+    Signature sig;
+    sig.variadic = false;
+    bool valid = (fields.size() >= 2) && parse_arg_type(fields[1], sig.ret);
+    for (size_t f = 2; valid && f < fields.size(); ++f) {
+      if (fields[f] == "..." && f == fields.size() - 1) {
+        sig.variadic = true;
+      } else {
+        ArgType type;
+        valid = parse_arg_type(fields[f], type);
+        sig.args.push_back(type);
+      }
+    }
+    if (! valid) {
+      fprintf(stderr, "lltap-decode: %s:%zu: invalid signature\n", path, i + 1);
+      return false;
+    }
+    signatures[fields[0]] = sig;
+  }
+  return true;
+}
+
+const std::string* LLTap::Decoder::target_name(unsigned id) {
+  auto it = targets.find(id);
+  return (it != targets.end()) ? &it->second : nullptr;
+}
+
+const LLTap::SiteInfo* LLTap::Decoder::site_info(unsigned id) {
+  return (id < sites.size() && ! sites[id].caller.empty()) ? &sites[id] : nullptr;
+}
+
+/**
+ * Decode the trace in batches of BATCH_EVENTS events per job. Every job reads and formats its
+ * part of the batch, which are written in order, so the events of every thread stay in order.
+ */
+bool LLTap::Decoder::decode(FILE* out, Format format, unsigned jobs) {
+  target_signatures.clear();
+  for (auto& target : targets) {
+    auto it = signatures.find(target.second);
+    if (it != signatures.end()) {
+      target_signatures[target.first] = &it->second;
+    }
+  }
+
+  if (format == Format::csv) {
+    fprintf(out, "thread_id,start_ns,end_ns,target_id,target,call_site_id,caller,file,line,"
+        "column,nargs");
+    for (unsigned i = 0; i < LLTAP_TRACE_MAX_ARGS; ++i) {
+      fprintf(out, ",arg%u", i);
+    }
+    fprintf(out, ",ret\n");
+  } else if (format == Format::json) {
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  }
+
+  std::vector<std::string> outs(jobs);
+  std::vector<size_t> decoded(jobs);
+  std::vector<char> ok(jobs);
+  bool done = false;
+  for (unsigned long long first = 0; first < num_events && ! done;
+      first += jobs * BATCH_EVENTS) {
+    std::vector<std::thread> workers;
+    for (unsigned j = 0; j < jobs; ++j) {
+      unsigned long long start = first + j * BATCH_EVENTS;
+      size_t count = (start < num_events)
+        ? (size_t)std::min((unsigned long long)BATCH_EVENTS, num_events - start) : 0;
+      outs[j].clear();
+      workers.emplace_back([this, j, start, count, format, &outs, &decoded, &ok]() {
+        ok[j] = decode_batch(start, count, format, outs[j], decoded[j]);
+      });
+    }
+    for (std::thread& w : workers) {
+      w.join();
+    }
+
+    for (unsigned j = 0; j < jobs && ! done; ++j) {
+      if (! ok[j]) {
+        return false;
+      }
+      fwrite(outs[j].data(), 1, outs[j].size(), out);
+      // the rest of an incomplete trace was never written
+      done = (decoded[j] < BATCH_EVENTS);
+    }
+  }
+
+  if (format == Format::json) {
+    fprintf(out, "\n]}\n");
+  }
+  if (ferror(out) != 0) {
+    fprintf(stderr, "lltap-decode: failed to write the output\n");
+    return false;
+  }
+  return true;
+}
+
+bool LLTap::Decoder::decode_batch(unsigned long long first, size_t count, Format format,
+    std::string& out, size_t& decoded) {
+  decoded = 0;
+  if (count == 0) {
+    return true;
+  }
+
+  std::vector<char> buf(count * header.event_size);
+  off_t offset = sizeof(LLTapTraceHeader) + first * header.event_size;
+  ssize_t n = pread(fd, buf.data(), buf.size(), offset);
+  if (n != (ssize_t)buf.size()) {
+    fprintf(stderr, "lltap-decode: failed to read events: %s\n",
+        (n < 0) ? strerror(errno) : "unexpected end of file");
+    return false;
+  }
+
+  out.reserve(count * 96);
+  for (size_t i = 0; i < count; ++i) {
+    LLTapTraceEvent ev;
+    memcpy(&ev, buf.data() + i * header.event_size, sizeof(ev));
+    if (incomplete && ev.end == 0) {
+      break;
+    }
+    format_event(out, ev, format, first + i == 0);
+    ++decoded;
+  }
+  return true;
+}
+
+void LLTap::Decoder::format_event(std::string& out, const LLTapTraceEvent& ev, Format format,
+    bool first) {
+  const std::string* name = target_name(ev.target_id);
+  std::string unknown;
+  if (name == nullptr) {
+    unknown = "target#" + std::to_string(ev.target_id);
+    name = &unknown;
+  }
+  auto found = target_signatures.find(ev.target_id);
+  const Signature* sig = (found != target_signatures.end()) ? found->second : nullptr;
+  const SiteInfo* site = site_info(ev.call_site_id);
+  unsigned nargs = std::min(ev.nargs, (unsigned)LLTAP_TRACE_MAX_ARGS);
+  const ArgType* rettype = (sig != nullptr) ? &sig->ret : nullptr;
+  auto argtype = [sig](unsigned i) -> const ArgType* {
+    return (sig != nullptr && i < sig->args.size()) ? &sig->args[i] : nullptr;
+  };
+
+  switch (format) {
+    case Format::text:
+      append_format(out, "[%u] %llu.%09llu ", ev.thread_id, ev.start / 1000000000ull,
+          ev.start % 1000000000ull);
+      out += *name;
+      out += '(';
+      for (unsigned i = 0; i < nargs; ++i) {
+        if (i > 0) {
+          out += ", ";
+        }
+        append_word(out, ev.args[i], argtype(i));
+      }
+      if (sig != nullptr && (sig->variadic || sig->args.size() > nargs)) {
+        out += (nargs > 0) ? ", ..." : "...";
+      }
+      out += ')';
+      if (rettype == nullptr || rettype->kind != ArgType::none) {
+        out += " = ";
+        append_word(out, ev.ret, rettype);
+      }
+      append_format(out, " <%llu.%09llu>", (ev.end - ev.start) / 1000000000ull,
+          (ev.end - ev.start) % 1000000000ull);
+      if (site != nullptr) {
+        out += " from " + site->caller;
+        if (! site->file.empty()) {
+          append_format(out, " %s:%u:%u", site->file.c_str(), site->line, site->column);
+        }
+      }
+      out += '\n';
+      break;
+
+    case Format::csv:
+      append_format(out, "%u,%llu,%llu,%u,", ev.thread_id, ev.start, ev.end, ev.target_id);
+      append_csv(out, *name);
+      if (site != nullptr) {
+        append_format(out, ",%u,", ev.call_site_id);
+        append_csv(out, site->caller);
+        out += ',';
+        append_csv(out, site->file);
+        append_format(out, ",%u,%u", site->line, site->column);
+      } else {
+        out += ",,,,,";
+      }
+      append_format(out, ",%u", nargs);
+      for (unsigned i = 0; i < LLTAP_TRACE_MAX_ARGS; ++i) {
+        out += ',';
+        if (i < nargs) {
+          append_word(out, ev.args[i], argtype(i));
+        }
+      }
+      out += ',';
+      append_word(out, ev.ret, rettype);
+      out += '\n';
+      break;
+
+    case Format::json: {
+      // complete events with the times in microseconds
+      if (! first) {
+        out += ",\n";
+      }
+      out += "{\"name\":";
+      append_json(out, *name);
+      append_format(out, ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%llu.%03llu,"
+          "\"dur\":%llu.%03llu,\"args\":{\"args\":[", ev.thread_id, ev.start / 1000,
+          ev.start % 1000, (ev.end - ev.start) / 1000, (ev.end - ev.start) % 1000);
+      for (unsigned i = 0; i < nargs; ++i) {
+        if (i > 0) {
+          out += ',';
+        }
+        std::string word;
+        append_word(word, ev.args[i], argtype(i));
+        append_json(out, word);
+      }
+      out += "],\"ret\":";
+      std::string word;
+      append_word(word, ev.ret, rettype);
+      append_json(out, word);
+      if (site != nullptr) {
+        std::string where = site->caller;
+        if (! site->file.empty()) {
+          where += " " + site->file + ":" + std::to_string(site->line) + ":"
+            + std::to_string(site->column);
+        }
+        out += ",\"site\":";
+        append_json(out, where);
+      }
+      out += "}}";
+      break;
+    }
+  }
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+      "Usage: %s [options] <trace file>\n"
+      "\n"
+      "Decodes a trace of the built-in tracer of the LLTap runtime.\n"
+      "\n"
+      "  -f, --format=text|csv|json  output format, json is the Chrome/Perfetto trace event\n"
+      "                              format (default: text)\n"
+      "  -o, --output=<file>         write to the file instead of stdout\n"
+      "  -j, --jobs=<n>              decode with n threads (default: number of CPUs)\n"
+      "  -s, --signatures=<file>     argument types from lltaptracergen --signatures\n"
+      "  -t, --target-ids=<file>     names of targets missing from the trace, from the\n"
+      "                              -target-ids file of the pass\n",
+      argv0);
+}
+
+int main(int argc, char** argv) {
+  static const struct option options[] = {
+    {"format", required_argument, nullptr, 'f'},
+    {"output", required_argument, nullptr, 'o'},
+    {"jobs", required_argument, nullptr, 'j'},
+    {"signatures", required_argument, nullptr, 's'},
+    {"target-ids", required_argument, nullptr, 't'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0},
+  };
+
+  LLTap::Format format = LLTap::Format::text;
+  const char* output = nullptr;
+  const char* signatures = nullptr;
+  const char* target_ids = nullptr;
+  unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:o:j:s:t:h", options, nullptr)) != -1) {
+    switch (opt) {
+      case 'f':
+        if (strcmp(optarg, "text") == 0) {
+          format = LLTap::Format::text;
+        } else if (strcmp(optarg, "csv") == 0) {
+          format = LLTap::Format::csv;
+        } else if (strcmp(optarg, "json") == 0) {
+          format = LLTap::Format::json;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'j':
+        jobs = std::max(atoi(optarg), 1);
+        break;
+      case 's':
+        signatures = optarg;
+        break;
+      case 't':
+        target_ids = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  LLTap::Decoder decoder;
+  if (! decoder.open(argv[optind])
+      || (target_ids != nullptr && ! decoder.load_target_ids(target_ids))
+      || (signatures != nullptr && ! decoder.load_signatures(signatures))) {
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (output != nullptr) {
+    out = fopen(output, "w");
+    if (out == nullptr) {
+      fprintf(stderr, "lltap-decode: failed to create %s: %s\n", output, strerror(errno));
+      return 1;
+    }
+  }
+  bool ok = decoder.decode(out, format, jobs);
+  if (out != stdout) {
+    ok = (fclose(out) == 0) && ok;
+  }
+  return ok ? 0 : 1;
+}
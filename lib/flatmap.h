@@ -0,0 +1,211 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LLTAP_FLATMAP_H
+#define LLTAP_FLATMAP_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace LLTap {
+
+  /**
+   * Hash map with open addressing and linear probing. All entries are stored inline in a single
+   * contiguous array, so a lookup usually touches only one or two cache lines. A default
+   * constructed key marks an empty bucket, so it can't be used as key itself.
+   *
+   * Traits must provide
+   *   static size_t hash(const L& key);
+   *   static bool equal(const K& key, const L& other);
+   * for every type L used to look up keys.
+   */
+  template<typename K, typename V, typename Traits>
+  class FlatMap {
+
+    public:
+      struct entry {
+        K key;
+        V value;
+      };
+
+      FlatMap() : entries(MIN_CAPACITY), count(0) {}
+
+      template<typename L>
+      V* find(const L& key) {
+        size_t i = lookup(key);
+        return (i == NOT_FOUND) ? nullptr : &entries[i].value;
+      }
+
+      template<typename L>
+      const V* find(const L& key) const {
+        size_t i = lookup(key);
+        return (i == NOT_FOUND) ? nullptr : &entries[i].value;
+      }
+
+      /**
+       * Returns the value of the given key and inserts a value initialized one if the key isn't
+       * in the map yet.
+       */
+      template<typename L>
+      V& operator[](const L& key) {
+        size_t i = lookup(key);
+        if (i != NOT_FOUND) {
+          return entries[i].value;
+        }
+
+        if ((count + 1) * 2 > entries.size()) {
+          grow();
+        }
+        i = Traits::hash(key) & mask();
+        while (! is_empty(entries[i])) {
+          i = (i + 1) & mask();
+        }
+        entries[i].key = K(key);
+        count++;
+        return entries[i].value;
+      }
+
+      /**
+       * Remove the key by shifting back the following entries of its probe sequence, so no
+       * tombstones are needed.
+       */
+      template<typename L>
+      bool erase(const L& key) {
+        size_t i = lookup(key);
+        if (i == NOT_FOUND) {
+          return false;
+        }
+
+        size_t j = i;
+        while (true) {
+          j = (j + 1) & mask();
+          if (is_empty(entries[j])) {
+            break;
+          }
+          size_t home = Traits::hash(entries[j].key) & mask();
+          // move the entry unless its home bucket lies cyclically in (i, j]
+          bool in_between = (i < j) ? (i < home && home <= j) : (i < home || home <= j);
+          if (! in_between) {
+            entries[i] = std::move(entries[j]);
+            i = j;
+          }
+        }
+        entries[i] = entry();
+        count--;
+        return true;
+      }
+
+      size_t size() const {
+        return count;
+      }
+
+      template<typename Fn>
+      void for_each(Fn fn) {
+        for (entry& e : entries) {
+          if (! is_empty(e)) {
+            fn(e.key, e.value);
+          }
+        }
+      }
+
+    private:
+      static const size_t MIN_CAPACITY = 16;
+      static const size_t NOT_FOUND = SIZE_MAX;
+
+      std::vector<entry> entries;
+      size_t count;
+
+      size_t mask() const {
+        return entries.size() - 1;
+      }
+
+      static bool is_empty(const entry& e) {
+        return e.key == K();
+      }
+
+      template<typename L>
+      size_t lookup(const L& key) const {
+        size_t i = Traits::hash(key) & mask();
+        while (! is_empty(entries[i])) {
+          if (Traits::equal(entries[i].key, key)) {
+            return i;
+          }
+          i = (i + 1) & mask();
+        }
+        return NOT_FOUND;
+      }
+
+      void grow() {
+        std::vector<entry> old(entries.size() * 2);
+        old.swap(entries);
+        for (entry& e : old) {
+          if (! is_empty(e)) {
+            size_t i = Traits::hash(e.key) & mask();
+            while (! is_empty(entries[i])) {
+              i = (i + 1) & mask();
+            }
+            entries[i] = std::move(e);
+          }
+        }
+      }
+  };
+
+  /**
+   * Function addresses are at least 2 byte aligned and close to each other, so the low bits carry
+   * almost no information. Fibonacci hashing folds the high bits of the product back into them.
+   */
+  struct AddrTraits {
+    static size_t hash(void* key) {
+      uint64_t h = (uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull;
+      return (size_t)(h ^ (h >> 32));
+    }
+
+    static bool equal(void* key, void* other) {
+      return key == other;
+    }
+  };
+
+  /**
+   * FNV-1a on the target names, which can be looked up with a plain C string.
+   */
+  struct NameTraits {
+    static size_t hash(const char* key) {
+      uint64_t h = 0xcbf29ce484222325ull;
+      for (; *key != '\0'; ++key) {
+        h = (h ^ (unsigned char)*key) * 0x100000001b3ull;
+      }
+      return (size_t)h;
+    }
+
+    static size_t hash(const std::string& key) {
+      return hash(key.c_str());
+    }
+
+    static bool equal(const std::string& key, const char* other) {
+      return strcmp(key.c_str(), other) == 0;
+    }
+
+    static bool equal(const std::string& key, const std::string& other) {
+      return key == other;
+    }
+  };
+}
+
+#endif // LLTAP_FLATMAP_H
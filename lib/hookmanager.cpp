@@ -17,15 +17,37 @@
 
 #include <liblltap.h>
 
-#include <map>
+#include "flatmap.h"
+#include "tracer.h"
+
+#include <algorithm>
 #include <list>
+#include <memory>
+#include <vector>
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+#include <new>
 #include <mutex>
+#include <atomic>
 #include <thread>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 
 using namespace std;
 
+/**
+ * Registries are compared by value when they are interned, see HookManager::intern.
+ */
+static bool operator==(const LLTapHookRegistry& a, const LLTapHookRegistry& b) {
+  return a.bitmap == b.bitmap && a.pre_hook == b.pre_hook && a.replace_hook == b.replace_hook
+    && a.post_hook == b.post_hook && a.target_id == b.target_id;
+}
+
 namespace LLTap {
 
   enum class LogLevel {
@@ -35,40 +57,246 @@ namespace LLTap {
     DEBUG,
   };
 
-  struct hook_registry {
-    LLTapHook pre_hook = nullptr;
-    LLTapHook replace_hook = nullptr;
-    LLTapHook post_hook = nullptr;
+  typedef LLTapHookRegistry hook_registry;
+
+  /**
+   * One version of the hooks of all targets, which maps every target with hooks to its interned
+   * registry. A hook_table is never modified after it was published, so the lookup path can use it
+   * without any synchronization. Readers only hold it inside a reader_section though, so retired
+   * versions can be released.
+   */
+  typedef FlatMap<void*, const hook_registry*, AddrTraits> hook_table;
+
+  struct RegistryTraits {
+    static size_t hash(const hook_registry& hr) {
+      size_t h = AddrTraits::hash((void*)hr.pre_hook) ^ (AddrTraits::hash((void*)hr.post_hook) << 1)
+        ^ (AddrTraits::hash((void*)hr.replace_hook) << 2);
+      return h ^ ((size_t)hr.target_id * 0x9E3779B97F4A7C15ull) ^ (size_t)hr.bitmap;
+    }
+
+    static bool equal(const hook_registry& key, const hook_registry& other) {
+      return key == other;
+    }
+  };
+
+  /**
+   * Announces the epoch of the hook table, in which a thread started reading it, or 0 while the
+   * thread reads no hook table. Every thread has its own record, so readers never write to a
+   * shared cache line. Records are never released, but reused by later threads.
+   */
+  struct alignas(64) reader_record {
+    atomic<unsigned long long> epoch{0};
+    atomic<bool> in_use{true};
+    reader_record* next = nullptr;
+  };
+
+  // all records ever created, new ones are pushed to the front
+  atomic<reader_record*> reader_records{nullptr};
+
+  __thread reader_record* reader __attribute__((tls_model("initial-exec"))) = nullptr;
+
+  /**
+   * Hands the record of an exiting thread to the next new one.
+   */
+  struct ReaderRecordOwner {
+    reader_record* rec = nullptr;
+
+    ~ReaderRecordOwner() {
+      if (rec != nullptr) {
+        reader = nullptr;
+        rec->in_use.store(false, memory_order_release);
+      }
+    }
+  };
+
+  thread_local ReaderRecordOwner reader_owner;
+
+  reader_record* get_reader_record() {
+    if (reader != nullptr) {
+      return reader;
+    }
+
+    reader_record* rec = reader_records.load(memory_order_acquire);
+    for (; rec != nullptr; rec = rec->next) {
+      bool unused = false;
+      if (! rec->in_use.load(memory_order_relaxed)
+          && rec->in_use.compare_exchange_strong(unused, true, memory_order_acquire)) {
+        break;
+      }
+    }
+    if (rec == nullptr) {
+      // operator new ignores the alignment before C++17
+      void* mem = nullptr;
+      if (posix_memalign(&mem, alignof(reader_record), sizeof(reader_record)) != 0) {
+        abort();
+      }
+      rec = new (mem) reader_record();
+      rec->next = reader_records.load(memory_order_relaxed);
+      while (! reader_records.compare_exchange_weak(rec->next, rec, memory_order_release)) {
+      }
+    }
+    reader = rec;
+    reader_owner.rec = rec;
+    return rec;
+  }
+
+  /**
+   * Marks the calling thread as reading the hook table while it exists. The table must be loaded
+   * after the section was entered. Sections nest, e.g. in a signal handler, and keep the epoch of
+   * the outermost one.
+   */
+  class reader_section {
+
+    public:
+      explicit reader_section(const atomic<unsigned long long>& epoch)
+        : rec(get_reader_record()), prev(rec->epoch.load(memory_order_relaxed)) {
+        if (prev == 0) {
+          // seq_cst orders the store before the load of the hook table
+          rec->epoch.store(epoch.load(memory_order_seq_cst), memory_order_seq_cst);
+        }
+      }
+
+      ~reader_section() {
+        rec->epoch.store(prev, memory_order_release);
+      }
+
+    private:
+      reader_record* rec;
+      unsigned long long prev;
+  };
+
+  /**
+   * An indirectly called address. Its slot is kept up to date like the dispatch slots of the
+   * instrumentation, unless the target calls its hooks itself. Never freed, as inline caches may
+   * refer to it at any time.
+   */
+  struct indirect_entry {
+    LLTapIndirectTarget target;
+    atomic<bool> hooked_at_entry{false};
+
+    explicit indirect_entry(void* addr) : target{addr, nullptr} {}
+  };
+
+  /**
+   * Open addressing table of the indirect_entries, which is only ever inserted into. Threads claim
+   * an empty bucket with a CAS, so neither lookups nor inserts take a lock. Once it is half full,
+   * a writer copies it into a table twice the size and seals every empty bucket of the old one,
+   * which makes inserts that race with the copy retry in the new table.
+   */
+  struct indirect_table {
+    size_t mask;
+    atomic<size_t> count{0};
+    unique_ptr<atomic<indirect_entry*>[]> buckets;
+
+    explicit indirect_table(size_t capacity)
+      : mask(capacity - 1), buckets(new atomic<indirect_entry*>[capacity]()) {}
+  };
+
+  // marks the buckets of an indirect_table which was copied into a larger one
+  indirect_entry sealed_bucket(nullptr);
+
+  template<typename Table>
+  struct retired_table {
+    const Table* table;
+    // the epoch, which was current when the table was replaced
+    unsigned long long epoch;
+  };
+
+  /**
+   * A patchable sled emitted by the instrumentation pass. It starts with a 5 byte NOP, which is
+   * replaced by a jmp to the dispatcher while hooks are installed for the target.
+   */
+  struct sled_info {
+    void* sled;
+    void* dispatcher;
   };
 
   class HookManager {
 
     public:
       bool add_hook(char* target, LLTapHook hook, LLTapHookType type);
+      bool add_hook(unsigned id, LLTapHook hook, LLTapHookType type);
+      bool add_hooks(LLTapHookInfo* infos);
       void add_target(char* name, void* target);
+      void add_slot(char* name, void* target, LLTapHookSlot* slot);
+      void add_targets(LLTapTargetRecord* begin, LLTapTargetRecord* end);
+      const LLTapIndirectTarget* lookup_indirect(void* addr, const LLTapIndirectTarget** cache,
+          unsigned size);
       LLTapHook get_hook(void* target, LLTapHookType type);
+      const hook_registry* get_hooks(void* target);
       int get_hook_bitmap(void* target);
       void remove_hook(char* name, LLTapHookType type);
-
-      ~HookManager() {
-        if (hooks != nullptr)
-          delete hooks;
-        if (functions != nullptr)
-          delete functions;
-      }
+      void remove_hook(unsigned id, LLTapHookType type);
+      bool start_trace(const char* path);
+      void stop_trace();
+      void shutdown();
 
       HookManager() {
         check_loglevel();
+        check_trace();
       }
 
     private:
-      map<void*, hook_registry>* hooks = nullptr;
-      map<string, void*>* functions = nullptr;
+      // the current version of the hook table. Readers only ever load this pointer.
+      atomic<const hook_table*> hooks{nullptr};
+      // incremented whenever a version is replaced, starts at 1 as 0 marks an idle reader_record
+      atomic<unsigned long long> epoch{1};
+      // versions replaced by a newer one, which may still be used by a reader_section
+      list<retired_table<hook_table>> retired;
+      // one registry for every combination of hooks, see intern
+      FlatMap<hook_registry, const hook_registry*, RegistryTraits> registries;
+      FlatMap<string, void*, NameTraits> functions;
+      // indexed by the target IDs assigned by the instrumentation pass
+      vector<void*> targets_by_id;
+      // the IDs of the pass, or one from LLTAP_FIRST_RUNTIME_TARGET_ID on for targets without
+      FlatMap<void*, unsigned, AddrTraits> target_ids;
+      unsigned next_runtime_id = LLTAP_FIRST_RUNTIME_TARGET_ID;
+      // the dispatch slots of every target, which mirror the current version of the hook table
+      FlatMap<void*, list<LLTapHookSlot*>, AddrTraits> slots;
+      // the patchable sleds of every target, which are enabled while it has hooks
+      FlatMap<void*, list<sled_info>, AddrTraits> sleds;
+      // the entries of indirectly called addresses
+      atomic<indirect_table*> indirect_targets{new indirect_table(64)};
+      // tables replaced by a larger one, released like the retired hook tables
+      list<retired_table<indirect_table>> retired_indirect;
+      // sections of target records, which were not yet added to functions and slots
+      list<pair<LLTapTargetRecord*, LLTapTargetRecord*>> pending_targets;
+      // start of every target record section seen so far
+      FlatMap<void*, bool, AddrTraits> target_sections;
+
+      // all targets are marked as LLTAP_TRACED, see start_trace
+      bool traced = false;
 
+      // serializes the writers, never taken on the lookup path
       mutex hm_mutex;
 
       LogLevel loglevel = LogLevel::ERROR;
 
+      hook_table* copy_hooks();
+      void publish(hook_table* next);
+      void reclaim();
+      indirect_entry* find_indirect(void* addr);
+      indirect_entry* insert_indirect(void* addr, bool& inserted);
+      indirect_entry* add_indirect(void* addr, bool locked);
+      void grow_indirect();
+      void init_indirect_slot(indirect_entry* entry);
+      const hook_registry* intern(const hook_registry& hr);
+      void update_slots(const hook_table* table, void* target);
+      void add_target_slot(void* target, LLTapHookSlot* slot);
+      void add_sled(void* target, void* sled, void* dispatcher);
+      bool patch_sled(const sled_info& s, bool enable);
+      hook_registry registry(const hook_table& table, void* target);
+      void set_registry(hook_table& table, void* target, const hook_registry& hr);
+      bool set_hook(hook_table& table, void* target, LLTapHook hook, LLTapHookType type);
+      void set_traced(const list<void*>& targets);
+      vector<pair<unsigned, string>> trace_targets();
+      bool install_hook(void* target, LLTapHook hook, LLTapHookType type);
+      void uninstall_hook(void* target, LLTapHookType type);
+      void* resolve_target(char* name);
+      void* resolve_target(unsigned id);
+      void register_target(char* name, void* target, unsigned id = LLTAP_NO_TARGET_ID);
+      void load_pending_targets();
+
       void check_loglevel() {
         char* x = getenv("LLTAP_LOGLEVEL");
         if (x != nullptr) {
@@ -84,76 +312,440 @@ namespace LLTap {
           }
         }
       }
+
+      void check_trace() {
+        char* path = getenv("LLTAP_TRACE");
+        if (path != nullptr && *path != '\0') {
+          start_trace(path);
+        }
+      }
+  };
+
+  /**
+   * Instrumented code may still look up hooks from destructors which run after ours, so the
+   * manager is never destroyed. At exit the hooks are only removed, see HookManager::shutdown.
+   */
+  HookManager& hookmanager = *new HookManager();
+
+  struct HookManagerShutdown {
+    ~HookManagerShutdown() {
+      hookmanager.shutdown();
+    }
   };
 
-  HookManager hookmanager;
+  HookManagerShutdown hookmanager_shutdown;
 }
 
 /**
  * HookManager implementation
  */
 
-bool LLTap::HookManager::add_hook(char* target, LLTapHook hook, LLTapHookType type) {
-  lock_guard<std::mutex> lock(hm_mutex);
+/**
+ * Create a private copy of the current hook table, which can be modified by a writer and then
+ * handed to \ref publish. Must be called with hm_mutex held.
+ */
+LLTap::hook_table* LLTap::HookManager::copy_hooks() {
+  const hook_table* current = hooks.load(memory_order_relaxed);
+  if (current == nullptr) {
+    return new hook_table();
+  }
+  return new hook_table(*current);
+}
+
+/**
+ * Make the given table the current version. Readers which already loaded the previous version may
+ * still use it, so it is retired instead of deleted. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::publish(hook_table* next) {
+  const hook_table* prev = hooks.exchange(next, memory_order_seq_cst);
+  if (prev != nullptr) {
+    retired.push_back(retired_table<hook_table>{prev, epoch.fetch_add(1, memory_order_seq_cst)});
+  }
+  reclaim();
+}
+
+/**
+ * Release the retired versions, which no reader_section can use anymore. A reader which entered
+ * its section in epoch e may have loaded every version retired in e or later, but none retired
+ * before. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::reclaim() {
+  unsigned long long oldest = ULLONG_MAX;
+  for (reader_record* rec = reader_records.load(memory_order_acquire); rec != nullptr;
+      rec = rec->next) {
+    unsigned long long e = rec->epoch.load(memory_order_seq_cst);
+    if (e != 0 && e < oldest) {
+      oldest = e;
+    }
+  }
+
+  retired.remove_if([oldest](const retired_table<hook_table>& r) {
+    if (r.epoch >= oldest) {
+      return false;
+    }
+    delete r.table;
+    return true;
+  });
+  retired_indirect.remove_if([oldest](const retired_table<indirect_table>& r) {
+    if (r.epoch >= oldest) {
+      return false;
+    }
+    delete r.table;
+    return true;
+  });
+}
+
+/**
+ * Returns the registry with the given hooks. The dispatch slots point to registries and the
+ * instrumentation uses them until the target returns, which no reader_section covers. So they are
+ * never released, but shared by all versions of the hook table: toggling hooks reuses the
+ * registries of the combinations seen before and only new combinations of hooks take memory.
+ * Must be called with hm_mutex held.
+ */
+const LLTap::hook_registry* LLTap::HookManager::intern(const hook_registry& hr) {
+  const hook_registry*& interned = registries[hr];
+  if (interned == nullptr) {
+    interned = new hook_registry(hr);
+  }
+  return interned;
+}
+
+/**
+ * Point all dispatch slots of the given target to its registry in the given table, or to NULL if
+ * there are no hooks left. The sleds of the target are patched accordingly. Must be called with
+ * hm_mutex held.
+ */
+void LLTap::HookManager::update_slots(const hook_table* table, void* target) {
+  const hook_registry* hr = nullptr;
+  if (table != nullptr) {
+    const hook_registry* const* found = table->find(target);
+    hr = (found != nullptr) ? *found : nullptr;
+  }
+
+  list<LLTapHookSlot*>* target_slots = slots.find(target);
+  if (target_slots != nullptr) {
+    for (LLTapHookSlot* slot : *target_slots) {
+      __atomic_store_n(slot, hr, __ATOMIC_RELEASE);
+    }
+  }
+  // an entry inserted concurrently initializes its slot itself, see init_indirect_slot
+  indirect_entry* entry = find_indirect(target);
+  if (entry != nullptr && ! entry->hooked_at_entry.load(memory_order_seq_cst)) {
+    __atomic_store_n(&entry->target.slot, hr, __ATOMIC_SEQ_CST);
+  }
+
+  // the slots are set before the sleds are enabled, so the dispatcher never sees stale hooks
+  list<sled_info>* target_sleds = sleds.find(target);
+  if (target_sleds != nullptr) {
+    for (const sled_info& s : *target_sleds) {
+      patch_sled(s, hr != nullptr);
+    }
+  }
+
+  // after the slots: a versioned loop, which still read the previous generation, caches what it
+  // saw in the slots only under that generation and checks them again on its next entry
+  __atomic_add_fetch(&__lltap_hook_generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::add_target_slot(void* target, LLTapHookSlot* slot) {
+  list<LLTapHookSlot*>& target_slots = slots[target];
+  // slots of non-local targets are shared by all modules of a linked image
+  for (LLTapHookSlot* s : target_slots) {
+    if (s == slot) {
+      return;
+    }
+  }
+  target_slots.push_back(slot);
+}
+
+/**
+ * Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::add_sled(void* target, void* sled, void* dispatcher) {
+  list<sled_info>& target_sleds = sleds[target];
+  // every module which calls the target references the same sled
+  for (const sled_info& s : target_sleds) {
+    if (s.sled == sled) {
+      return;
+    }
+  }
+  target_sleds.push_back(sled_info{sled, dispatcher});
+}
+
+/**
+ * Replace the NOP at the start of the sled with a jmp to the dispatcher or restore it. The sled is
+ * 8 byte aligned, so the instruction is replaced by a single atomic store and other threads either
+ * execute the old or the new one. Must be called with hm_mutex held.
+ */
+bool LLTap::HookManager::patch_sled(const sled_info& s, bool enable) {
+#if defined(__x86_64__) && defined(__linux__)
+  static const uint8_t nop5[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+  uint8_t* sled = (uint8_t*)s.sled;
+
+  if (((uintptr_t)sled & 7) != 0) {
+    if (loglevel >= LogLevel::ERROR) {
+      fprintf(stderr, "[LLTAP-RT] Sled at (%p) is not aligned\n", s.sled);
+    }
+    return false;
+  }
+
+  uint64_t word = __atomic_load_n((uint64_t*)sled, __ATOMIC_RELAXED);
+  uint8_t bytes[8];
+  memcpy(bytes, &word, sizeof(bytes));
+  if (enable) {
+    intptr_t disp = (intptr_t)s.dispatcher - (intptr_t)(sled + 5);
+    if (disp < INT32_MIN || disp > INT32_MAX) {
+      if (loglevel >= LogLevel::ERROR) {
+        fprintf(stderr, "[LLTAP-RT] Dispatcher (%p) out of range of sled (%p)\n",
+            s.dispatcher, s.sled);
+      }
+      return false;
+    }
+    int32_t rel = (int32_t)disp;
+    bytes[0] = 0xe9;
+    memcpy(&bytes[1], &rel, sizeof(rel));
+  } else {
+    memcpy(bytes, nop5, sizeof(nop5));
+  }
+  uint64_t patched;
+  memcpy(&patched, bytes, sizeof(patched));
+  if (patched == word) {
+    return true;
+  }
+
+  static const uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+  void* page = (void*)((uintptr_t)sled & ~(pagesize - 1));
+  if (mprotect(page, pagesize, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+    if (loglevel >= LogLevel::ERROR) {
+      fprintf(stderr, "[LLTAP-RT] Failed to make sled at (%p) writable\n", s.sled);
+    }
+    return false;
+  }
+  __atomic_store_n((uint64_t*)sled, patched, __ATOMIC_SEQ_CST);
+  mprotect(page, pagesize, PROT_READ | PROT_EXEC);
 
   if (loglevel >= LogLevel::DEBUG) {
-    fprintf(stderr,
-        "[LLTAP-RT] Adding hook for target %s (%p) type %d\n",
-        target, (void*)hook, type);
+    fprintf(stderr, "[LLTAP-RT] %s sled at (%p)\n", enable ? "Enabled" : "Disabled", s.sled);
   }
+  return true;
+#else
+  if (loglevel >= LogLevel::ERROR) {
+    fprintf(stderr, "[LLTAP-RT] Patching sleds is not supported on this platform\n");
+  }
+  return false;
+#endif
+}
 
-  if (functions == nullptr) {
+/**
+ * Returns the address of the target with the given name or nullptr if there is no such target.
+ * Must be called with hm_mutex held.
+ */
+void* LLTap::HookManager::resolve_target(char* name) {
+  if (functions.size() == 0) {
     if (loglevel >= LogLevel::WARN) {
       fprintf(stderr, "[LLTAP-RT] No hook targets registered\n");
     }
-    return false;
+    return nullptr;
   }
 
-  if (hooks == nullptr) {
-    hooks = new map<void*, hook_registry>();
+  void** fn = functions.find(name);
+  if (fn == nullptr) {
+    if (loglevel >= LogLevel::WARN) {
+      fprintf(stderr, "[LLTAP-RT] Unknown hook target %s\n", name);
+    }
+    return nullptr;
   }
+  return *fn;
+}
 
-  void* targetaddr = (*functions)[target];
-  if (target == nullptr) {
-    return false;
+/**
+ * Returns the address of the target with the given ID or nullptr if there is no such target.
+ * Must be called with hm_mutex held.
+ */
+void* LLTap::HookManager::resolve_target(unsigned id) {
+  if (id >= targets_by_id.size() || targets_by_id[id] == nullptr) {
+    if (loglevel >= LogLevel::WARN) {
+      fprintf(stderr, "[LLTAP-RT] Unknown hook target ID %u\n", id);
+    }
+    return nullptr;
   }
+  return targets_by_id[id];
+}
+
+/**
+ * Returns a copy of the registry of the target in the given table, which is empty if the target
+ * has no hooks. Must be called with hm_mutex held.
+ */
+LLTap::hook_registry LLTap::HookManager::registry(const hook_table& table, void* target) {
+  hook_registry hr;
+  const hook_registry* const* found = table.find(target);
+  if (found != nullptr) {
+    hr = **found;
+  } else {
+    memset(&hr, 0, sizeof(hr));
+  }
+  unsigned* id = target_ids.find(target);
+  hr.target_id = (id != nullptr) ? *id : LLTAP_NO_TARGET_ID;
+  return hr;
+}
+
+/**
+ * Store the registry of the target in the given (unpublished) table, or remove the target if the
+ * registry has no hooks left. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::set_registry(hook_table& table, void* target, const hook_registry& hr) {
+  if (hr.bitmap == 0) {
+    table.erase(target);
+  } else {
+    table[target] = intern(hr);
+  }
+}
+
+/**
+ * Set a hook in the given (unpublished) table.
+ */
+bool LLTap::HookManager::set_hook(hook_table& table, void* target, LLTapHook hook,
+    LLTapHookType type) {
+
+  hook_registry hr = registry(table, target);
   switch (type) {
     case LLTAP_PRE_HOOK:
-      (*hooks)[targetaddr].pre_hook = hook;
+      hr.pre_hook = hook;
       break;
     case LLTAP_REPLACE_HOOK:
-      (*hooks)[targetaddr].replace_hook = hook;
+      hr.replace_hook = hook;
       break;
     case LLTAP_POST_HOOK:
-      (*hooks)[targetaddr].post_hook = hook;
+    case LLTAP_POST_HOOK_BYREF:
+      // there is only one post hook, the bitmap tells the instrumentation how to call it
+      hr.post_hook = hook;
+      hr.bitmap &= ~(LLTAP_POST_HOOK | LLTAP_POST_HOOK_BYREF);
       break;
     default:
       if (loglevel >= LogLevel::ERROR) {
         fprintf(stderr, "[LLTAP-RT] Invalid hook type\n");
       }
+      return false;
   }
+  if (hook != nullptr) {
+    hr.bitmap |= type;
+  } else {
+    hr.bitmap &= ~type;
+  }
+  set_registry(table, target, hr);
 
   return true;
 }
 
-LLTapHook LLTap::HookManager::get_hook(void* target, LLTapHookType type) {
+/**
+ * Publish a new version of the hook table with the given hook set. Must be called with hm_mutex
+ * held.
+ */
+bool LLTap::HookManager::install_hook(void* target, LLTapHook hook, LLTapHookType type) {
+  hook_table* next = copy_hooks();
+  if (! set_hook(*next, target, hook, type)) {
+    delete next;
+    return false;
+  }
+  publish(next);
+  update_slots(next, target);
+
+  return true;
+}
+
+bool LLTap::HookManager::add_hook(char* target, LLTapHook hook, LLTapHookType type) {
+  lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
+
+  if (loglevel >= LogLevel::DEBUG) {
+    fprintf(stderr,
+        "[LLTAP-RT] Adding hook for target %s (%p) type %d\n",
+        target, (void*)hook, type);
+  }
+
+  void* targetaddr = resolve_target(target);
+  if (targetaddr == nullptr) {
+    return false;
+  }
+  return install_hook(targetaddr, hook, type);
+}
+
+bool LLTap::HookManager::add_hook(unsigned id, LLTapHook hook, LLTapHookType type) {
   lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
 
-  if (hooks == nullptr) {
+  if (loglevel >= LogLevel::DEBUG) {
+    fprintf(stderr,
+        "[LLTAP-RT] Adding hook for target ID %u (%p) type %d\n",
+        id, (void*)hook, type);
+  }
+
+  void* targetaddr = resolve_target(id);
+  if (targetaddr == nullptr) {
+    return false;
+  }
+  return install_hook(targetaddr, hook, type);
+}
+
+/**
+ * Add all hooks of a LLTAP_HOOKSV_END terminated array, but publish only a single new version of
+ * the hook table.
+ */
+bool LLTap::HookManager::add_hooks(LLTapHookInfo* infos) {
+  lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
+
+  bool all = true;
+  list<void*> changed;
+  hook_table* next = copy_hooks();
+  for (size_t i = 0; infos[i].target != nullptr; ++i) {
+    if (loglevel >= LogLevel::DEBUG) {
+      fprintf(stderr,
+          "[LLTAP-RT] Adding hook for target %s (%p) type %d\n",
+          infos[i].target, (void*)infos[i].hook, infos[i].type);
+    }
+
+    void* targetaddr = resolve_target(infos[i].target);
+    if (targetaddr != nullptr
+        && set_hook(*next, targetaddr, infos[i].hook, infos[i].type)) {
+      changed.push_back(targetaddr);
+    } else {
+      all = false;
+    }
+  }
+  publish(next);
+  for (void* targetaddr : changed) {
+    update_slots(next, targetaddr);
+  }
+
+  return all;
+}
+
+LLTapHook LLTap::HookManager::get_hook(void* target, LLTapHookType type) {
+  reader_section section(epoch);
+  const hook_table* table = hooks.load(memory_order_seq_cst);
+
+  if (table == nullptr) {
     if (loglevel >= LogLevel::WARN) {
       fprintf(stderr, "[LLTAP-RT] No hooks registered at all\n");
     }
     return nullptr;
   }
 
-  if (hooks->count(target) != 0) {
+  const hook_registry* const* found = table->find(target);
+  if (found != nullptr) {
+    const hook_registry* hr = *found;
     switch (type) {
       case LLTapHookType::LLTAP_PRE_HOOK:
-        return (*hooks)[target].pre_hook;
+        return hr->pre_hook;
       case LLTapHookType::LLTAP_POST_HOOK:
-        return (*hooks)[target].post_hook;
+      case LLTapHookType::LLTAP_POST_HOOK_BYREF:
+        return (hr->bitmap & type) ? hr->post_hook : nullptr;
       case LLTapHookType::LLTAP_REPLACE_HOOK:
-        return (*hooks)[target].replace_hook;
+        return hr->replace_hook;
       default:
         if (loglevel >= LogLevel::ERROR) {
           fprintf(stderr, "[LLTAP-RT] Invalid hook type\n");
@@ -168,28 +760,37 @@ LLTapHook LLTap::HookManager::get_hook(void* target, LLTapHookType type) {
   }
 }
 
+/**
+ * Returns all hooks of the target from a single version of the hook table, or nullptr if there are
+ * none. The returned registry stays valid, since registries are never released.
+ */
+const LLTap::hook_registry* LLTap::HookManager::get_hooks(void* target) {
+  reader_section section(epoch);
+  const hook_table* table = hooks.load(memory_order_seq_cst);
+
+  if (table == nullptr) {
+    return nullptr;
+  }
+
+  const hook_registry* const* found = table->find(target);
+  return (found != nullptr) ? *found : nullptr;
+}
+
 int LLTap::HookManager::get_hook_bitmap(void* target) {
-  lock_guard<std::mutex> lock(hm_mutex);
+  reader_section section(epoch);
+  const hook_table* table = hooks.load(memory_order_seq_cst);
 
   int hook_bm = 0;
-  if (hooks == nullptr) {
+  if (table == nullptr) {
     if (loglevel >= LogLevel::DEBUG) {
       fprintf(stderr, "[LLTAP-RT] No hooks registered at all\n");
     }
     return 0;
   }
 
-  if (hooks->count(target) != 0) {
-    hook_registry& hr = (*hooks)[target];
-    if (hr.pre_hook != nullptr) {
-      hook_bm |= LLTapHookType::LLTAP_PRE_HOOK;
-    }
-    if (hr.replace_hook != nullptr) {
-      hook_bm |= LLTapHookType::LLTAP_REPLACE_HOOK;
-    }
-    if (hr.post_hook != nullptr) {
-      hook_bm |= LLTapHookType::LLTAP_POST_HOOK;
-    }
+  const hook_registry* const* found = table->find(target);
+  if (found != nullptr) {
+    hook_bm = (*found)->bitmap;
   }
 
   return hook_bm;
@@ -197,50 +798,500 @@ int LLTap::HookManager::get_hook_bitmap(void* target) {
 
 void LLTap::HookManager::remove_hook(char* name, LLTapHookType type) {
   lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
 
-  if (hooks == nullptr) {
+  void** fn = functions.find(name);
+  if (fn == nullptr) {
     return;
   }
+  uninstall_hook(*fn, type);
+}
+
+void LLTap::HookManager::remove_hook(unsigned id, LLTapHookType type) {
+  lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
 
-  void* target = (*functions)[name];
-  if (target == nullptr) {
+  if (id >= targets_by_id.size() || targets_by_id[id] == nullptr) {
     return;
   }
-  if (hooks->count(target) != 0) {
-    switch (type) {
-      case LLTapHookType::LLTAP_PRE_HOOK:
-        (*hooks)[target].pre_hook = nullptr;
-        break;
-      case LLTapHookType::LLTAP_POST_HOOK:
-        (*hooks)[target].post_hook = nullptr;
-        break;
-      case LLTapHookType::LLTAP_REPLACE_HOOK:
-        (*hooks)[target].replace_hook = nullptr;
-        break;
-      default:
-        if (loglevel >= LogLevel::ERROR) {
-          fprintf(stderr,
-              "[LLTAP-RT] Failed to remove hook on '%s' - Invalid hook type (%d)\n",
-              name, type);
-        }
-        return;
-    }
+  uninstall_hook(targets_by_id[id], type);
+}
+
+/**
+ * Publish a new version of the hook table without the given hook. Must be called with hm_mutex
+ * held.
+ */
+void LLTap::HookManager::uninstall_hook(void* target, LLTapHookType type) {
+  const hook_table* current = hooks.load(memory_order_relaxed);
+  if (current == nullptr || current->find(target) == nullptr) {
+    return;
   }
 
+  hook_table* next = copy_hooks();
+  hook_registry hr = registry(*next, target);
+  switch (type) {
+    case LLTapHookType::LLTAP_PRE_HOOK:
+      hr.pre_hook = nullptr;
+      break;
+    case LLTapHookType::LLTAP_POST_HOOK:
+    case LLTapHookType::LLTAP_POST_HOOK_BYREF:
+      // removes the post hook regardless of how it is called
+      hr.post_hook = nullptr;
+      hr.bitmap &= ~(LLTAP_POST_HOOK | LLTAP_POST_HOOK_BYREF);
+      break;
+    case LLTapHookType::LLTAP_REPLACE_HOOK:
+      hr.replace_hook = nullptr;
+      break;
+    default:
+      if (loglevel >= LogLevel::ERROR) {
+        fprintf(stderr,
+            "[LLTAP-RT] Failed to remove hook on (%p) - Invalid hook type (%d)\n",
+            target, type);
+      }
+      delete next;
+      return;
+  }
+  hr.bitmap &= ~type;
+  set_registry(*next, target, hr);
+  publish(next);
+  update_slots(next, target);
 }
 
 void LLTap::HookManager::add_target(char* name, void* target) {
   lock_guard<std::mutex> lock(hm_mutex);
 
-  if (functions == nullptr) {
-    functions = new map<string, void*>();
+  register_target(name, target);
+  if (traced) {
+    set_traced({target});
+  }
+}
+
+/**
+ * Register a target together with the dispatch slot the instrumentation emitted for it. The slot
+ * is immediately updated in case hooks for the target are already installed.
+ */
+void LLTap::HookManager::add_slot(char* name, void* target, LLTapHookSlot* slot) {
+  lock_guard<std::mutex> lock(hm_mutex);
+
+  register_target(name, target);
+  add_target_slot(target, slot);
+  update_slots(hooks.load(memory_order_relaxed), target);
+  if (traced) {
+    set_traced({target});
+  }
+}
+
+/**
+ * Add the target records of a section emitted by the instrumentation pass. Every instrumented
+ * module of a linked image registers the same section, so sections are identified by their start.
+ * The records are only parsed once hooks are installed, which keeps this off the startup path.
+ */
+void LLTap::HookManager::add_targets(LLTapTargetRecord* begin, LLTapTargetRecord* end) {
+  lock_guard<std::mutex> lock(hm_mutex);
+
+  if (begin == nullptr || begin >= end || target_sections.find(begin) != nullptr) {
+    return;
+  }
+  target_sections[begin] = true;
+
+  if (loglevel >= LogLevel::DEBUG) {
+    fprintf(stderr, "[LLTAP-RT] Registering %zu target records at (%p)\n",
+        (size_t)(end - begin), (void*)begin);
+  }
+
+  pending_targets.push_back(make_pair(begin, end));
+  // e.g. a library loaded with dlopen, whose slots must reflect the installed hooks right away
+  if (hooks.load(memory_order_relaxed) != nullptr || traced) {
+    load_pending_targets();
+  }
+}
+
+/**
+ * Returns the entry of an indirectly called address and adds it to the inline cache of the call
+ * site. Entries are created for any address, as hooks may still be installed for it later on.
+ * Only growing the table of the entries takes the lock.
+ */
+const LLTapIndirectTarget* LLTap::HookManager::lookup_indirect(void* addr,
+    const LLTapIndirectTarget** cache, unsigned size) {
+  const LLTapIndirectTarget* entry = &add_indirect(addr, /*locked=*/false)->target;
+
+  if (cache == nullptr || size == 0) {
+    return entry;
+  }
+
+  // fill the first free cache entry or replace one once the site turned out to be megamorphic
+  unsigned i = 0;
+  while (i < size && __atomic_load_n(&cache[i], __ATOMIC_RELAXED) != nullptr) {
+    i++;
+  }
+  if (i == size) {
+    i = AddrTraits::hash(addr) % size;
+  }
+  __atomic_store_n(&cache[i], entry, __ATOMIC_RELEASE);
+
+  return entry;
+}
+
+/**
+ * Returns the entry of the given address or NULL. Must be called with hm_mutex held, so the table
+ * is not replaced meanwhile.
+ */
+LLTap::indirect_entry* LLTap::HookManager::find_indirect(void* addr) {
+  const indirect_table* table = indirect_targets.load(memory_order_relaxed);
+  size_t i = AddrTraits::hash(addr) & table->mask;
+  for (size_t probes = 0; probes <= table->mask; ++probes, i = (i + 1) & table->mask) {
+    indirect_entry* e = table->buckets[i].load(memory_order_seq_cst);
+    if (e == nullptr) {
+      return nullptr;
+    }
+    if (e->target.addr == addr) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Returns the entry of the given address in the current table and inserts it if there is none.
+ * Returns NULL if the table is full or was sealed, see grow_indirect. Must be called inside a
+ * reader_section.
+ */
+LLTap::indirect_entry* LLTap::HookManager::insert_indirect(void* addr, bool& inserted) {
+  indirect_table* table = indirect_targets.load(memory_order_seq_cst);
+  indirect_entry* fresh = nullptr;
+  inserted = false;
+
+  size_t i = AddrTraits::hash(addr) & table->mask;
+  for (size_t probes = 0; probes <= table->mask; ++probes, i = (i + 1) & table->mask) {
+    indirect_entry* e = table->buckets[i].load(memory_order_seq_cst);
+    if (e == nullptr) {
+      if (fresh == nullptr) {
+        fresh = new indirect_entry(addr);
+      }
+      // seq_cst orders the insert before init_indirect_slot loads the hook table
+      if (table->buckets[i].compare_exchange_strong(e, fresh, memory_order_seq_cst)) {
+        table->count.fetch_add(1, memory_order_relaxed);
+        inserted = true;
+        return fresh;
+      }
+      // e is what another thread inserted meanwhile
+    }
+    if (e == &sealed_bucket) {
+      break;
+    }
+    if (e->target.addr == addr) {
+      delete fresh;
+      return e;
+    }
+  }
+
+  delete fresh;
+  return nullptr;
+}
+
+/**
+ * Returns the entry of the given address, which is inserted if there is none yet. locked tells
+ * whether the caller holds hm_mutex, which is needed to grow the table.
+ */
+LLTap::indirect_entry* LLTap::HookManager::add_indirect(void* addr, bool locked) {
+  while (true) {
+    indirect_entry* entry = nullptr;
+    bool inserted = false;
+    bool grow = false;
+    {
+      reader_section section(epoch);
+      entry = insert_indirect(addr, inserted);
+      const indirect_table* table = indirect_targets.load(memory_order_seq_cst);
+      grow = (entry == nullptr)
+        || (inserted && table->count.load(memory_order_relaxed) * 2 > table->mask + 1);
+    }
+
+    if (grow) {
+      if (locked) {
+        grow_indirect();
+      } else {
+        // waits for a concurrent grow_indirect, which sealed the table
+        lock_guard<std::mutex> lock(hm_mutex);
+        grow_indirect();
+      }
+    }
+
+    if (entry != nullptr) {
+      if (inserted) {
+        init_indirect_slot(entry);
+      }
+      return entry;
+    }
+  }
+}
+
+/**
+ * Replace the current indirect_table by one twice its size once it is half full. The empty buckets
+ * of the old table are sealed before its entries are copied, so every insert into it either is
+ * copied or fails and retries in the new table. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::grow_indirect() {
+  indirect_table* current = indirect_targets.load(memory_order_relaxed);
+  size_t capacity = current->mask + 1;
+  if (current->count.load(memory_order_relaxed) * 2 <= capacity) {
+    return;
+  }
+
+  indirect_table* next = new indirect_table(capacity * 2);
+  size_t count = 0;
+  for (size_t i = 0; i < capacity; ++i) {
+    indirect_entry* e = nullptr;
+    if (current->buckets[i].compare_exchange_strong(e, &sealed_bucket, memory_order_seq_cst)) {
+      continue;
+    }
+    // the table is not published yet, so there are no concurrent inserts
+    size_t j = AddrTraits::hash(e->target.addr) & next->mask;
+    while (next->buckets[j].load(memory_order_relaxed) != nullptr) {
+      j = (j + 1) & next->mask;
+    }
+    next->buckets[j].store(e, memory_order_relaxed);
+    count++;
+  }
+  next->count.store(count, memory_order_relaxed);
+
+  indirect_targets.store(next, memory_order_seq_cst);
+  retired_indirect.push_back(
+      retired_table<indirect_table>{current, epoch.fetch_add(1, memory_order_seq_cst)});
+  reclaim();
+}
+
+/**
+ * Point the slot of a new entry to the current hooks of its address. A writer which publishes a
+ * new hook table meanwhile may not have seen the entry yet or may be overwritten by a stale value
+ * here, so the slot is set again until the hook table stays the same. The slot of an address
+ * without hooks already is up to date, which keeps __lltap_hook_generation and thus the versioned
+ * loops untouched.
+ */
+void LLTap::HookManager::init_indirect_slot(indirect_entry* entry) {
+  // the tables loaded here are not released and thus not reused before the section ends
+  reader_section section(epoch);
+  bool changed = false;
+  while (true) {
+    const hook_table* table = hooks.load(memory_order_seq_cst);
+    const hook_registry* hr = nullptr;
+    if (table != nullptr) {
+      const hook_registry* const* found = table->find(entry->target.addr);
+      hr = (found != nullptr) ? *found : nullptr;
+    }
+    // calling it hooks it already, the slot of the entry stays empty
+    if (entry->hooked_at_entry.load(memory_order_seq_cst)) {
+      hr = nullptr;
+    }
+
+    // a new slot is empty, unless a previous round set it
+    if (hr != nullptr || changed) {
+      __atomic_store_n(&entry->target.slot, hr, __ATOMIC_SEQ_CST);
+      changed = true;
+    }
+    if (table == hooks.load(memory_order_seq_cst)) {
+      if (changed) {
+        __atomic_add_fetch(&__lltap_hook_generation, 1, __ATOMIC_RELEASE);
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::load_pending_targets() {
+  const hook_table* current = hooks.load(memory_order_relaxed);
+
+  list<void*> added;
+  for (auto& section : pending_targets) {
+    for (LLTapTargetRecord* rec = section.first; rec < section.second; ++rec) {
+      // a weak function which was not linked in
+      if (rec->addr == nullptr) {
+        continue;
+      }
+      register_target(rec->name, rec->addr, rec->id);
+      added.push_back(rec->addr);
+      if (rec->flags & LLTAP_TARGET_HOOKED_AT_ENTRY) {
+        // before any hook table has hooks for it, so init_indirect_slot sees the flag
+        indirect_entry* entry = add_indirect(rec->addr, /*locked=*/true);
+        entry->hooked_at_entry.store(true, memory_order_seq_cst);
+        __atomic_store_n(&entry->target.slot, nullptr, __ATOMIC_SEQ_CST);
+      }
+      if (rec->slot != nullptr) {
+        add_target_slot(rec->addr, rec->slot);
+      }
+      if (rec->sled != nullptr) {
+        add_sled(rec->addr, rec->sled, rec->dispatcher);
+      }
+      if (rec->slot != nullptr || rec->sled != nullptr) {
+        update_slots(current, rec->addr);
+      }
+    }
+  }
+  pending_targets.clear();
+
+  if (traced) {
+    set_traced(added);
+  }
+}
+
+/**
+ * Publish a new version of the hook table with the given targets marked as LLTAP_TRACED, so their
+ * slots point to a registry even if they have no hooks. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::set_traced(const list<void*>& targets) {
+  if (targets.empty()) {
+    return;
+  }
+
+  hook_table* next = copy_hooks();
+  for (void* target : targets) {
+    hook_registry hr = registry(*next, target);
+    hr.bitmap |= LLTAP_TRACED;
+    set_registry(*next, target, hr);
+  }
+  publish(next);
+  for (void* target : targets) {
+    update_slots(next, target);
+  }
+}
+
+/**
+ * Returns the ID and name of every target which has an ID, ordered by ID.
+ */
+vector<pair<unsigned, string>> LLTap::HookManager::trace_targets() {
+  vector<pair<unsigned, string>> targets;
+  functions.for_each([&](const string& name, void* target) {
+    unsigned* id = target_ids.find(target);
+    if (id != nullptr) {
+      targets.push_back(make_pair(*id, name));
+    }
+  });
+  sort(targets.begin(), targets.end());
+  return targets;
+}
+
+/**
+ * Start the built-in tracer and mark all targets as traced, including the ones registered later
+ * on.
+ */
+bool LLTap::HookManager::start_trace(const char* path) {
+  lock_guard<std::mutex> lock(hm_mutex);
+  load_pending_targets();
+
+  if (! trace_open(path)) {
+    return false;
+  }
+  if (loglevel >= LogLevel::DEBUG) {
+    fprintf(stderr, "[LLTAP-RT] Tracing to %s\n", path);
+  }
+  traced = true;
+
+  list<void*> targets;
+  functions.for_each([&](const string&, void* target) {
+    targets.push_back(target);
+  });
+  set_traced(targets);
+  return true;
+}
+
+void LLTap::HookManager::stop_trace() {
+  lock_guard<std::mutex> lock(hm_mutex);
+  if (! traced) {
+    return;
   }
+  traced = false;
 
+  if (hooks.load(memory_order_relaxed) != nullptr) {
+    hook_table* next = copy_hooks();
+    list<void*> changed;
+    next->for_each([&](void* target, const hook_registry*& hr) {
+      if (hr->bitmap & LLTAP_TRACED) {
+        changed.push_back(target);
+      }
+    });
+    for (void* target : changed) {
+      hook_registry hr = registry(*next, target);
+      hr.bitmap &= ~LLTAP_TRACED;
+      set_registry(*next, target, hr);
+    }
+    publish(next);
+    for (void* target : changed) {
+      update_slots(next, target);
+    }
+  }
+
+  trace_close(trace_targets());
+}
+
+/**
+ * Remove all hooks at exit, as they may belong to objects which are destroyed by now. Instrumented
+ * code which still runs afterwards, e.g. from later destructors, skips the hooks, but the tables
+ * stay valid for lookups.
+ */
+void LLTap::HookManager::shutdown() {
+  lock_guard<std::mutex> lock(hm_mutex);
+
+  slots.for_each([](void*, list<LLTapHookSlot*>& s) {
+    for (LLTapHookSlot* slot : s) {
+      __atomic_store_n(slot, nullptr, __ATOMIC_RELEASE);
+    }
+  });
+  const indirect_table* indirect = indirect_targets.load(memory_order_relaxed);
+  for (size_t i = 0; i <= indirect->mask; ++i) {
+    indirect_entry* e = indirect->buckets[i].load(memory_order_seq_cst);
+    if (e != nullptr && e != &sealed_bucket) {
+      __atomic_store_n(&e->target.slot, nullptr, __ATOMIC_SEQ_CST);
+    }
+  }
+  if (hooks.load(memory_order_relaxed) != nullptr) {
+    publish(nullptr);
+  }
+  __atomic_add_fetch(&__lltap_hook_generation, 1, __ATOMIC_RELEASE);
+
+  if (traced) {
+    traced = false;
+    trace_close(trace_targets());
+  }
+}
+
+/**
+ * Register a target by name and by its ID. The registration by ID fails if the ID was already
+ * assigned to another target, e.g. by modules instrumented with different -target-ids files, so
+ * hooks registered by ID never end up on a different target. Must be called with hm_mutex held.
+ */
+void LLTap::HookManager::register_target(char* name, void* target, unsigned id) {
   if (loglevel >= LogLevel::DEBUG) {
     fprintf(stderr, "[LLTAP-RT] Registering target %s for addr (%p)\n", name, target);
   }
-  string n(name);
-  (*functions)[n] = target;
+  functions[name] = target;
+
+  unsigned* known = target_ids.find(target);
+  if (id == LLTAP_NO_TARGET_ID || id >= LLTAP_FIRST_RUNTIME_TARGET_ID) {
+    if (known == nullptr) {
+      target_ids[target] = next_runtime_id++;
+    }
+    return;
+  }
+
+  if (id >= targets_by_id.size()) {
+    targets_by_id.resize(id + 1, nullptr);
+  }
+  bool taken = (targets_by_id[id] != nullptr && targets_by_id[id] != target);
+  bool renumbered = (known != nullptr && *known != id && *known < LLTAP_FIRST_RUNTIME_TARGET_ID);
+  if (taken || renumbered) {
+    if (loglevel >= LogLevel::ERROR) {
+      fprintf(stderr, "[LLTAP-RT] Target ID %u of %s conflicts with target ID %u of (%p)\n",
+          id, name, renumbered ? *known : id, taken ? targets_by_id[id] : target);
+    }
+    if (known == nullptr) {
+      target_ids[target] = next_runtime_id++;
+    }
+    return;
+  }
+  targets_by_id[id] = target;
+  target_ids[target] = id;
 }
 
 
@@ -249,6 +1300,10 @@ void LLTap::HookManager::add_target(char* name, void* target) {
  */
 extern "C" {
 
+int lltap_static_hooks_enabled = 1;
+
+unsigned long long __lltap_hook_generation = 0;
+
 int lltap_register_hook(char* target, LLTapHook hook, LLTapHookType type) {
   LLTap::hookmanager.add_hook(target, hook, type);
   return 1;
@@ -259,14 +1314,40 @@ int lltap_register_hook_i(LLTapHookInfo* info) {
   return 1;
 }
 
+int lltap_register_hooks(LLTapHookInfo* infos) {
+  LLTap::hookmanager.add_hooks(infos);
+  return 1;
+}
+
+int lltap_register_hook_id(unsigned target, LLTapHook hook, LLTapHookType type) {
+  return LLTap::hookmanager.add_hook(target, hook, type);
+}
+
 void __lltap_inst_add_hook_target(void* addr, char* name) {
   LLTap::hookmanager.add_target(name, addr);
 }
 
+void __lltap_inst_add_hook_slot(void* addr, char* name, LLTapHookSlot* slot) {
+  LLTap::hookmanager.add_slot(name, addr, slot);
+}
+
+void __lltap_inst_add_hook_targets(LLTapTargetRecord* begin, LLTapTargetRecord* end) {
+  LLTap::hookmanager.add_targets(begin, end);
+}
+
 LLTapHook __lltap_inst_get_hook(void* addr, LLTapHookType type) {
   return LLTap::hookmanager.get_hook(addr, type);
 }
 
+const LLTapHookRegistry* __lltap_inst_get_hooks(void* addr) {
+  return LLTap::hookmanager.get_hooks(addr);
+}
+
+
+const LLTapIndirectTarget* __lltap_inst_lookup_indirect(void* addr,
+    const LLTapIndirectTarget** cache, unsigned size) {
+  return LLTap::hookmanager.lookup_indirect(addr, cache, size);
+}
 
 int __lltap_inst_has_hooks(void* addr) {
   return LLTap::hookmanager.get_hook_bitmap(addr);
@@ -277,4 +1358,17 @@ void lltap_deregister_hook(char* target, LLTapHookType type)
   LLTap::hookmanager.remove_hook(target, type);
 }
 
+void lltap_deregister_hook_id(unsigned target, LLTapHookType type)
+{
+  LLTap::hookmanager.remove_hook(target, type);
+}
+
+int lltap_trace_start(const char* path) {
+  return LLTap::hookmanager.start_trace(path);
+}
+
+void lltap_trace_stop(void) {
+  LLTap::hookmanager.stop_trace();
+}
+
 }
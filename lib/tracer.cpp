@@ -0,0 +1,396 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <liblltap.h>
+
+#include "tracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace LLTap {
+
+  /**
+   * Ring buffer of the events of one thread. Only the owning thread writes events and advances
+   * head, only the tracer advances tail, so recording an event takes no lock.
+   */
+  struct TraceBuffer {
+    static const size_t SIZE = 4096;
+
+    LLTapTraceEvent events[SIZE];
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    // the thread exited, the buffer is freed once it is drained
+    std::atomic<bool> orphaned{false};
+  };
+
+  /**
+   * Drains the trace buffers of all threads into a file. A background thread drains them
+   * periodically, a thread whose buffer is full drains it itself. The events are copied into a
+   * memory mapped window at the end of the file, so only the window is mapped however large the
+   * trace grows.
+   */
+  class Tracer {
+
+    public:
+      bool open(const char* path);
+      void close(const std::vector<std::pair<unsigned, std::string>>& targets);
+      TraceBuffer* add_buffer();
+      void drain(TraceBuffer* buf);
+
+      // events are only recorded while this is set
+      std::atomic<bool> active{false};
+
+    private:
+      static const size_t WINDOW_SIZE = 4 << 20;
+      static const unsigned DRAIN_INTERVAL_MS = 10;
+
+      // protects everything below
+      std::mutex lock;
+      std::condition_variable wakeup;
+      std::vector<TraceBuffer*> buffers;
+      std::thread drainer;
+      bool stopping = false;
+      int fd = -1;
+      // the mapped part of the file and its offset
+      char* window = nullptr;
+      size_t window_offset = 0;
+      // end of the data written to the file so far
+      size_t used = 0;
+      unsigned long long num_events = 0;
+      bool failed = false;
+
+      void run();
+      void drain_locked(TraceBuffer* buf);
+      void drain_all_locked();
+      void append(const void* data, size_t size);
+      void unmap();
+      void write_names(const std::vector<std::pair<unsigned, std::string>>& targets);
+      bool write_header(size_t names_offset);
+  };
+
+  /**
+   * Instrumented code may record events from destructors, so it is never destroyed.
+   */
+  Tracer& tracer() {
+    static Tracer* t = new Tracer();
+    return *t;
+  }
+
+  // initial-exec saves a call to __tls_get_addr on every event
+  __thread TraceBuffer* trace_buffer __attribute__((tls_model("initial-exec"))) = nullptr;
+  // set once the buffer of the thread was handed back. Instrumented calls from later TLS
+  // destructors must not allocate a new one, which nothing would ever hand back.
+  __thread bool trace_buffer_released __attribute__((tls_model("initial-exec"))) = false;
+
+  /**
+   * Hands the buffer of an exiting thread back to the tracer.
+   */
+  struct TraceBufferOwner {
+    TraceBuffer* buf = nullptr;
+
+    ~TraceBufferOwner() {
+      trace_buffer_released = true;
+      if (buf != nullptr) {
+        trace_buffer = nullptr;
+        buf->orphaned.store(true, std::memory_order_release);
+      }
+    }
+  };
+
+  thread_local TraceBufferOwner trace_buffer_owner;
+}
+
+/**
+ * Tracer implementation
+ */
+
+const size_t LLTap::TraceBuffer::SIZE;
+const size_t LLTap::Tracer::WINDOW_SIZE;
+const unsigned LLTap::Tracer::DRAIN_INTERVAL_MS;
+
+bool LLTap::Tracer::open(const char* path) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (fd != -1) {
+    fprintf(stderr, "[LLTAP-RT] Already tracing, not tracing to %s\n", path);
+    return false;
+  }
+
+  fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "[LLTAP-RT] Failed to create trace file %s: %s\n", path, strerror(errno));
+    fd = -1;
+    return false;
+  }
+  // names_offset stays 0 until the trace is closed, which marks an incomplete trace
+  used = sizeof(LLTapTraceHeader);
+  num_events = 0;
+  failed = false;
+  if (! write_header(0)) {
+    fprintf(stderr, "[LLTAP-RT] Failed to write trace file %s: %s\n", path, strerror(errno));
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  // drop what was recorded after the previous trace was closed
+  for (TraceBuffer* buf : buffers) {
+    buf->tail.store(buf->head.load(std::memory_order_acquire), std::memory_order_release);
+  }
+
+  stopping = false;
+  active.store(true, std::memory_order_release);
+  drainer = std::thread(&Tracer::run, this);
+  return true;
+}
+
+/**
+ * Calls which are still running record their events after the final drain, these are lost.
+ */
+void LLTap::Tracer::close(const std::vector<std::pair<unsigned, std::string>>& targets) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd == -1) {
+      return;
+    }
+    active.store(false, std::memory_order_release);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  if (drainer.joinable()) {
+    drainer.join();
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  drain_all_locked();
+  size_t names_offset = used;
+  write_names(targets);
+  unmap();
+
+  if (! write_header(names_offset) || ftruncate(fd, used) != 0 || failed) {
+    fprintf(stderr, "[LLTAP-RT] Failed to write the trace file: %s\n", strerror(errno));
+  }
+  ::close(fd);
+  fd = -1;
+}
+
+LLTap::TraceBuffer* LLTap::Tracer::add_buffer() {
+  TraceBuffer* buf = new TraceBuffer();
+  std::lock_guard<std::mutex> guard(lock);
+  buffers.push_back(buf);
+  return buf;
+}
+
+/**
+ * Called by the owner of a full buffer.
+ */
+void LLTap::Tracer::drain(TraceBuffer* buf) {
+  std::lock_guard<std::mutex> guard(lock);
+  drain_locked(buf);
+}
+
+void LLTap::Tracer::run() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (! stopping) {
+    wakeup.wait_for(guard, std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+    drain_all_locked();
+  }
+}
+
+/**
+ * Append the events of the buffer to the file. Must be called with lock held.
+ */
+void LLTap::Tracer::drain_locked(TraceBuffer* buf) {
+  size_t head = buf->head.load(std::memory_order_acquire);
+  size_t tail = buf->tail.load(std::memory_order_relaxed);
+
+  // at most two copies, as the events may wrap around the end of the ring
+  while (fd != -1 && tail < head) {
+    size_t i = tail & (TraceBuffer::SIZE - 1);
+    size_t n = std::min(head - tail, TraceBuffer::SIZE - i);
+    append(&buf->events[i], n * sizeof(LLTapTraceEvent));
+    tail += n;
+    if (! failed) {
+      num_events += n;
+    }
+  }
+  buf->tail.store(head, std::memory_order_release);
+}
+
+/**
+ * Must be called with lock held.
+ */
+void LLTap::Tracer::drain_all_locked() {
+  for (auto it = buffers.begin(); it != buffers.end(); ) {
+    TraceBuffer* buf = *it;
+    // the last events of an exited thread are visible once it is marked as orphaned
+    bool orphaned = buf->orphaned.load(std::memory_order_acquire);
+    drain_locked(buf);
+    if (orphaned) {
+      delete buf;
+      it = buffers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+/**
+ * Copy the data to the end of the file, moving the window on when it is full. After an error
+ * nothing is written any more, so the file stays consistent. Must be called with lock held.
+ */
+void LLTap::Tracer::append(const void* data, size_t size) {
+  const char* src = (const char*)data;
+  while (size > 0 && ! failed) {
+    if (window == nullptr || used >= window_offset + WINDOW_SIZE) {
+      unmap();
+      // mappings start at a page boundary
+      window_offset = used & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+      void* m = MAP_FAILED;
+      if (ftruncate(fd, window_offset + WINDOW_SIZE) == 0) {
+        m = mmap(nullptr, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, window_offset);
+      }
+      if (m == MAP_FAILED) {
+        fprintf(stderr, "[LLTAP-RT] Failed to extend the trace file: %s\n", strerror(errno));
+        failed = true;
+        return;
+      }
+      window = (char*)m;
+    }
+
+    size_t n = std::min(size, window_offset + WINDOW_SIZE - used);
+    memcpy(window + (used - window_offset), src, n);
+    used += n;
+    src += n;
+    size -= n;
+  }
+}
+
+/**
+ * Must be called with lock held.
+ */
+void LLTap::Tracer::unmap() {
+  if (window != nullptr) {
+    munmap(window, WINDOW_SIZE);
+    window = nullptr;
+  }
+}
+
+/**
+ * Must be called with lock held.
+ */
+bool LLTap::Tracer::write_header(size_t names_offset) {
+  LLTapTraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LLTAP_TRACE_MAGIC, sizeof(header.magic));
+  header.version = LLTAP_TRACE_VERSION;
+  header.event_size = sizeof(LLTapTraceEvent);
+  header.num_events = num_events;
+  header.names_offset = names_offset;
+  return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+/**
+ * Append the names of the targets and call sites. Must be called with lock held.
+ */
+void LLTap::Tracer::write_names(const std::vector<std::pair<unsigned, std::string>>& targets) {
+  std::string names;
+  for (auto& t : targets) {
+    names += "target\t" + std::to_string(t.first) + "\t" + t.second + "\n";
+  }
+  unsigned num_sites = lltap_num_call_sites();
+  for (unsigned id = 0; id < num_sites; ++id) {
+    const LLTapCallSiteRecord* site = lltap_get_call_site(id);
+    names += "site\t" + std::to_string(id) + "\t" + std::to_string(site->target_id) + "\t"
+      + site->caller + "\t" + ((site->file != nullptr) ? site->file : "") + "\t"
+      + std::to_string(site->line) + "\t" + std::to_string(site->column) + "\n";
+  }
+
+  append(names.data(), names.size());
+}
+
+bool LLTap::trace_open(const char* path) {
+  return tracer().open(path);
+}
+
+void LLTap::trace_close(const std::vector<std::pair<unsigned, std::string>>& targets) {
+  tracer().close(targets);
+}
+
+extern "C" {
+
+unsigned long long __lltap_trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Called by the wrappers after the post hook of a traced target.
+ */
+void __lltap_trace_call(const LLTapHookRegistry* hooks, unsigned call_site_id,
+    unsigned long long start, const unsigned long long* args, unsigned nargs,
+    unsigned long long ret) {
+  unsigned long long end = __lltap_trace_clock();
+  LLTap::Tracer& t = LLTap::tracer();
+  if (! t.active.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  LLTap::TraceBuffer* buf = LLTap::trace_buffer;
+  if (buf == nullptr) {
+    if (LLTap::trace_buffer_released) {
+      return;
+    }
+    buf = t.add_buffer();
+    LLTap::trace_buffer = buf;
+    LLTap::trace_buffer_owner.buf = buf;
+  }
+
+  size_t head = buf->head.load(std::memory_order_relaxed);
+  if (head - buf->tail.load(std::memory_order_acquire) == LLTap::TraceBuffer::SIZE) {
+    t.drain(buf);
+  }
+
+  LLTapTraceEvent& ev = buf->events[head & (LLTap::TraceBuffer::SIZE - 1)];
+  ev.start = start;
+  ev.end = end;
+  ev.target_id = hooks->target_id;
+  ev.call_site_id = call_site_id;
+  ev.thread_id = (__lltap_thread_id != 0) ? __lltap_thread_id : __lltap_inst_thread_id();
+  ev.nargs = std::min(nargs, (unsigned)LLTAP_TRACE_MAX_ARGS);
+  memcpy(ev.args, args, ev.nargs * sizeof(ev.args[0]));
+  ev.ret = ret;
+  buf->head.store(head + 1, std::memory_order_release);
+}
+
+}
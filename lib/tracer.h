@@ -0,0 +1,40 @@
+/*
+ * Copyright 2015 Michael Rodler <contact@f0rki.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LLTAP_TRACER_H
+#define LLTAP_TRACER_H 1
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace LLTap {
+
+  /**
+   * Create the trace file and start the thread draining the trace buffers into it. The hook
+   * manager marks the traced targets, so the tracer itself doesn't know about them.
+   */
+  bool trace_open(const char* path);
+
+  /**
+   * Drain all trace buffers and complete the file with the names of the given targets, which are
+   * pairs of target ID and name, and of all call sites.
+   */
+  void trace_close(const std::vector<std::pair<unsigned, std::string>>& targets);
+}
+
+#endif // LLTAP_TRACER_H
@@ -27,13 +27,23 @@
 ///
 //===----------------------------------------------------------------------===//
 
-#define DEBUG_TYPE "LLTap"
-
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/TinyPtrVector.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/BitVector.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
@@ -42,24 +52,45 @@
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/CallSite.h"
-#include "llvm/IR/TypeBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 
 #include "llvm/Pass.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Regex.h"
 #include "llvm/Support/CommandLine.h"
-
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
 #include <string>
 
 
 using namespace std;
 using namespace llvm;
 
+#define DEBUG_TYPE "LLTap"
+
 //STATISTIC(FunctionsVisited, "# of functions that were visited.");
 //STATISTIC(FunctionsInstrumented, "# of functions that were actually instrumented.");
 //STATISTIC(CallsFound, "# calls to some function");
@@ -73,10 +104,69 @@ namespace LLTap {
     inst_e,
   };
 
+  enum class PipelinePoint {
+    pre_inline,
+    post_inline,
+    lto,
+    none,
+  };
+
+  /**
+   * Which part of the program a run of the pass sees. A ThinLTO backend only sees its partition,
+   * while all other backends run in parallel. The merged module of a full LTO link is the whole
+   * program.
+   */
+  enum class LinkTime {
+    none,
+    thin_backend,
+    whole_program,
+  };
+
+  /**
+   * What happens to the calls which exceed the -inst-budget.
+   */
+  enum class BudgetAction {
+    skip,
+    sled,
+  };
+
   enum class HookType {
     PRE_HOOK = 1,
     REPLACE_HOOK = 2,
     POST_HOOK = 4,
+    POST_HOOK_BYREF = 8,
+  };
+
+  /**
+   * Names of the hook functions, which are called directly by the wrapper of a target (see the
+   * -static-hooks option). Empty if the target has no such hook.
+   */
+  struct StaticHooks {
+    string pre_hook;
+    string replace_hook;
+    string post_hook;
+    bool post_hook_byref = false;
+  };
+
+  /**
+   * A rule of the -inst-policy file. The rule applies to a call if all of its regexes match, a
+   * missing regex matches anything.
+   */
+  struct PolicyRule {
+    bool instrument = false;
+    std::unique_ptr<Regex> callee;
+    std::unique_ptr<Regex> caller;
+    std::unique_ptr<Regex> file;
+    std::unique_ptr<Regex> module;
+  };
+
+  /**
+   * What is known about the calls from one function: the policy rules applying to them, indexed
+   * like the rules, and whether the command line caller filters allow instrumenting them.
+   */
+  struct CallerScope {
+    BitVector rules;
+    bool allowed = true;
   };
 
 
@@ -85,6 +175,8 @@ namespace LLTap {
    */
   class InstrumentationPass : public ModulePass {
 
+    friend class InstrumentationModulePass;
+
     public:
       // Pass identification, replacement for typeid
       static char ID;
@@ -97,14 +189,60 @@ namespace LLTap {
       //}
 
     private:
-      const string fn_lltap_get_hook = "__lltap_inst_get_hook";
-      const string fn_lltap_add_hook = "__lltap_inst_add_hook_target";
-      const string fn_lltap_has_hooks = "__lltap_inst_has_hooks";
+      const string fn_lltap_get_hooks = "__lltap_inst_get_hooks";
+      const string fn_lltap_add_targets = "__lltap_inst_add_hook_targets";
+      const string fn_lltap_register_targets = "__lltap_register_targets";
+      const string fn_lltap_lookup_indirect = "__lltap_inst_lookup_indirect";
+
+      const string LLTAP_REGISTRY_TYPENAME = "struct.LLTapHookRegistry";
+      const string LLTAP_TARGET_RECORD_TYPENAME = "struct.LLTapTargetRecord";
+      const string LLTAP_TARGETS_SECTION = "__lltap_targets";
+      const string LLTAP_INDIRECT_TARGET_TYPENAME = "struct.LLTapIndirectTarget";
+      const string LLTAP_CALL_SITE_RECORD_TYPENAME = "struct.LLTapCallSiteRecord";
+      const string LLTAP_CALL_SITES_SECTION = "__lltap_call_sites";
+      const string LLTAP_CALL_SITE = "__lltap_call_site";
+      const string fn_lltap_add_call_sites = "__lltap_inst_add_call_sites";
+      const string fn_lltap_register_call_sites = "__lltap_register_call_sites";
+      const string LLTAP_CALL_CONTEXT_TYPENAME = "struct.LLTapCallContext";
+      const string LLTAP_CALL_CONTEXT = "__lltap_call_context";
+      const string LLTAP_THREAD_ID = "__lltap_thread_id";
+      const string fn_lltap_thread_id = "__lltap_inst_thread_id";
+      const unsigned LLTAP_CALL_CONTEXT_WORDS = 4;
+      const string fn_lltap_trace_clock = "__lltap_trace_clock";
+      const string fn_lltap_trace_call = "__lltap_trace_call";
+      const unsigned LLTAP_TRACED = 16;
+      const unsigned LLTAP_TRACE_MAX_ARGS = 6;
+      const unsigned LLTAP_TARGET_HOOKED_AT_ENTRY = 1;
+      const unsigned LLTAP_NO_TARGET_ID = (unsigned)-1;
+      const unsigned LLTAP_NO_CALL_SITE_ID = (unsigned)-1;
+
+      const string LLTAP_STATIC_HOOKS_ENABLED = "lltap_static_hooks_enabled";
+      const string LLTAP_HOOK_GENERATION = "__lltap_hook_generation";
 
       const string LLVM_GLOBAL_CTORS_VARNAME = "llvm.global_ctors";
       const int DEFAULT_CTOR_PRIORITY = 0;
 
-      SmallPtrSet<Function*, 100> lltapHookFunctions;
+      SmallPtrSet<Function*, 32> lltapHookFunctions;
+
+      // target IDs, targetIdNames is indexed by the ID
+      StringMap<unsigned> targetIds;
+      std::vector<string> targetIdNames;
+      // number of IDs read from the -target-ids file, the others are provisional
+      size_t loadedTargetIds = 0;
+      void loadTargetIds();
+      void saveTargetIds();
+      void writeTargetIdHeader();
+      unsigned getTargetIdFor(StringRef fname);
+
+      LinkTime linkTime = LinkTime::none;
+      // the target records emitted for this module and the names of their targets
+      std::vector<std::pair<GlobalVariable*, string>> targetRecords;
+
+      StringMap<StaticHooks> staticHooks;
+      void loadStaticHooks();
+      StaticHooks* getStaticHooksFor(Function* calledFn);
+      Value* getStaticHook(StaticHooks* statics, HookType type, FunctionType* hookty, Module& M);
+      Value* loadStaticHooksEnabled(IRBuilder<>& irb, Module& M);
 
       StringSet<> instrumentCallsTo;
       StringSet<> noInstrumentCallsTo;
@@ -112,30 +250,170 @@ namespace LLTap {
       Regex* noInstrumentCallsRe = nullptr;
       void initializeInstConfig();
 
+      StringSet<> instrumentCallsFrom;
+      StringSet<> noInstrumentCallsFrom;
+      Regex* instrumentCallersRe = nullptr;
+      Regex* noInstrumentCallersRe = nullptr;
+      Regex* instrumentCallerFilesRe = nullptr;
+      Regex* noInstrumentCallerFilesRe = nullptr;
+      Regex* instrumentModulesRe = nullptr;
+      Regex* noInstrumentModulesRe = nullptr;
+
+      std::vector<PolicyRule> policy;
+      void loadPolicy();
+
       bool instConfigInitialized = false;
+      // decisions of the callee filters and target names, per function of the current module
+      DenseMap<Function*, bool> instrumentDecisions;
+      DenseMap<Function*, string> targetNames;
+      // policy rules matching a callee, in order, and the scope of the calls from a function. The
+      // calls outside of any function, e.g. indirect calls, use the nullptr entries.
+      DenseMap<Function*, SmallVector<unsigned, 2>> calleeRules;
+      DenseMap<Function*, CallerScope> callerScopes;
       bool shouldBeInstrumented(Function& F);
+      bool computeShouldBeInstrumented(Function& F);
+      bool matchesCalleeFilters(Function& F);
+      const SmallVector<unsigned, 2>& getPolicyRulesFor(Function* callee);
+      const CallerScope& getCallerScope(Function* caller, Module& M);
+      bool shouldInstrumentCall(Function* callee, Instruction* at, Module& M);
+
+      // calls per caller and callee read from -call-counts, keyed by "<caller> <callee>"
+      StringMap<uint64_t> callCounts;
+      bool callCountsLoaded = false;
+      void loadCallCounts();
+      void addCallCounters(Module& M);
+      bool getCallCounts(Module& M,
+          MapVector<std::pair<Function*, Function*>, uint64_t>& counts);
+      // (caller, callee) pairs whose calls exceed the -inst-budget and the targets downgraded
+      // to a patchable sled instead
+      DenseSet<std::pair<Function*, Function*>> budgetExcluded;
+      SmallPtrSet<Function*, 16> sledTargets;
+      void applyBudget(Module& M);
       bool runOnFunction(Function& F);
       bool isUseInLLTapHook(User* user);
 
-      bool instrumentCall(CallSite* inst, Module& M);
+      bool instrumentCall(CallBase* inst, Module& M);
       bool instrumentUse(User* inst, Module& M);
 
-      string mangleFunctionArgs(CallSite* CS);
+      // mangled names of the argument types seen in varargs calls
+      DenseMap<Type*, string> mangledTypes;
+      string mangleFunctionArgs(CallBase* CS);
+      const string& getMangledTypeName(Type* type);
 
       void addToGlobalCtors(Module& M, Function* fn);
 
-      string getHookFunctionNameFor(Function* origFunc, CallSite* CS=nullptr);
-      Function* getHookFunctionFor(CallSite* CS, Module& M);
+      // suffix of the wrapper names, see getWrapperVariant
+      string wrapperVariant;
+      string getWrapperVariant(Module& M);
+      string getHookFunctionNameFor(Function* origFunc, CallBase* CS=nullptr,
+          bool siteArg=false);
+      Function* getHookFunctionFor(CallBase* CS, Module& M, bool siteArg=false);
       Function* getHookFunctionFor(Function* origFunc, Module& M);
-      Function* createHookFunction(StringRef name, CallSite* call, Function* F, Module& M);
+      Function* createHookFunction(StringRef name, CallBase* call, Function* F, Module& M,
+          bool siteArg=false);
       Function* createHookFunction(StringRef name, Function* origFunc, Module& M);
-      bool createHookingCode(Function* origFunc, Function* F, Module& M);
+      Function* createHookWrapper(StringRef name, FunctionType* FT, Function* origFunc,
+          Module& M, CallBase* CS=nullptr, bool siteArg=false);
+      AttributeList getForwardedAttributes(Function* origFunc, CallBase* CS, Module& M);
+      void markForwardingTailCall(CallInst* call, Function* F);
+      void setForwardedCallAttributes(CallInst* call, Function* F, Module& M);
+      AttributeList removeMemoryAttributes(AttributeList attrs, Module& M);
+      bool createHookingCode(Function* origFunc, Function* F, Module& M,
+          bool registryArg=false, Function* impl=nullptr, bool siteArg=false);
+      bool useCalleeSideFor(Function& F);
+      bool instrumentDefinition(Function& F);
+      Value* loadHookRegistry(IRBuilder<>& irb, Function* origFunc, Module& M);
+      MDNode* getUnlikelyHooksWeights(Module& M);
 
       void addCallTarget(Function* calledFn, Module &M);
       Function* getOrAddInitializerToModule(Module &M);
       void declareLLTapFunctions(Module &M);
-      GlobalVariable* addFunctionNameAsStringConstant(Function* calledFn, Module &M);
+      string getTargetNameFor(Function* calledFn);
+      StructType* getHookRegistryType(Module& M);
+      GlobalVariable* getHookSlotFor(Function* calledFn, Module& M);
+      Value* loadHookFromRegistry(IRBuilder<>& irb, Value* registry, HookType type, Module& M);
+      GlobalVariable* addFunctionNameAsStringConstant(StringRef fname, Module &M);
+      void shareAcrossModules(GlobalObject* GO, Module& M);
+      bool useTargetSection(Module& M);
+      StructType* getTargetRecordType(Module& M);
+      void addTargetRecord(Constant* funcaddr, Constant* name, GlobalVariable* slot,
+          unsigned flags, Constant* sled, Constant* dispatcher, StringRef fname, Module& M);
+
+      // indirect call sites, collected before any code is generated
+      std::vector<CallInst*> indirectCalls;
+      // by the type, the parameter and return attributes and the calling convention of the calls
+      DenseMap<std::tuple<FunctionType*, AttributeList, unsigned>, Function*> indirectSlowPaths;
+      void collectIndirectCalls(Module& M);
+      bool instrumentIndirectCall(CallInst* call, Module& M);
+      StructType* getIndirectTargetType(Module& M);
+      Function* getIndirectSlowPathFor(CallInst* call, Module& M);
+      bool useSledFor(Function* calledFn, Module& M);
+      bool canUseSledFor(Function* calledFn, Module& M);
+      Function* getOrAddSledFor(Function* calledFn, Module& M);
+      Function* getOrAddTargetSectionRegistration(Module& M);
+
+      // calls redirected to a wrapper, which looks up the hooks of the target at runtime, and
+      // those of them passing their LLTapCallSiteRecord as last argument
+      DenseMap<CallInst*, Function*> instrumentedCalls;
+      SmallPtrSet<CallInst*, 32> siteArgCalls;
+      void versionHookedLoops(Module& M);
+      bool versionLoop(Loop* L, DominatorTree& DT, LoopInfo& LI, Module& M);
+
+      /**
+       * A call site, whose LLTapCallSiteRecord is emitted at the end of the module, once the
+       * target IDs are final. Until then the calls reference the placeholder.
+       */
+      struct CallSite {
+        GlobalVariable* placeholder;
+        Function* target;
+        Function* caller;
+        string file;
+        unsigned line;
+        unsigned column;
+      };
+      std::vector<CallSite> callSites;
+      StringMap<Constant*> callSiteFiles;
+      bool useCallSiteIdsFor(CallInst* call, Function* calledFn, Module& M);
+      StructType* getCallSiteRecordType(Module& M);
+      StructType* getCallContextType(Module& M);
+      Instruction* createCallContext(BasicBlock* entry_BB, BasicBlock* check_pre_bb,
+          BasicBlock* return_bb, Value* site, Module& M);
+      void createUnwindCleanup(Function* F,
+          ArrayRef<std::pair<GlobalVariable*, Instruction*>> restores, Module& M);
+      void createTraceCode(BasicBlock* entry_BB, BasicBlock* check_pre_bb, BasicBlock* return_bb,
+          Value* registry, ArrayRef<Value*> params, Value* ret, Value* site, Module& M);
+      Constant* addCallSite(CallInst* call, Function* calledFn, Module& M);
+      void addCallSiteTable(Module& M);
+
+  };
+
+
+  /**
+   * LLTap instrumentation for the new pass manager. Every run gets a fresh InstrumentationPass, so
+   * no state is carried over from a previous module.
+   */
+  class InstrumentationModulePass : public PassInfoMixin<InstrumentationModulePass> {
+
+    public:
+      explicit InstrumentationModulePass(LinkTime linkTime = LinkTime::none)
+        : linkTime(linkTime) {}
+
+      PreservedAnalyses run(Module& M, ModuleAnalysisManager& MAM) {
+        InstrumentationPass pass;
+        pass.linkTime = linkTime;
+        if (! pass.runOnModule(M)) {
+          return PreservedAnalyses::all();
+        }
+        return PreservedAnalyses::none();
+      }
+
+      // the hook wrappers must be generated even for optnone functions at -O0
+      static bool isRequired() {
+        return true;
+      }
 
+    private:
+      LinkTime linkTime;
   };
 }
 
@@ -157,8 +435,7 @@ cl::opt<InstrumentationMode> InstMode(cl::desc("Choose what calls LLTap instrume
       clEnumVal(inst_e,
         "Instrument only 'external' calls, which are only declared in the module."),
       clEnumVal(inst_ie,
-        "Instrument all types of calls"),
-      clEnumValEnd),
+        "Instrument all types of calls")),
     cl::cat(LLTapCat));
 
 cl::list<string> InstrumentFunctions("inst-func",
@@ -177,16 +454,243 @@ cl::opt<string> NoInstrumentFunctionsRegexRaw("no-inst-funcs-re",
     cl::desc("Regex to match functions not to be instrumented."),
     cl::cat(LLTapCat));
 
+cl::list<string> InstrumentCallers("inst-caller",
+    cl::desc("Instrument only calls from this function. (Use multiple times for more functions)"),
+    cl::cat(LLTapCat));
+
+cl::opt<string> InstrumentCallersRegexRaw("inst-callers-re",
+    cl::desc("Regex to match functions whose calls are instrumented."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> InstrumentCallerFilesRegexRaw("inst-caller-files-re",
+    cl::desc("Regex to match source files whose calls are instrumented. The file of a function "
+      "is taken from its debug info, without debug info it is the source file of the module."),
+    cl::cat(LLTapCat));
+
+cl::list<string> NoInstrumentCallers("no-inst-caller",
+    cl::desc("Don't instrument calls from this function. (Use multiple times for more functions)"),
+    cl::cat(LLTapCat));
+
+cl::opt<string> NoInstrumentCallersRegexRaw("no-inst-callers-re",
+    cl::desc("Regex to match functions whose calls are not instrumented."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> NoInstrumentCallerFilesRegexRaw("no-inst-caller-files-re",
+    cl::desc("Regex to match source files whose calls are not instrumented."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> InstrumentModulesRegexRaw("inst-modules-re",
+    cl::desc("Regex to match the identifiers of modules whose calls are instrumented."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> NoInstrumentModulesRegexRaw("no-inst-modules-re",
+    cl::desc("Regex to match the identifiers of modules whose calls are not instrumented."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> InstrumentationPolicyFile("inst-policy",
+    cl::desc("File of rules deciding which calls are instrumented, one rule per line: "
+      "'<instrument|skip> <callee regex> [caller=<regex>] [file=<regex>] [module=<regex>]'. "
+      "The first matching rule decides, calls matching no rule are left to the other filters."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> CountCalls("count-calls",
+    cl::init(false),
+    cl::desc("Don't instrument anything, but count the calls of each callee from each caller. "
+      "The LLTap runtime writes the counts to the file named by LLTAP_CALL_COUNTS at exit."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> CallCountsFile("call-counts",
+    cl::desc("Call counts of a -count-calls build, used by -inst-budget instead of the PGO "
+      "profile of the module."),
+    cl::cat(LLTapCat));
+
+cl::opt<double> InstrumentationBudget("inst-budget",
+    cl::desc("Don't instrument the hottest calls, so the instrumented calls are at most this "
+      "percentage of all direct calls of a module. Needs -call-counts or a PGO profile."),
+    cl::cat(LLTapCat));
+
+cl::opt<BudgetAction> InstrumentationBudgetAction("inst-budget-action",
+    cl::desc("What happens to the calls exceeding the -inst-budget"),
+    cl::init(BudgetAction::skip),
+    cl::values(
+      clEnumValN(BudgetAction::skip, "skip",
+        "Don't instrument them (default)"),
+      clEnumValN(BudgetAction::sled, "sled",
+        "Call their targets through patchable sleds where possible (see -patchable-sleds), "
+        "otherwise skip them")),
+    cl::cat(LLTapCat));
+
+cl::opt<string> InstrumentationBudgetReport("inst-budget-report",
+    cl::desc("Append the calls excluded by the -inst-budget and why to this file, '-' for stderr."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> CallSiteIds("call-site-ids",
+    cl::init(false),
+    cl::desc("Pass a record of the caller, source location and target of each instrumented call "
+      "to its wrapper. While the hooks run, __lltap_call_site points to it."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> CallContexts("call-contexts",
+    cl::init(false),
+    cl::desc("Reserve a LLTapCallContext on the stack of each hooked call, which the hooks of the "
+      "call can reach through __lltap_call_context."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> TraceCalls("trace-calls",
+    cl::init(false),
+    cl::desc("Let the built-in tracer of the runtime record the calls of targets without static "
+      "hooks (see lltap_trace_start)."),
+    cl::cat(LLTapCat));
 
 cl::opt<string> HookNamespace("hook-namespace",
     cl::desc("hook targets are registered using this namespace."),
     cl::cat(LLTapCat));
 
+cl::opt<string> TargetIdsFile("target-ids",
+    cl::desc("File mapping target names to target IDs, one name per line. It is read before and "
+      "updated after instrumenting a module, which keeps IDs unique across modules. Targets get "
+      "no ID without it."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> TargetIdHeader("target-id-header",
+    cl::desc("Write a C header defining LLTAP_TARGET_ID_<name> for every target ID to this file. "
+      "Requires -target-ids."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> NoTargetSection("no-target-section",
+    cl::init(false),
+    cl::desc("Register hook targets from a module constructor instead of a section of target "
+      "records. Non-ELF targets always use the constructor."),
+    cl::cat(LLTapCat));
+
+cl::opt<string> StaticHooksFile("static-hooks",
+    cl::desc("Manifest of hooks which are called directly instead of being looked up in the LLTap "
+      "runtime. Each line has the form "
+      "'<target> <pre|replace|post|post-byref> <hook function>'."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> StaticHooksKillSwitch("static-hooks-kill-switch",
+    cl::init(false),
+    cl::desc("Call the static hooks only while the global lltap_static_hooks_enabled is non-zero."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> InstrumentIndirectCalls("inst-indirect-calls",
+    cl::init(false),
+    cl::desc("Instrument indirect call sites. Each site caches the hook slots of the functions it "
+      "called recently."),
+    cl::cat(LLTapCat));
+
+cl::opt<unsigned> IndirectCacheSize("indirect-cache-size",
+    cl::init(2),
+    cl::desc("Number of callees cached per indirect call site (default 2)."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> CalleeSide("callee-side",
+    cl::init(false),
+    cl::desc("Instrument functions defined in the module once at their entry instead of at every "
+      "call site. This also covers indirect calls and calls from other modules."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> PatchableSleds("patchable-sleds",
+    cl::init(false),
+    cl::desc("Call hook targets through a patchable sled, which the LLTap runtime redirects to the "
+      "hook wrapper only while hooks are installed. Only supported on x86-64 ELF."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> SplitHookWrappers("split-hook-wrappers",
+    cl::init(false),
+    cl::desc("Generate hook wrappers as an inlinable check for installed hooks, which calls an "
+      "outlined cold function only if there are any."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> VersionHookedLoops("version-hooked-loops",
+    cl::init(false),
+    cl::desc("Clone loops with instrumented calls. The clone calls the targets directly and is run "
+      "instead of the loop while none of the targets has hooks."),
+    cl::cat(LLTapCat));
+
+cl::opt<unsigned> VersionHookedLoopsThreshold("version-hooked-loops-threshold",
+    cl::init(1000),
+    cl::desc("Only version loops with at most this many instructions (default 1000)."),
+    cl::cat(LLTapCat));
+
+cl::opt<bool> NoHookSlots("no-hook-slots",
+    cl::init(false),
+    cl::desc("Fetch the hooks from the LLTap runtime on every call instead of using per-target "
+      "dispatch slots."),
+    cl::cat(LLTapCat));
+
+
+cl::opt<PipelinePoint> InstPipelinePoint("inst-pipeline-point",
+    cl::desc("Where the pass plugin adds LLTap to the default pipelines of the new pass manager"),
+    cl::init(PipelinePoint::pre_inline),
+    cl::values(
+      clEnumValN(PipelinePoint::pre_inline, "pre-inline",
+        "At the start of the pipeline, so every call is instrumented and the split hook wrappers "
+        "are inlined (default)"),
+      clEnumValN(PipelinePoint::post_inline, "post-inline",
+        "At the end of the pipeline, so calls which were inlined are not instrumented"),
+      clEnumValN(PipelinePoint::lto, "lto",
+        "Not when compiling, but in the ThinLTO backends at link time"),
+      clEnumValN(PipelinePoint::none, "none",
+        "Only run when requested with -passes=lltap-inst")),
+    cl::cat(LLTapCat));
+
 
 char LLTap::InstrumentationPass::ID = 0x42;
 static RegisterPass<LLTap::InstrumentationPass> IP("LLTapInst", "LLTap instrumentation pass");
 
 
+/**
+ * Entry point of the plugin for the new pass manager, e.g. clang -fpass-plugin=libLLTap.so or
+ * opt -load-pass-plugin=libLLTap.so -passes=lltap-inst.
+ */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "LLTap", LLVM_VERSION_STRING, [](PassBuilder& PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef name, ModulePassManager& MPM, ArrayRef<PassBuilder::PipelineElement>) {
+          if (name == "lltap-inst") {
+            MPM.addPass(InstrumentationModulePass());
+            return true;
+          }
+          // for the merged module of a full LTO link, e.g. lltap-inst-lto,lto<O2>
+          if (name == "lltap-inst-lto") {
+            MPM.addPass(InstrumentationModulePass(LinkTime::whole_program));
+            return true;
+          }
+          return false;
+        });
+
+    // Only the pipelines used when compiling start with the PipelineStart extension point, the
+    // ThinLTO backend pipeline starts with the early simplification.
+    auto compiling = std::make_shared<bool>(false);
+
+    PB.registerPipelineStartEPCallback(
+        [compiling](ModulePassManager& MPM, OptimizationLevel level) {
+          *compiling = true;
+          if (InstPipelinePoint == PipelinePoint::pre_inline) {
+            MPM.addPass(InstrumentationModulePass());
+          }
+        });
+
+    PB.registerPipelineEarlySimplificationEPCallback(
+        [compiling](ModulePassManager& MPM, OptimizationLevel level) {
+          if (InstPipelinePoint == PipelinePoint::lto && ! *compiling) {
+            MPM.addPass(InstrumentationModulePass(LinkTime::thin_backend));
+          }
+          *compiling = false;
+        });
+
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager& MPM, OptimizationLevel level) {
+          if (InstPipelinePoint == PipelinePoint::post_inline) {
+            MPM.addPass(InstrumentationModulePass());
+          }
+        });
+  }};
+}
+
+
 /**
  * This function takes a CallSite parameter and mangles the called function's name by appending
  * parameter types. (kind of like c++ does it, but more primitive)
@@ -200,36 +704,50 @@ static RegisterPass<LLTap::InstrumentationPass> IP("LLTapInst", "LLTap instrumen
  * combination of types in the varargs call.
  *
  */
-string LLTap::InstrumentationPass::mangleFunctionArgs(CallSite* CS) {
+string LLTap::InstrumentationPass::mangleFunctionArgs(CallBase* CS) {
   string mangled = "";
-  DEBUG(dbgs() << "starting arg mangling\n");
-  for (size_t i = 0; i < CS->getNumArgOperands(); ++i) {
-    string typestr = "";
-    Type* type = CS->getArgument(i)->getType();
-    llvm::raw_string_ostream rso(typestr);
-    type->print(rso);
-    rso.flush();
-    DEBUG(dbgs() << "typestring arg " << i << " " << typestr << " (should be " << *type << ")\n");
-    Regex star("[\\*]");
-    Regex whitespace("\\s");
-    Regex printable("[^a-zA-Z0-9_]+");
-    while (star.match(typestr)) {
-      typestr = star.sub("p", typestr);
-    }
-    while (whitespace.match(typestr)) {
-      typestr = whitespace.sub("_", typestr);
-    }
-    while (printable.match(typestr)) {
-      typestr = printable.sub("", typestr);
-    }
-    DEBUG(dbgs() << "mangled type string " << typestr << "\n");
-    mangled += typestr;
+  for (size_t i = 0; i < CS->arg_size(); ++i) {
+    mangled += getMangledTypeName(CS->getArgOperand(i)->getType());
   }
 
+  LLVM_DEBUG(dbgs() << "mangled arguments " << mangled << "\n");
   return mangled;
 }
 
 
+/**
+ * Returns the printed type with '*' replaced by 'p', whitespace by '_' and all other characters,
+ * which are not allowed in C identifiers, removed. Types are uniqued by their LLVMContext, so this
+ * only prints every type once.
+ */
+const string& LLTap::InstrumentationPass::getMangledTypeName(Type* type) {
+  auto it = mangledTypes.find(type);
+  if (it != mangledTypes.end()) {
+    return it->second;
+  }
+
+  string typestr = "";
+  llvm::raw_string_ostream rso(typestr);
+  type->print(rso);
+  rso.flush();
+
+  string mangled = "";
+  mangled.reserve(typestr.size());
+  for (char c : typestr) {
+    if (c == '*') {
+      mangled += 'p';
+    } else if (isspace((unsigned char)c)) {
+      mangled += '_';
+    } else if (isalnum((unsigned char)c) || c == '_') {
+      mangled += c;
+    }
+  }
+  LLVM_DEBUG(dbgs() << "mangled type string " << typestr << " to " << mangled << "\n");
+
+  return mangledTypes[type] = mangled;
+}
+
+
 /**
  * Inserts the declaration of the LLTap runtime functions into the module.
  *
@@ -237,7 +755,6 @@ string LLTap::InstrumentationPass::mangleFunctionArgs(CallSite* CS) {
 void LLTap::InstrumentationPass::declareLLTapFunctions(Module &M) {
 
   PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
-  Type* i32 = IntegerType::get(M.getContext(), 32);
   //PointerType* voidptr = PointerType::getUnqual(Type::getVoidTy(M.getContext()));
   PointerType* voidptr = i8ptr;
   FunctionType *ft;
@@ -245,358 +762,2438 @@ void LLTap::InstrumentationPass::declareLLTapFunctions(Module &M) {
 
   // add function declarations to module:
 
-  // void lltap_add_hook_target(void* addr, char* name);
+  // const LLTapHookRegistry* lltap_get_hooks(void* addr);
+  PointerType* regptr = PointerType::getUnqual(getHookRegistryType(M));
   ftargs.clear();
   ftargs.push_back(voidptr);
-  ftargs.push_back(i8ptr);
   ft = FunctionType::get(
-      Type::getVoidTy(M.getContext()),
+      regptr,
       ftargs,
       false);
-  M.getOrInsertFunction(fn_lltap_add_hook, ft);
+  M.getOrInsertFunction(fn_lltap_get_hooks, ft);
 
-  // void* (void* addr, char* name);
+  // LLTapIndirectTarget* lltap_lookup_indirect(void* addr, LLTapIndirectTarget** cache,
+  //                                            unsigned size);
+  PointerType* entryptr = PointerType::getUnqual(getIndirectTargetType(M));
   ftargs.clear();
   ftargs.push_back(voidptr);
-  ftargs.push_back(i32);
+  ftargs.push_back(PointerType::getUnqual(entryptr));
+  ftargs.push_back(IntegerType::get(M.getContext(), 32));
   ft = FunctionType::get(
-      voidptr,
+      entryptr,
       ftargs,
       false);
-  M.getOrInsertFunction(fn_lltap_get_hook, ft);
+  M.getOrInsertFunction(fn_lltap_lookup_indirect, ft);
 
-  // int (void* addr);
+  // void lltap_add_hook_targets(LLTapTargetRecord* begin, LLTapTargetRecord* end);
+  PointerType* recptr = PointerType::getUnqual(getTargetRecordType(M));
   ftargs.clear();
-  ftargs.push_back(voidptr);
+  ftargs.push_back(recptr);
+  ftargs.push_back(recptr);
   ft = FunctionType::get(
-      i32,
+      Type::getVoidTy(M.getContext()),
       ftargs,
       false);
-  M.getOrInsertFunction(fn_lltap_has_hooks, ft);
-}
+  M.getOrInsertFunction(fn_lltap_add_targets, ft);
 
+  if (CallSiteIds) {
+    // void lltap_add_call_sites(LLTapCallSiteRecord* begin, LLTapCallSiteRecord* end);
+    PointerType* siteptr = PointerType::getUnqual(getCallSiteRecordType(M));
+    ftargs.clear();
+    ftargs.push_back(siteptr);
+    ftargs.push_back(siteptr);
+    ft = FunctionType::get(
+        Type::getVoidTy(M.getContext()),
+        ftargs,
+        false);
+    M.getOrInsertFunction(fn_lltap_add_call_sites, ft);
 
-/**
- * Loop over all functions in the given function and apply instrumentation.
- *
- */
-bool LLTap::InstrumentationPass::runOnModule(Module &M) {
+    // __thread LLTapCallSiteRecord* __lltap_call_site;
+    if (M.getNamedGlobal(LLTAP_CALL_SITE) == nullptr) {
+      GlobalVariable* current = new GlobalVariable(M, siteptr, false,
+          GlobalValue::ExternalLinkage, nullptr, LLTAP_CALL_SITE);
+      current->setThreadLocal(true);
+    }
+  }
 
-  DEBUG(dbgs() << "running on module: " << M.getModuleIdentifier() << "\n");
+  if (CallContexts) {
+    // __thread LLTapCallContext* __lltap_call_context;
+    if (M.getNamedGlobal(LLTAP_CALL_CONTEXT) == nullptr) {
+      GlobalVariable* current = new GlobalVariable(M,
+          PointerType::getUnqual(getCallContextType(M)), false,
+          GlobalValue::ExternalLinkage, nullptr, LLTAP_CALL_CONTEXT);
+      current->setThreadLocal(true);
+    }
 
-  declareLLTapFunctions(M);
+    // __thread unsigned __lltap_thread_id;
+    IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+    if (M.getNamedGlobal(LLTAP_THREAD_ID) == nullptr) {
+      GlobalVariable* tid = new GlobalVariable(M, i32, false,
+          GlobalValue::ExternalLinkage, nullptr, LLTAP_THREAD_ID);
+      tid->setThreadLocal(true);
+    }
 
-  // then instrument all the functions
-  for (Function& F : M.getFunctionList()) {
-    runOnFunction(F);
+    // unsigned lltap_inst_thread_id(void);
+    M.getOrInsertFunction(fn_lltap_thread_id, FunctionType::get(i32, false));
   }
 
-  //DEBUG(dbgs() << "creating the following module" << M << "\n");
+  if (TraceCalls) {
+    IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+    IntegerType* i64 = IntegerType::get(M.getContext(), 64);
 
-  return true;
+    // unsigned long long lltap_trace_clock(void);
+    M.getOrInsertFunction(fn_lltap_trace_clock, FunctionType::get(i64, false));
+
+    // void lltap_trace_call(LLTapHookRegistry* hooks, unsigned call_site_id,
+    //                       unsigned long long start, unsigned long long* args, unsigned nargs,
+    //                       unsigned long long ret);
+    Type* params[] = {
+      regptr,
+      i32,
+      i64,
+      PointerType::getUnqual(i64),
+      i32,
+      i64,
+    };
+    M.getOrInsertFunction(fn_lltap_trace_call,
+        FunctionType::get(Type::getVoidTy(M.getContext()), params, false));
+  }
 }
 
 
 /**
- * Add a function to the global constructor table of the given module.
+ * Returns the type of the LLTapHookRegistry struct of the LLTap runtime:
+ * struct LLTapHookRegistry {
+ *   int bitmap; LLTapHook pre_hook, replace_hook, post_hook; unsigned target_id;
+ * };
  */
-void LLTap::InstrumentationPass::addToGlobalCtors(Module& M, Function* fn) {
-  // just use the LLVM provided function for this.
-  appendToGlobalCtors(M, fn, DEFAULT_CTOR_PRIORITY);
-}
+StructType* LLTap::InstrumentationPass::getHookRegistryType(Module& M) {
+  StructType* regty = StructType::getTypeByName(M.getContext(), LLTAP_REGISTRY_TYPENAME);
 
-/**
- * Create the initializer function as a global constructor function. This initializer contains
- * calls to the LLTap runtime which registers a hook, by giving it a pointer to the function and
- * the name for the function.
- */
-Function* LLTap::InstrumentationPass::getOrAddInitializerToModule(Module& M) {
+  if (regty == nullptr) {
+    PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+    Type* elems[] = {
+      IntegerType::get(M.getContext(), 32),
+      voidptr,
+      voidptr,
+      voidptr,
+      IntegerType::get(M.getContext(), 32),
+    };
+    regty = StructType::create(M.getContext(), elems, LLTAP_REGISTRY_TYPENAME);
+  }
 
-  string name = "__lltap_init_";
-  name.append(M.getName());
+  return regty;
+}
 
-  Function* initFn = M.getFunction(name);
 
-  if (initFn == NULL) {
-    // need to create the function
+/**
+ * Returns the type of the LLTapTargetRecord struct of the LLTap runtime:
+ * struct LLTapTargetRecord {
+ *   void* addr; char* name; LLTapHookSlot* slot; unsigned id; unsigned flags;
+ *   void* sled; void* dispatcher;
+ * };
+ */
+StructType* LLTap::InstrumentationPass::getTargetRecordType(Module& M) {
+  StructType* recty = StructType::getTypeByName(M.getContext(), LLTAP_TARGET_RECORD_TYPENAME);
 
-    std::vector<Type*> args;
-    FunctionType* FT = FunctionType::get(
-        /*Result=*/Type::getVoidTy(M.getContext()),
-        /*Params=*/args,
-        /*isVarArg=*/false);
+  if (recty == nullptr) {
+    PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+    Type* elems[] = {
+      voidptr,
+      voidptr,
+      PointerType::getUnqual(PointerType::getUnqual(getHookRegistryType(M))),
+      IntegerType::get(M.getContext(), 32),
+      IntegerType::get(M.getContext(), 32),
+      voidptr,
+      voidptr,
+    };
+    recty = StructType::create(M.getContext(), elems, LLTAP_TARGET_RECORD_TYPENAME);
+  }
 
-    initFn = Function::Create(FT, Function::ExternalLinkage, name, &M);
+  return recty;
+}
 
-    BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", initFn);
-    IRBuilder<> irb(BB);
-    irb.CreateRetVoid();
 
-    //DEBUG(dbgs() << "created function:" << *BB << "\n");
+/**
+ * Returns the type of the LLTapCallSiteRecord struct of the LLTap runtime:
+ * struct LLTapCallSiteRecord {
+ *   void* target; char* caller; char* file; unsigned line; unsigned column; unsigned target_id;
+ *   unsigned id;
+ * };
+ */
+StructType* LLTap::InstrumentationPass::getCallSiteRecordType(Module& M) {
+  StructType* recty = StructType::getTypeByName(M.getContext(), LLTAP_CALL_SITE_RECORD_TYPENAME);
 
-    addToGlobalCtors(M, initFn);
+  if (recty == nullptr) {
+    PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+    IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+    Type* elems[] = {
+      voidptr,
+      voidptr,
+      voidptr,
+      i32,
+      i32,
+      i32,
+      i32,
+    };
+    recty = StructType::create(M.getContext(), elems, LLTAP_CALL_SITE_RECORD_TYPENAME);
   }
 
-  return initFn;
+  return recty;
 }
 
 
 /**
- * Saves the name of a function in a string. This is used as a quick and dirty way to tell the
- * LLTap runtime about the name of a function.
+ * Reserves the LLTapCallContext of a hooked call in the entry block of its wrapper. check_pre
+ * fills it in and publishes it in __lltap_call_context, return restores the context of the
+ * enclosing call. A thread gets its ID from the runtime on its first hooked call, afterwards it is
+ * read from __lltap_thread_id. Returns the load of the enclosing context.
  */
-GlobalVariable* LLTap::InstrumentationPass::addFunctionNameAsStringConstant(Function* calledFn, Module &M) {
-  string fname = calledFn->getName();
-  size_t size = fname.size() + 1;
-  string varname = ".__lltap_fname_";
-  varname.append(fname);
-
-  ArrayType* strty = ArrayType::get(IntegerType::get(M.getContext(), 8), size);
-  //PointerType* strpty = PointerType::get(strty, 0);
-
-  GlobalVariable* gvar = new GlobalVariable(
-      /*Module=*/M,
-      /*Type=*/strty,
-      /*isConstant=*/true,
-      /*Linkage=*/GlobalValue::PrivateLinkage,
-      /*Initializer=*/0, // has initializer, specified below
-      /*Name=*/varname);
-  gvar->setAlignment(1);
-
-  // Constant Definitions
-  Constant *data = ConstantDataArray::getString(M.getContext(), fname, true);
+Instruction* LLTap::InstrumentationPass::createCallContext(BasicBlock* entry_BB,
+    BasicBlock* check_pre_bb, BasicBlock* return_bb, Value* site, Module& M) {
+  StructType* ctxty = getCallContextType(M);
+  IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+  GlobalVariable* current = M.getNamedGlobal(LLTAP_CALL_CONTEXT);
+  GlobalVariable* tidvar = M.getNamedGlobal(LLTAP_THREAD_ID);
+
+  IRBuilder<> entry(entry_BB, entry_BB->getFirstInsertionPt());
+  AllocaInst* ctx = entry.CreateAlloca(ctxty, nullptr, "ctx");
+
+  // check_pre --> assign_thread_id (if the thread has no ID yet)
+  //           --> the rest of check_pre, which fills in the context
+  IRBuilder<> check_pre(check_pre_bb, check_pre_bb->getFirstInsertionPt());
+  Value* tid = check_pre.CreateLoad(i32, tidvar, "thread_id");
+  Value* no_tid = check_pre.CreateIsNull(tid);
+  Instruction* assign_term = SplitBlockAndInsertIfThen(no_tid, &*check_pre.GetInsertPoint(),
+      /*Unreachable=*/false, MDBuilder(M.getContext()).createBranchWeights(1, 2000));
+  BasicBlock* assign_bb = assign_term->getParent();
+  assign_bb->setName("assign_thread_id");
+  IRBuilder<> assign(assign_term);
+  Value* assigned = assign.CreateCall(M.getFunction(fn_lltap_thread_id));
+
+  BasicBlock* fill_bb = assign_term->getSuccessor(0);
+  IRBuilder<> fill(fill_bb, fill_bb->getFirstInsertionPt());
+  PHINode* phi = fill.CreatePHI(i32, 2, "thread_id");
+  phi->addIncoming(tid, check_pre_bb);
+  phi->addIncoming(assigned, assign_bb);
+
+  Type* datatype = ctxty->getElementType(0);
+  fill.CreateStore(Constant::getNullValue(datatype), fill.CreateStructGEP(ctxty, ctx, 0));
+  LoadInst* outer = fill.CreateLoad(current->getValueType(), current, "outer_ctx");
+  fill.CreateStore(outer, fill.CreateStructGEP(ctxty, ctx, 1));
+  fill.CreateStore(phi, fill.CreateStructGEP(ctxty, ctx, 2));
+  Value* site_id = ConstantInt::get(i32, LLTAP_NO_CALL_SITE_ID);
+  if (site != nullptr) {
+    StructType* recty = getCallSiteRecordType(M);
+    site_id = fill.CreateLoad(i32, fill.CreateStructGEP(recty, site, 6), "site_id");
+  }
+  fill.CreateStore(site_id, fill.CreateStructGEP(ctxty, ctx, 3));
+  fill.CreateStore(ctx, current);
 
-  // Global Variable Definitions
-  gvar->setInitializer(data);
+  IRBuilder<> return_irb(return_bb, return_bb->getFirstInsertionPt());
+  return_irb.CreateStore(outer, current);
 
-  return gvar;
+  return outer;
 }
 
 
-void LLTap::InstrumentationPass::addCallTarget(Function* calledFn, Module &M) {
+/**
+ * Turns the calls of a wrapper, which may unwind while the wrapper published its call site or
+ * context, into invokes of a cleanup that restores the outer ones from restores. Otherwise an
+ * exception thrown by a hook or the target would leave pointers into the unwound frame behind.
+ * The cleanup needs a personality function, so it is only added to modules which already use
+ * one.
+ */
+void LLTap::InstrumentationPass::createUnwindCleanup(Function* F,
+    ArrayRef<std::pair<GlobalVariable*, Instruction*>> restores, Module& M) {
+  Constant* personality = nullptr;
+  for (Function& other : M) {
+    if (other.hasPersonalityFn()) {
+      personality = other.getPersonalityFn();
+      break;
+    }
+  }
+  if (personality == nullptr) {
+    return;
+  }
 
-  if (calledFn->isIntrinsic()) {
+  DominatorTree DT(*F);
+  SmallVector<CallInst*, 8> calls;
+  for (Instruction& I : instructions(F)) {
+    CallInst* call = dyn_cast<CallInst>(&I);
+    if (call == nullptr || call->doesNotThrow() || call->isMustTailCall()
+        || isa<IntrinsicInst>(call)) {
+      continue;
+    }
+    bool published = std::all_of(restores.begin(), restores.end(),
+        [&](const std::pair<GlobalVariable*, Instruction*>& r) {
+          return DT.dominates(r.second, call);
+        });
+    if (published) {
+      calls.push_back(call);
+    }
+  }
+  if (calls.empty()) {
     return;
   }
 
-  string fname = "";
-  if (! HookNamespace.empty()) {
-    fname += HookNamespace + "_";
+  F->setPersonalityFn(personality);
+  BasicBlock* cleanup_bb = BasicBlock::Create(M.getContext(), "unwind_cleanup", F);
+  IRBuilder<> cleanup(cleanup_bb);
+  StructType* lpty = StructType::get(cleanup.getInt8PtrTy(), cleanup.getInt32Ty());
+  LandingPadInst* lp = cleanup.CreateLandingPad(lpty, 0);
+  lp->setCleanup(true);
+  for (const std::pair<GlobalVariable*, Instruction*>& r : restores) {
+    cleanup.CreateStore(r.second, r.first);
   }
-  fname += calledFn->getName();
+  cleanup.CreateResume(lp);
 
-  string varname = "__lltap_fname_";
-  varname.append(fname);
+  for (CallInst* call : calls) {
+    changeToInvokeAndSplitBasicBlock(call, cleanup_bb);
+  }
+}
+
+
+/**
+ * Converts a value to the raw word the tracer records for it: integers are zero extended,
+ * pointers and floating point values are recorded by their bits and anything else as 0.
+ */
+static Value* getTraceWord(IRBuilder<>& irb, Value* v) {
+  Type* ty = v->getType();
+  IntegerType* i64 = irb.getInt64Ty();
+  if (ty->isPointerTy()) {
+    return irb.CreatePtrToInt(v, i64);
+  }
+  if (ty->isFloatingPointTy() && ty->getPrimitiveSizeInBits() <= 64) {
+    v = irb.CreateBitCast(v, irb.getIntNTy(ty->getPrimitiveSizeInBits()));
+    ty = v->getType();
+  }
+  if (ty->isIntegerTy()) {
+    return irb.CreateZExtOrTrunc(v, i64);
+  }
+  return ConstantInt::get(i64, 0);
+}
+
+
+/**
+ * Records the calls of a target which the runtime marked as LLTAP_TRACED. check_pre reads the
+ * clock, return passes the start time, the arguments and the return value to the tracer. Targets
+ * which are only hooked skip both.
+ */
+void LLTap::InstrumentationPass::createTraceCode(BasicBlock* entry_BB, BasicBlock* check_pre_bb,
+    BasicBlock* return_bb, Value* registry, ArrayRef<Value*> params, Value* ret, Value* site,
+    Module& M) {
+  IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+  IntegerType* i64 = IntegerType::get(M.getContext(), 64);
+  StructType* regty = getHookRegistryType(M);
+  ArrayType* argsty = ArrayType::get(i64, LLTAP_TRACE_MAX_ARGS);
+  size_t nargs = std::min(params.size(), (size_t)LLTAP_TRACE_MAX_ARGS);
+
+  IRBuilder<> entry(entry_BB, entry_BB->getFirstInsertionPt());
+  AllocaInst* args = entry.CreateAlloca(argsty, nullptr, "trace_args");
+
+  // check_pre --> trace_start (if the target is traced)
+  //           --> the rest of check_pre
+  IRBuilder<> check_pre(check_pre_bb, check_pre_bb->getFirstInsertionPt());
+  Value* bitmap = check_pre.CreateLoad(regty->getElementType(0),
+      check_pre.CreateStructGEP(regty, registry, 0));
+  Value* traced = check_pre.CreateICmpNE(check_pre.CreateAnd(bitmap, LLTAP_TRACED),
+      ConstantInt::get(bitmap->getType(), 0), "traced");
+  Instruction* start_term = SplitBlockAndInsertIfThen(traced, &*check_pre.GetInsertPoint(),
+      /*Unreachable=*/false);
+  BasicBlock* start_bb = start_term->getParent();
+  start_bb->setName("trace_start");
+  IRBuilder<> start_irb(start_term);
+  Value* now = start_irb.CreateCall(M.getFunction(fn_lltap_trace_clock));
+
+  BasicBlock* rest_bb = start_term->getSuccessor(0);
+  IRBuilder<> rest(rest_bb, rest_bb->getFirstInsertionPt());
+  PHINode* start = rest.CreatePHI(i64, 2, "start");
+  start->addIncoming(ConstantInt::get(i64, 0), check_pre_bb);
+  start->addIncoming(now, start_bb);
+
+  // return --> trace_end (if the target is traced) --> ret
+  Instruction* end_term = SplitBlockAndInsertIfThen(traced, return_bb->getTerminator(),
+      /*Unreachable=*/false);
+  end_term->getParent()->setName("trace_end");
+  IRBuilder<> end(end_term);
+  for (size_t i = 0; i < nargs; ++i) {
+    end.CreateStore(getTraceWord(end, params[i]),
+        end.CreateConstInBoundsGEP2_32(argsty, args, 0, i));
+  }
+  Value* site_id = ConstantInt::get(i32, LLTAP_NO_CALL_SITE_ID);
+  if (site != nullptr) {
+    StructType* recty = getCallSiteRecordType(M);
+    site_id = end.CreateLoad(i32, end.CreateStructGEP(recty, site, 6), "site_id");
+  }
+  Value* trace_args[] = {
+    registry,
+    site_id,
+    start,
+    end.CreateConstInBoundsGEP2_32(argsty, args, 0, 0),
+    ConstantInt::get(i32, nargs),
+    (ret != nullptr) ? getTraceWord(end, ret) : ConstantInt::get(i64, 0),
+  };
+  end.CreateCall(M.getFunction(fn_lltap_trace_call), trace_args);
+}
+
+
+/**
+ * Returns the type of the LLTapCallContext struct of the LLTap runtime:
+ * struct LLTapCallContext {
+ *   unsigned long long data[LLTAP_CALL_CONTEXT_WORDS]; LLTapCallContext* outer;
+ *   unsigned thread_id; unsigned call_site_id;
+ * };
+ */
+StructType* LLTap::InstrumentationPass::getCallContextType(Module& M) {
+  StructType* ctxty = StructType::getTypeByName(M.getContext(), LLTAP_CALL_CONTEXT_TYPENAME);
+
+  if (ctxty == nullptr) {
+    IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+    ctxty = StructType::create(M.getContext(), LLTAP_CALL_CONTEXT_TYPENAME);
+    Type* elems[] = {
+      ArrayType::get(IntegerType::get(M.getContext(), 64), LLTAP_CALL_CONTEXT_WORDS),
+      PointerType::getUnqual(ctxty),
+      i32,
+      i32,
+    };
+    ctxty->setBody(elems);
+  }
+
+  return ctxty;
+}
+
+
+/**
+ * Loop over all functions in the given function and apply instrumentation.
+ *
+ */
+bool LLTap::InstrumentationPass::runOnModule(Module &M) {
+
+  LLVM_DEBUG(dbgs() << "running on module: " << M.getModuleIdentifier() << "\n");
+
+  // functions and types of a previous module may have been freed
+  instrumentDecisions.clear();
+  targetNames.clear();
+  calleeRules.clear();
+  callerScopes.clear();
+  mangledTypes.clear();
+  budgetExcluded.clear();
+  sledTargets.clear();
+
+  if (CountCalls) {
+    addCallCounters(M);
+    return true;
+  }
+
+  declareLLTapFunctions(M);
+  wrapperVariant = getWrapperVariant(M);
+  loadTargetIds();
+  applyBudget(M);
+  collectIndirectCalls(M);
+
+  // then instrument all the functions
+  for (Function& F : M.getFunctionList()) {
+    runOnFunction(F);
+  }
+
+  for (CallInst* call : indirectCalls) {
+    instrumentIndirectCall(call, M);
+  }
+  indirectCalls.clear();
+
+  if (VersionHookedLoops) {
+    versionHookedLoops(M);
+  }
+  instrumentedCalls.clear();
+  siteArgCalls.clear();
+
+  saveTargetIds();
+  addCallSiteTable(M);
+  targetRecords.clear();
+
+  //LLVM_DEBUG(dbgs() << "creating the following module" << M << "\n");
+
+  return true;
+}
+
+
+/**
+ * Add a function to the global constructor table of the given module.
+ */
+void LLTap::InstrumentationPass::addToGlobalCtors(Module& M, Function* fn) {
+  // just use the LLVM provided function for this.
+  appendToGlobalCtors(M, fn, DEFAULT_CTOR_PRIORITY);
+}
+
+/**
+ * Create the initializer function as a global constructor function. This initializer contains
+ * calls to the LLTap runtime which registers a hook, by giving it a pointer to the function and
+ * the name for the function.
+ */
+Function* LLTap::InstrumentationPass::getOrAddInitializerToModule(Module& M) {
+
+  string name = "__lltap_init_";
+  name.append(M.getName().str());
+
+  Function* initFn = M.getFunction(name);
+
+  if (initFn == NULL) {
+    // need to create the function
+
+    std::vector<Type*> args;
+    FunctionType* FT = FunctionType::get(
+        /*Result=*/Type::getVoidTy(M.getContext()),
+        /*Params=*/args,
+        /*isVarArg=*/false);
+
+    initFn = Function::Create(FT, Function::ExternalLinkage, name, &M);
+
+    BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", initFn);
+    IRBuilder<> irb(BB);
+    irb.CreateRetVoid();
+
+    //LLVM_DEBUG(dbgs() << "created function:" << *BB << "\n");
+
+    addToGlobalCtors(M, initFn);
+  }
+
+  return initFn;
+}
+
+
+/**
+ * Saves the name of a function in a string. This is used as a quick and dirty way to tell the
+ * LLTap runtime about the name of a function.
+ */
+GlobalVariable* LLTap::InstrumentationPass::addFunctionNameAsStringConstant(StringRef fname, Module &M) {
+  size_t size = fname.size() + 1;
+  string varname = "__lltap_fname_";
+  varname.append(fname.str());
+
+  ArrayType* strty = ArrayType::get(IntegerType::get(M.getContext(), 8), size);
+  //PointerType* strpty = PointerType::get(strty, 0);
+
+  GlobalVariable* gvar = new GlobalVariable(
+      /*Module=*/M,
+      /*Type=*/strty,
+      /*isConstant=*/true,
+      /*Linkage=*/GlobalValue::LinkOnceODRLinkage,
+      /*Initializer=*/0, // has initializer, specified below
+      /*Name=*/varname);
+  gvar->setAlignment(Align(1));
+  shareAcrossModules(gvar, M);
+
+  // Constant Definitions
+  Constant *data = ConstantDataArray::getString(M.getContext(), fname, true);
+
+  // Global Variable Definitions
+  gvar->setInitializer(data);
+
+  return gvar;
+}
+
+
+/**
+ * Let the linker keep only one copy of the given global per linked image. Every instrumented
+ * module emits the same wrappers, slots and names for a target, so this is given the
+ * linkonce_odr linkage and put into a COMDAT group of its own where supported. Hidden visibility
+ * keeps it local to each shared object, so references to it don't go through the GOT or PLT.
+ */
+void LLTap::InstrumentationPass::shareAcrossModules(GlobalObject* GO, Module& M) {
+  GO->setLinkage(GlobalValue::LinkOnceODRLinkage);
+  GO->setVisibility(GlobalValue::HiddenVisibility);
+  if (! Triple(M.getTargetTriple()).isOSBinFormatMachO()) {
+    GO->setComdat(M.getOrInsertComdat(GO->getName()));
+  }
+}
+
+
+/**
+ * Read the target IDs assigned when instrumenting previous modules from the -target-ids file. The
+ * ID of a target is the (zero based) line number of its name.
+ */
+void LLTap::InstrumentationPass::loadTargetIds() {
+  targetIds.clear();
+  targetIdNames.clear();
+  loadedTargetIds = 0;
+
+  if (TargetIdsFile.empty()) {
+    if (! TargetIdHeader.empty()) {
+      errs() << "Warning: -target-id-header requires -target-ids, targets get no IDs\n";
+    }
+    return;
+  }
+  if (! sys::fs::exists(TargetIdsFile)) {
+    return;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(TargetIdsFile);
+  if (! buf) {
+    errs() << "Warning: failed to read target IDs from " << TargetIdsFile << ": "
+      << buf.getError().message() << "\n";
+    return;
+  }
+
+  // the IDs of the names in the file never change, saveTargetIds only appends to it. The last
+  // line may be incomplete while another module appends, saveTargetIds reads it again anyway.
+  StringRef contents = (*buf)->getBuffer();
+  contents = contents.substr(0, contents.rfind('\n') + 1);
+  for (line_iterator line(MemoryBufferRef(contents, TargetIdsFile), /*SkipBlanks=*/false);
+      ! line.is_at_eof(); ++line) {
+    targetIds[*line] = targetIdNames.size();
+    targetIdNames.push_back(line->str());
+  }
+  loadedTargetIds = targetIdNames.size();
+  LLVM_DEBUG(dbgs() << "loaded " << targetIdNames.size() << " target IDs\n");
+}
+
+
+/**
+ * Assign the final IDs to the targets which are new in this module, append them to the
+ * -target-ids file and generate the -target-id-header. Modules may be instrumented in parallel,
+ * so this happens with the file locked and the file is read again: the new targets of this module
+ * get the IDs after the ones other modules appended meanwhile, so no ID is handed out twice. The
+ * target records of the module are updated with the final IDs.
+ */
+void LLTap::InstrumentationPass::saveTargetIds() {
+  // the backends of the other partitions run concurrently and never assign new IDs
+  if (linkTime == LinkTime::thin_backend || TargetIdsFile.empty()) {
+    return;
+  }
+
+  // the call site records are only emitted afterwards, but need the final IDs as well
+  for (CallSite& site : callSites) {
+    getTargetIdFor(getTargetNameFor(site.target));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream out(TargetIdsFile, EC, sys::fs::OF_Append);
+  if (EC) {
+    report_fatal_error(Twine("LLTap: failed to open target IDs ") + TargetIdsFile + ": "
+        + EC.message());
+  }
+  Expected<sys::fs::FileLocker> lock = out.lock();
+  if (! lock) {
+    report_fatal_error(Twine("LLTap: failed to lock target IDs ") + TargetIdsFile + ": "
+        + toString(lock.takeError()));
+  }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(TargetIdsFile,
+      /*IsText=*/false, /*RequiresNullTerminator=*/false, /*IsVolatile=*/true);
+  if (! buf) {
+    report_fatal_error(Twine("LLTap: failed to read target IDs ") + TargetIdsFile + ": "
+        + buf.getError().message());
+  }
+
+  std::vector<string> added(targetIdNames.begin() + loadedTargetIds, targetIdNames.end());
+  // with the whole program, the new IDs don't depend on the order in which modules were linked
+  if (linkTime == LinkTime::whole_program) {
+    std::sort(added.begin(), added.end());
+  }
+
+  targetIds.clear();
+  targetIdNames.clear();
+  StringRef contents = (*buf)->getBuffer();
+  for (line_iterator line(**buf, /*SkipBlanks=*/false); ! line.is_at_eof(); ++line) {
+    targetIds[*line] = targetIdNames.size();
+    targetIdNames.push_back(line->str());
+  }
+  // a module which failed while appending left an incomplete line, which keeps its ID
+  if (! contents.empty() && contents.back() != '\n') {
+    out << "\n";
+  }
+  for (const string& name : added) {
+    if (targetIds.find(name) == targetIds.end()) {
+      targetIds[name] = targetIdNames.size();
+      targetIdNames.push_back(name);
+      out << name << "\n";
+    }
+  }
+  loadedTargetIds = targetIdNames.size();
+  out.flush();
+  if (out.has_error()) {
+    report_fatal_error(Twine("LLTap: failed to write target IDs ") + TargetIdsFile + ": "
+        + out.error().message());
+  }
+
+  for (auto& record : targetRecords) {
+    GlobalVariable* rec = record.first;
+    ConstantStruct* init = cast<ConstantStruct>(rec->getInitializer());
+    SmallVector<Constant*, 8> fields;
+    for (unsigned i = 0; i < init->getNumOperands(); ++i) {
+      fields.push_back(init->getOperand(i));
+    }
+    fields[3] = ConstantInt::get(fields[3]->getType(), targetIds[record.second]);
+    rec->setInitializer(ConstantStruct::get(init->getType(), fields));
+  }
+
+  // still locked, so the header matches the file
+  if (! TargetIdHeader.empty()) {
+    writeTargetIdHeader();
+  }
+}
+
+
+/**
+ * Generate the -target-id-header with all IDs of the -target-ids file.
+ */
+void LLTap::InstrumentationPass::writeTargetIdHeader() {
+  std::error_code EC;
+  raw_fd_ostream out(TargetIdHeader, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Warning: failed to write target ID header " << TargetIdHeader << ": "
+      << EC.message() << "\n";
+    return;
+  }
+  out << "/* generated by the LLTap instrumentation pass */\n"
+    << "#ifndef LLTAP_TARGET_IDS_H\n"
+    << "#define LLTAP_TARGET_IDS_H 1\n\n";
+  for (size_t id = 0; id < targetIdNames.size(); ++id) {
+    string macro = targetIdNames[id];
+    for (char& c : macro) {
+      if (! isalnum((unsigned char)c)) {
+        c = '_';
+      }
+    }
+    out << "#define LLTAP_TARGET_ID_" << macro << " " << id << "\n";
+  }
+  out << "\n#define LLTAP_NUM_TARGET_IDS " << targetIdNames.size() << "\n"
+    << "\n#endif // LLTAP_TARGET_IDS_H\n";
+}
+
+
+/**
+ * Returns the ID of the given target and assigns the next free one if it has none yet. Such a new
+ * ID is provisional until \ref saveTargetIds. Without -target-ids, IDs would only be unique within
+ * a module, so targets get none.
+ */
+unsigned LLTap::InstrumentationPass::getTargetIdFor(StringRef fname) {
+  if (TargetIdsFile.empty()) {
+    return LLTAP_NO_TARGET_ID;
+  }
+
+  auto it = targetIds.find(fname);
+  if (it != targetIds.end()) {
+    return it->getValue();
+  }
+
+  // another partition might assign the same ID to a different target
+  if (linkTime == LinkTime::thin_backend) {
+    LLVM_DEBUG(dbgs() << "no target ID for " << fname << " in " << TargetIdsFile << "\n");
+    return LLTAP_NO_TARGET_ID;
+  }
+
+  unsigned id = targetIdNames.size();
+  targetIds[fname] = id;
+  targetIdNames.push_back(fname.str());
+  return id;
+}
+
+
+/**
+ * Whether hook targets are registered through a section of target records. This relies on the
+ * linker providing __start_ and __stop_ symbols for the section, which only ELF linkers do.
+ */
+bool LLTap::InstrumentationPass::useTargetSection(Module& M) {
+  return (! NoTargetSection) && Triple(M.getTargetTriple()).isOSBinFormatELF();
+}
+
+
+/**
+ * Emit a LLTapTargetRecord for the given target. With \ref useTargetSection it is put into the
+ * target record section, where the runtime finds all records of a linked image through the
+ * section bounds, so no code is needed per target. Otherwise it is registered from the module
+ * constructor.
+ */
+void LLTap::InstrumentationPass::addTargetRecord(Constant* funcaddr, Constant* name,
+    GlobalVariable* slot, unsigned flags, Constant* sled, Constant* dispatcher, StringRef fname,
+    Module& M) {
+
+  StructType* recty = getTargetRecordType(M);
+  PointerType* slotptr = PointerType::getUnqual(PointerType::getUnqual(getHookRegistryType(M)));
+  PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+
+  Constant* fields[] = {
+    funcaddr,
+    name,
+    (slot != nullptr) ? (Constant*)slot : ConstantPointerNull::get(slotptr),
+    ConstantInt::get(IntegerType::get(M.getContext(), 32), getTargetIdFor(fname)),
+    ConstantInt::get(IntegerType::get(M.getContext(), 32), flags),
+    (sled != nullptr) ? ConstantExpr::getBitCast(sled, voidptr) : ConstantPointerNull::get(voidptr),
+    (dispatcher != nullptr)
+      ? ConstantExpr::getBitCast(dispatcher, voidptr) : ConstantPointerNull::get(voidptr),
+  };
+
+  // modules without slots must not share a record with those that have one
+  GlobalVariable* rec = new GlobalVariable(
+      /*Module=*/M,
+      /*Type=*/recty,
+      /*isConstant=*/true,
+      /*Linkage=*/GlobalValue::PrivateLinkage,
+      /*Initializer=*/ConstantStruct::get(recty, fields),
+      /*Name=*/"__lltap_target_" + fname + (NoHookSlots ? ".n" : ""));
+  rec->setAlignment(M.getDataLayout().getPointerABIAlignment(0));
+  targetRecords.push_back(std::make_pair(rec, fname.str()));
+  // a single record per target and linked image, as long as the target is shared as well
+  if (slot == nullptr || ! slot->hasLocalLinkage()) {
+    shareAcrossModules(rec, M);
+  }
+
+  if (useTargetSection(M)) {
+    rec->setSection(LLTAP_TARGETS_SECTION);
+
+    // nothing references the record, keep it anyway
+    GlobalValue* used[] = { rec };
+    appendToUsed(M, used);
+
+    getOrAddTargetSectionRegistration(M);
+  } else {
+    Function* initfunc = getOrAddInitializerToModule(M);
+    IRBuilder<> irb(initfunc->getEntryBlock().getFirstNonPHIOrDbgOrLifetime());
+
+    SmallVector<Value*, 2> args;
+    args.push_back(rec);
+    args.push_back(ConstantExpr::getGetElementPtr(recty, rec,
+          ConstantInt::get(IntegerType::get(M.getContext(), 32), 1)));
+    irb.CreateCall(M.getFunction(fn_lltap_add_targets), args);
+  }
+}
+
+
+/**
+ * Create the constructor, which hands the target record section of the linked image to the LLTap
+ * runtime. It is emitted into a COMDAT in every module, so the linker keeps only one copy.
+ */
+Function* LLTap::InstrumentationPass::getOrAddTargetSectionRegistration(Module& M) {
+
+  Function* regFn = M.getFunction(fn_lltap_register_targets);
+
+  if (regFn == NULL) {
+    StructType* recty = getTargetRecordType(M);
+
+    // provided by the linker for every section with a C identifier as name
+    GlobalVariable* start = new GlobalVariable(M, recty, true, GlobalValue::ExternalWeakLinkage,
+        nullptr, "__start_" + LLTAP_TARGETS_SECTION);
+    start->setVisibility(GlobalValue::HiddenVisibility);
+    GlobalVariable* stop = new GlobalVariable(M, recty, true, GlobalValue::ExternalWeakLinkage,
+        nullptr, "__stop_" + LLTAP_TARGETS_SECTION);
+    stop->setVisibility(GlobalValue::HiddenVisibility);
+
+    std::vector<Type*> args;
+    FunctionType* FT = FunctionType::get(
+        /*Result=*/Type::getVoidTy(M.getContext()),
+        /*Params=*/args,
+        /*isVarArg=*/false);
+
+    regFn = Function::Create(FT, Function::LinkOnceODRLinkage, fn_lltap_register_targets, &M);
+    regFn->setVisibility(GlobalValue::HiddenVisibility);
+    regFn->setComdat(M.getOrInsertComdat(fn_lltap_register_targets));
+
+    BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", regFn);
+    IRBuilder<> irb(BB);
+    SmallVector<Value*, 2> callargs;
+    callargs.push_back(start);
+    callargs.push_back(stop);
+    irb.CreateCall(M.getFunction(fn_lltap_add_targets), callargs);
+    irb.CreateRetVoid();
+
+    addToGlobalCtors(M, regFn);
+  }
+
+  return regFn;
+}
+
+
+/**
+ * Returns the name under which the given function is registered as hook target.
+ */
+string LLTap::InstrumentationPass::getTargetNameFor(Function* calledFn) {
+  auto it = targetNames.find(calledFn);
+  if (it != targetNames.end()) {
+    return it->second;
+  }
+
+  string fname = "";
+  if (! HookNamespace.empty()) {
+    fname += HookNamespace + "_";
+  }
+  fname += calledFn->getName();
+  targetNames[calledFn] = fname;
+  return fname;
+}
+
+
+/**
+ * Register the given function as hook target with the LLTap runtime by a target record (see
+ * \ref addTargetRecord). Unless turned off with
+ * -no-hook-slots, this also creates the dispatch slot of the target, which the LLTap runtime keeps
+ * pointing to the currently installed hooks.
+ */
+void LLTap::InstrumentationPass::addCallTarget(Function* calledFn, Module &M) {
+
+  if (calledFn->isIntrinsic()) {
+    return;
+  }
+
+  // targets with static hooks are never looked up in the runtime
+  if (getStaticHooksFor(calledFn) != nullptr) {
+    return;
+  }
+
+  string fname = getTargetNameFor(calledFn);
+
+  string varname = "__lltap_fname_";
+  varname.append(fname);
+
+  if (M.getNamedValue(varname) == NULL) {
+
+    PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+    Constant* funcaddr = ConstantExpr::getCast(Instruction::BitCast, calledFn, voidptr);
+
+    GlobalVariable* namevar = addFunctionNameAsStringConstant(fname, M);
+    Constant* name = ConstantExpr::getPointerCast(namevar, voidptr);
+
+    GlobalVariable* slot = nullptr;
+    if (! NoHookSlots) {
+      PointerType* slotty = PointerType::getUnqual(getHookRegistryType(M));
+      slot = new GlobalVariable(
+          /*Module=*/M,
+          /*Type=*/slotty,
+          /*isConstant=*/false,
+          /*Linkage=*/GlobalValue::InternalLinkage,
+          /*Initializer=*/ConstantPointerNull::get(slotty),
+          /*Name=*/"__lltap_slot_" + fname);
+      slot->setAlignment(M.getDataLayout().getPointerABIAlignment(0));
+      // local functions of different modules may have the same name
+      if (! calledFn->hasLocalLinkage()) {
+        shareAcrossModules(slot, M);
+      }
+    }
+
+    // with a sled the wrapper is only entered once the runtime patched the sled
+    Function* sled = nullptr;
+    Function* dispatcher = nullptr;
+    if (useSledFor(calledFn, M)) {
+      sled = getOrAddSledFor(calledFn, M);
+      dispatcher = getHookFunctionFor(calledFn, M);
+    }
+
+    unsigned flags = useCalleeSideFor(*calledFn) ? LLTAP_TARGET_HOOKED_AT_ENTRY : 0;
+    addTargetRecord(funcaddr, name, slot, flags, sled, dispatcher, fname, M);
+  }
+
+}
+
+
+/**
+ * Whether calls to the given function go through a patchable sled (see -patchable-sleds). The
+ * sled jumps to the function by its symbol, so it must not be local.
+ */
+bool LLTap::InstrumentationPass::useSledFor(Function* calledFn, Module& M) {
+  if (! PatchableSleds && sledTargets.count(calledFn) == 0) {
+    return false;
+  }
+
+  return canUseSledFor(calledFn, M);
+}
+
+
+/**
+ * Whether calls to the given function can go through a patchable sled on the target platform.
+ */
+bool LLTap::InstrumentationPass::canUseSledFor(Function* calledFn, Module& M) {
+  Triple triple(M.getTargetTriple());
+  if (triple.getArch() != Triple::x86_64 || ! triple.isOSBinFormatELF()) {
+    return false;
+  }
+
+  return (! calledFn->isVarArg())
+    && (! calledFn->hasLocalLinkage())
+    && (! useCalleeSideFor(*calledFn))
+    && (! calledFn->getName().startswith("\1"))
+    && getStaticHooksFor(calledFn) == nullptr;
+}
+
+
+/**
+ * Returns the sled of the given target and emits it if it doesn't exist yet. The sled is a 5 byte
+ * NOP followed by a jmp to the target, written as module level assembly:
+ *
+ *     __lltap_sled_<fn>:
+ *       nopl 0x0(%rax,%rax,1)
+ *       jmp <fn>@PLT
+ *
+ * The runtime replaces the NOP with a jmp to the hook wrapper of the target while it has hooks.
+ * Every module emits the sled into the same COMDAT section, so a linked image has one sled per
+ * target.
+ */
+Function* LLTap::InstrumentationPass::getOrAddSledFor(Function* calledFn, Module& M) {
+  string sledname = "__lltap_sled_" + calledFn->getName().str();
+
+  Function* sled = M.getFunction(sledname);
+  if (sled != nullptr) {
+    return sled;
+  }
+
+  sled = Function::Create(calledFn->getFunctionType(), Function::ExternalLinkage, sledname, &M);
+  sled->setVisibility(GlobalValue::HiddenVisibility);
+  // the sled only jumps, so the target's ABI applies
+  sled->setCallingConv(calledFn->getCallingConv());
+  sled->setAttributes(getForwardedAttributes(calledFn, nullptr, M));
+
+  string fname = calledFn->getName().str();
+  M.appendModuleInlineAsm(
+      "\t.pushsection .text." + sledname + ",\"axG\",@progbits," + sledname + ",comdat\n"
+      "\t.weak " + sledname + "\n"
+      "\t.hidden " + sledname + "\n"
+      "\t.type " + sledname + ",@function\n"
+      // the NOP is replaced with a single 8 byte store
+      "\t.p2align 3\n" +
+      sledname + ":\n"
+      "\t.byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n"
+      "\tjmp " + fname + "@PLT\n"
+      "\t.size " + sledname + ", .-" + sledname + "\n"
+      "\t.popsection\n");
+
+  return sled;
+}
+
+
+/**
+ * Returns the dispatch slot of a target, which was created by \ref addCallTarget, or nullptr if
+ * dispatch slots are turned off.
+ */
+GlobalVariable* LLTap::InstrumentationPass::getHookSlotFor(Function* calledFn, Module& M) {
+  if (NoHookSlots) {
+    return nullptr;
+  }
+  return M.getNamedGlobal("__lltap_slot_" + getTargetNameFor(calledFn));
+}
+
+
+/**
+ * Load the hook of the given type from a LLTapHookRegistry. The registry is never modified after
+ * it was published by the runtime, so no atomic access is needed here.
+ */
+Value* LLTap::InstrumentationPass::loadHookFromRegistry(IRBuilder<>& irb, Value* registry,
+    HookType type, Module& M) {
+  unsigned field = 0;
+  switch (type) {
+    case HookType::PRE_HOOK:
+      field = 1;
+      break;
+    case HookType::REPLACE_HOOK:
+      field = 2;
+      break;
+    case HookType::POST_HOOK:
+    case HookType::POST_HOOK_BYREF:
+      field = 3;
+      break;
+  }
+  StructType* regty = getHookRegistryType(M);
+  Value* hookptr = irb.CreateStructGEP(regty, registry, field);
+  return irb.CreateLoad(regty->getElementType(field), hookptr);
+}
+
+bool LLTap::InstrumentationPass::isUseInLLTapHook(User* user) {
+  if (Instruction* inst = dyn_cast<Instruction>(user)) {
+    LLVM_DEBUG(dbgs() << "user" << *user << "is inside a lltap generated function: skipping\n");
+    return lltapHookFunctions.count(inst->getParent()->getParent()) == 1;
+  }
+
+  return true;
+}
+
+
+
+/**
+ * Compile the regex of a command line filter, nullptr if the option is empty. An invalid regex
+ * would otherwise silently match nothing.
+ */
+static Regex* compileFilterRegex(StringRef raw, StringRef option) {
+  if (raw.empty()) {
+    return nullptr;
+  }
+
+  string error;
+  Regex* re = new Regex(raw);
+  if (! re->isValid(error)) {
+    report_fatal_error(Twine("LLTap: invalid ") + option + ": " + error);
+  }
+  LLVM_DEBUG(dbgs() << option << " regex: " << raw << "\n");
+  return re;
+}
+
+/**
+ * Parse cli args
+ */
+void LLTap::InstrumentationPass::initializeInstConfig() {
+
+  LLVM_DEBUG(dbgs() << "Initializing instrumentation configuration\n");
+
+  LLVM_DEBUG(dbgs() << "going to instrument calls to ");
+  for (StringRef s : InstrumentFunctions) {
+    instrumentCallsTo.insert(s);
+    LLVM_DEBUG(dbgs() << s << ", ");
+  }
+  LLVM_DEBUG(dbgs() << "\n");
+
+  LLVM_DEBUG(dbgs() << "going to skip instrumentation of calls to ");
+  for (StringRef s : NoInstrumentFunctions) {
+    noInstrumentCallsTo.insert(s);
+    LLVM_DEBUG(dbgs() << s << ", ");
+  }
+  LLVM_DEBUG(dbgs() << "\n");
+
+  instrumentCallsRe = compileFilterRegex(InstrumentFunctionsRegexRaw, "-inst-funcs-re");
+  noInstrumentCallsRe = compileFilterRegex(NoInstrumentFunctionsRegexRaw, "-no-inst-funcs-re");
+
+  for (StringRef s : InstrumentCallers) {
+    instrumentCallsFrom.insert(s);
+  }
+  for (StringRef s : NoInstrumentCallers) {
+    noInstrumentCallsFrom.insert(s);
+  }
+  instrumentCallersRe = compileFilterRegex(InstrumentCallersRegexRaw, "-inst-callers-re");
+  noInstrumentCallersRe = compileFilterRegex(NoInstrumentCallersRegexRaw, "-no-inst-callers-re");
+  instrumentCallerFilesRe = compileFilterRegex(InstrumentCallerFilesRegexRaw,
+      "-inst-caller-files-re");
+  noInstrumentCallerFilesRe = compileFilterRegex(NoInstrumentCallerFilesRegexRaw,
+      "-no-inst-caller-files-re");
+  instrumentModulesRe = compileFilterRegex(InstrumentModulesRegexRaw, "-inst-modules-re");
+  noInstrumentModulesRe = compileFilterRegex(NoInstrumentModulesRegexRaw, "-no-inst-modules-re");
+
+  loadPolicy();
+  loadStaticHooks();
+
+  instConfigInitialized = true;
+}
+
+
+/**
+ * Parse the -inst-policy file. The regexes of a rule have to match the whole name. Empty lines and
+ * lines starting with '#' are ignored.
+ */
+void LLTap::InstrumentationPass::loadPolicy() {
+  if (InstrumentationPolicyFile.empty()) {
+    return;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(InstrumentationPolicyFile);
+  if (! buf) {
+    report_fatal_error(Twine("failed to read instrumentation policy from ")
+        + InstrumentationPolicyFile + ": " + buf.getError().message());
+  }
+
+  for (line_iterator line(**buf, /*SkipBlanks=*/true, /*CommentMarker=*/'#');
+      ! line.is_at_eof(); ++line) {
+    string where = (Twine(InstrumentationPolicyFile) + ":" + Twine(line.line_number())).str();
+    StringRef rest = *line;
+    StringRef action, token;
+    std::tie(action, rest) = getToken(rest);
+    std::tie(token, rest) = getToken(rest);
+
+    PolicyRule rule;
+    if (action == "instrument") {
+      rule.instrument = true;
+    } else if (action != "skip") {
+      report_fatal_error(Twine("LLTap: unknown action '") + action + "' in " + where);
+    }
+    if (token.empty()) {
+      report_fatal_error(Twine("LLTap: missing callee in ") + where);
+    }
+
+    auto compile = [&](StringRef raw) {
+      string error;
+      std::unique_ptr<Regex> re(new Regex((Twine("^(") + raw + ")$").str()));
+      if (! re->isValid(error)) {
+        report_fatal_error(Twine("LLTap: invalid regex '") + raw + "' in " + where + ": " + error);
+      }
+      return re;
+    };
+
+    rule.callee = compile(token);
+    for (std::tie(token, rest) = getToken(rest); ! token.empty();
+        std::tie(token, rest) = getToken(rest)) {
+      StringRef key, raw;
+      std::tie(key, raw) = token.split('=');
+      if (key == "caller") {
+        rule.caller = compile(raw);
+      } else if (key == "file") {
+        rule.file = compile(raw);
+      } else if (key == "module") {
+        rule.module = compile(raw);
+      } else {
+        report_fatal_error(Twine("LLTap: unknown condition '") + token + "' in " + where);
+      }
+    }
+
+    LLVM_DEBUG(dbgs() << "policy rule " << policy.size() << ": " << *line << "\n");
+    policy.push_back(std::move(rule));
+  }
+}
+
+
+/**
+ * Parse the -static-hooks manifest. Empty lines and lines starting with '#' are ignored.
+ */
+void LLTap::InstrumentationPass::loadStaticHooks() {
+  if (StaticHooksFile.empty()) {
+    return;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(StaticHooksFile);
+  if (! buf) {
+    report_fatal_error(Twine("failed to read static hooks from ") + StaticHooksFile + ": "
+        + buf.getError().message());
+  }
+
+  for (line_iterator line(**buf, /*SkipBlanks=*/true, /*CommentMarker=*/'#');
+      ! line.is_at_eof(); ++line) {
+    string where = (Twine(StaticHooksFile) + ":" + Twine(line.line_number())).str();
+    StringRef rest = *line;
+    StringRef target, type, hook;
+    std::tie(target, rest) = getToken(rest);
+    std::tie(type, rest) = getToken(rest);
+    std::tie(hook, rest) = getToken(rest);
+
+    // like the policy, a skipped line would silently build a binary without the hook
+    if (hook.empty() || ! rest.trim().empty()) {
+      report_fatal_error(Twine("LLTap: malformed static hook in ") + where);
+    }
+    if (type != "pre" && type != "replace" && type != "post" && type != "post-byref") {
+      report_fatal_error(Twine("LLTap: unknown hook type '") + type + "' in " + where);
+    }
+
+    StaticHooks& statics = staticHooks[target];
+    if (type == "pre") {
+      statics.pre_hook = hook.str();
+    } else if (type == "replace") {
+      statics.replace_hook = hook.str();
+    } else if (type == "post") {
+      statics.post_hook = hook.str();
+      statics.post_hook_byref = false;
+    } else {
+      statics.post_hook = hook.str();
+      statics.post_hook_byref = true;
+    }
+    LLVM_DEBUG(dbgs() << "static " << type << " hook " << hook << " for " << target << "\n");
+  }
+}
+
+
+/**
+ * Returns the static hooks of the given target or nullptr if its hooks are looked up at runtime.
+ */
+StaticHooks* LLTap::InstrumentationPass::getStaticHooksFor(Function* calledFn) {
+  if (staticHooks.empty()) {
+    return nullptr;
+  }
+
+  auto it = staticHooks.find(getTargetNameFor(calledFn));
+  if (it == staticHooks.end()) {
+    return nullptr;
+  }
+  return &it->getValue();
+}
+
+
+/**
+ * Returns the static hook of the given type as i8*, or a null pointer if there is none. The hook
+ * is declared with the type the wrapper calls it with, so the call folds to a direct call.
+ */
+Value* LLTap::InstrumentationPass::getStaticHook(StaticHooks* statics, HookType type,
+    FunctionType* hookty, Module& M) {
+  PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+
+  const string* name = nullptr;
+  switch (type) {
+    case HookType::PRE_HOOK:
+      name = &statics->pre_hook;
+      break;
+    case HookType::REPLACE_HOOK:
+      name = &statics->replace_hook;
+      break;
+    case HookType::POST_HOOK:
+    case HookType::POST_HOOK_BYREF:
+      name = &statics->post_hook;
+      break;
+  }
+
+  if (name->empty()) {
+    return ConstantPointerNull::get(i8ptr);
+  }
+
+  Constant* hook = cast<Constant>(M.getOrInsertFunction(*name, hookty).getCallee());
+  if (Function* hookFn = dyn_cast<Function>(hook)) {
+    // calls in the hook itself must not be instrumented
+    lltapHookFunctions.insert(hookFn);
+  }
+  return ConstantExpr::getBitCast(hook, i8ptr);
+}
+
+
+/**
+ * Load the global kill switch of the static hooks. Every module defines it weakly, so it is also
+ * available if the program is not linked against the LLTap runtime.
+ */
+Value* LLTap::InstrumentationPass::loadStaticHooksEnabled(IRBuilder<>& irb, Module& M) {
+  IntegerType* i32 = IntegerType::get(M.getContext(), 32);
+
+  GlobalVariable* enabled = M.getNamedGlobal(LLTAP_STATIC_HOOKS_ENABLED);
+  if (enabled == nullptr) {
+    enabled = new GlobalVariable(
+        /*Module=*/M,
+        /*Type=*/i32,
+        /*isConstant=*/false,
+        /*Linkage=*/GlobalValue::WeakAnyLinkage,
+        /*Initializer=*/ConstantInt::get(i32, 1),
+        /*Name=*/LLTAP_STATIC_HOOKS_ENABLED);
+    enabled->setAlignment(Align(4));
+  }
+
+  LoadInst* val = irb.CreateLoad(i32, enabled, "static_hooks_enabled");
+  val->setAtomic(AtomicOrdering::Monotonic);
+  val->setAlignment(Align(4));
+  return val;
+}
+
+
+/**
+ * Check whether the given Function matches the instrumentation mode and regexes.
+ *
+ */
+bool LLTap::InstrumentationPass::shouldBeInstrumented(Function& F) {
+
+  // skip all lltap functions
+  if (F.getName().find("lltap") != string::npos) {
+    return false;
+  }
+
+  if (lltapHookFunctions.count(&F) == 1) {
+    return false;
+  }
+
+  if (matchesCalleeFilters(F)) {
+    return true;
+  }
+
+  // calls from some functions may still be instrumented by the policy
+  for (unsigned r : getPolicyRulesFor(&F)) {
+    if (policy[r].instrument) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Memoized \ref computeShouldBeInstrumented.
+ */
+bool LLTap::InstrumentationPass::matchesCalleeFilters(Function& F) {
+  auto it = instrumentDecisions.find(&F);
+  if (it != instrumentDecisions.end()) {
+    return it->second;
+  }
+
+  bool decision = computeShouldBeInstrumented(F);
+  instrumentDecisions[&F] = decision;
+  return decision;
+}
+
+
+/**
+ * Returns the indices of the policy rules whose callee regex matches the given function. Indirect
+ * calls (nullptr) have an empty callee name, so only rules like '.*' apply to them.
+ */
+const SmallVector<unsigned, 2>& LLTap::InstrumentationPass::getPolicyRulesFor(Function* callee) {
+  auto it = calleeRules.find(callee);
+  if (it != calleeRules.end()) {
+    return it->second;
+  }
+
+  SmallVector<unsigned, 2> rules;
+  StringRef name = (callee != nullptr) ? callee->getName() : "";
+  for (unsigned r = 0; r < policy.size(); ++r) {
+    if (policy[r].callee->match(name)) {
+      rules.push_back(r);
+    }
+  }
+  return calleeRules[callee] = std::move(rules);
+}
+
+
+/**
+ * Match the caller filters and the caller conditions of the policy rules against the given
+ * function once, calls outside of a function (nullptr) have an empty caller name.
+ */
+const CallerScope& LLTap::InstrumentationPass::getCallerScope(Function* caller, Module& M) {
+  auto it = callerScopes.find(caller);
+  if (it != callerScopes.end()) {
+    return it->second;
+  }
+
+  // indirect calls are collected before any callee is looked at
+  if (! instConfigInitialized) {
+    initializeInstConfig();
+  }
+
+  StringRef name = (caller != nullptr) ? caller->getName() : "";
+  StringRef file = M.getSourceFileName();
+  if (caller != nullptr && caller->getSubprogram() != nullptr) {
+    file = caller->getSubprogram()->getFilename();
+  }
+  StringRef module = M.getModuleIdentifier();
+
+  CallerScope scope;
+  scope.rules.resize(policy.size());
+  for (unsigned r = 0; r < policy.size(); ++r) {
+    const PolicyRule& rule = policy[r];
+    scope.rules[r] = (! rule.caller || (caller != nullptr && rule.caller->match(name)))
+      && (! rule.file || rule.file->match(file))
+      && (! rule.module || rule.module->match(module));
+  }
 
-  if (M.getNamedValue(varname) == NULL) {
+  if (! instrumentCallsFrom.empty() || instrumentCallersRe != nullptr
+      || instrumentCallerFilesRe != nullptr) {
+    scope.allowed = instrumentCallsFrom.count(name) > 0
+      || (instrumentCallersRe != nullptr && instrumentCallersRe->match(name))
+      || (instrumentCallerFilesRe != nullptr && instrumentCallerFilesRe->match(file));
+  }
+  if (instrumentModulesRe != nullptr && ! instrumentModulesRe->match(module)) {
+    scope.allowed = false;
+  }
+  if (noInstrumentCallsFrom.count(name) > 0
+      || (noInstrumentCallersRe != nullptr && noInstrumentCallersRe->match(name))
+      || (noInstrumentCallerFilesRe != nullptr && noInstrumentCallerFilesRe->match(file))
+      || (noInstrumentModulesRe != nullptr && noInstrumentModulesRe->match(module))) {
+    scope.allowed = false;
+  }
 
-    Function* initfunc = getOrAddInitializerToModule(M);
-    IRBuilder<> irb(initfunc->getEntryBlock().getFirstNonPHIOrDbgOrLifetime());
+  LLVM_DEBUG(dbgs() << "calls from " << name << " (" << file << ") are "
+      << (scope.allowed ? "" : "not ") << "allowed\n");
+  return callerScopes[caller] = std::move(scope);
+}
 
-    PointerType* voidptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
-    Constant* funcaddr = ConstantExpr::getCast(Instruction::BitCast, calledFn, voidptr);
 
-    Function* callee = M.getFunction(fn_lltap_add_hook);
+/**
+ * Decide whether the given call or use of callee at the given instruction is instrumented. The
+ * first policy rule matching both decides, otherwise the callee and caller filters have to agree.
+ * The callee is nullptr for indirect calls, the instruction for uses outside of any function.
+ */
+bool LLTap::InstrumentationPass::shouldInstrumentCall(Function* callee, Instruction* at,
+    Module& M) {
+  const CallerScope& scope = getCallerScope(at ? at->getFunction() : nullptr, M);
+  if (! policy.empty()) {
+    for (unsigned r : getPolicyRulesFor(callee)) {
+      if (scope.rules[r]) {
+        return policy[r].instrument;
+      }
+    }
+  }
 
-    Value* val = irb.CreateGlobalStringPtr(fname, varname);
+  return scope.allowed && (callee == nullptr || matchesCalleeFilters(*callee));
+}
 
-    SmallVector<Value*, 2> args;
-    args.push_back(funcaddr);
-    args.push_back(val);
 
-    //callee, args,
-    irb.CreateCall(callee, args);
+/**
+ * Apply the instrumentation mode and the white- and blacklists to the given function. Only called
+ * once per function by \ref shouldBeInstrumented.
+ */
+bool LLTap::InstrumentationPass::computeShouldBeInstrumented(Function& F) {
+
+  if (! instConfigInitialized) {
+    initializeInstConfig();
+  }
+
+  bool instModeFits = false;
+
+  if (InstMode > InstrumentationMode::inst_ie) {
+    if (InstMode == InstrumentationMode::inst_i && (! F.isDeclaration())) {
+      instModeFits = true;
+    } else if (InstMode == InstrumentationMode::inst_e && (F.isDeclaration())) {
+      instModeFits = true;
+    }
+  } else {
+    instModeFits = true;
+  }
+
+  bool shouldInstrumentF = false;
+
+  // check if we have whitelist
+  if (instrumentCallsTo.size() == 0 && instrumentCallsRe == nullptr) {
+    // nothing was specified --> instrument all
+    shouldInstrumentF = true;
+
+  } else {
+    // check the simple list
+    if (instrumentCallsTo.count(F.getName()) > 0) {
+      shouldInstrumentF = true;
+    }
+
+    // check regex
+    if (instrumentCallsRe != nullptr
+        && instrumentCallsRe->match(F.getName())) {
+      shouldInstrumentF = true;
+    }
+  }
+
+  // check blacklist
+  if (noInstrumentCallsTo.size() > 0) {
+    if (noInstrumentCallsTo.count(F.getName())) {
+      shouldInstrumentF = false;
+    }
+  }
+  // and blacklist regex
+  if (noInstrumentCallsRe != nullptr) {
+    if (noInstrumentCallsRe->match(F.getName())) {
+      shouldInstrumentF = false;
+    }
+  }
+
+  return shouldInstrumentF && instModeFits;
+}
+
+
+/**
+ * Instrument all uses of the given function. For each function it is checked whether it should be
+ * instrumented with \ref shouldBeInstrumented and for each use it is checked whether it is inside
+ * a function generated by this pass.
+ */
+bool LLTap::InstrumentationPass::runOnFunction(Function &F) {
+
+  bool changed = false;
+
+  //++FunctionsVisited;
+  LLVM_DEBUG(dbgs() << "Function: ");
+  LLVM_DEBUG(dbgs().write_escaped(F.getName()) << '\n');
+
+  if (! shouldBeInstrumented(F)) {
+    LLVM_DEBUG(dbgs() << "...skipping\n");
+    return false;
+  }
+
+  if (useCalleeSideFor(F)) {
+    return instrumentDefinition(F);
+  }
+
+  LLVM_DEBUG(dbgs() << "got " << F.getNumUses() << " uses\n");
+  SmallVector<User*, 16> worklist;
+  for (User* user : F.users()) {
+    LLVM_DEBUG(dbgs() << "found user " << *user << "\n");
+    worklist.push_back(user);
+  }
+
+  for (User* user : worklist) {
+    Instruction* at = dyn_cast<Instruction>(user);
+    if (isa<CallInst>(user) && budgetExcluded.count(std::make_pair(at->getFunction(), &F)) > 0) {
+      continue;
+    }
+    if (! isUseInLLTapHook(user) && shouldInstrumentCall(&F, at, *F.getParent())) {
+      if (isa<CallInst>(user)) {
+        //CallsFound++;
+        changed |= instrumentCall(cast<CallBase>(user), *(F.getParent()));
+      } else if (! DoNotInstrumentUses) {
+        if (F.isVarArg()) {
+          errs() << "Warning: cannot replace function pointer to varargs function ("
+            << F.getName() << ")\n";
+        } else {
+          changed |= instrumentUse(user, *F.getParent());
+        }
+        //UsesFound++;
+      }
+    }
   }
 
+  return changed;
 }
 
-bool LLTap::InstrumentationPass::isUseInLLTapHook(User* user) {
-  if (Instruction* inst = dyn_cast<Instruction>(user)) {
-    DEBUG(dbgs() << "user" << *user << "is inside a lltap generated function: skipping\n");
-    return lltapHookFunctions.count(inst->getParent()->getParent()) == 1;
+/**
+ * Whether the given function is instrumented at its definition (see -callee-side). Variadic
+ * functions can't forward their arguments, so their call sites are instrumented instead.
+ */
+bool LLTap::InstrumentationPass::useCalleeSideFor(Function& F) {
+  return CalleeSide && (! F.isDeclaration()) && (! F.isVarArg());
+}
+
+
+/**
+ * Move the body of the given function into the new internal function __lltap_impl_<name> and make
+ * the function itself call the hooks and the moved body. The function keeps its name, linkage and
+ * address, so all callers go through the hooks without changing any call site.
+ */
+bool LLTap::InstrumentationPass::instrumentDefinition(Function& F) {
+  Module& M = *F.getParent();
+
+  LLVM_DEBUG(dbgs() << "instrumenting definition of " << F.getName() << "\n");
+
+  Function* impl = Function::Create(F.getFunctionType(), GlobalValue::InternalLinkage,
+      "__lltap_impl_" + F.getName(), &M);
+  impl->copyAttributesFrom(&F);
+  impl->setLinkage(GlobalValue::InternalLinkage);
+  impl->setVisibility(GlobalValue::DefaultVisibility);
+
+  impl->getBasicBlockList().splice(impl->begin(), F.getBasicBlockList());
+  // the debug info describes the body, whose instructions are scoped to the subprogram. F itself
+  // only contains the generated hooking code, which has no source locations.
+  impl->setSubprogram(F.getSubprogram());
+  F.setSubprogram(nullptr);
+  auto implArg = impl->arg_begin();
+  for (Argument& arg : F.args()) {
+    implArg->takeName(&arg);
+    arg.replaceAllUsesWith(&*implArg);
+    ++implArg;
   }
 
+  // F may call the hooks now
+  F.setAttributes(removeMemoryAttributes(F.getAttributes(), M));
+
+  addCallTarget(&F, M);
+  createHookingCode(&F, &F, M, /*registryArg=*/false, impl);
+  // F now only contains the hooking code, the original body stays instrumented in impl
+  lltapHookFunctions.insert(&F);
+
   return true;
 }
 
 
 /**
- * Parse cli args
+ * Count the direct calls of each callee from each caller in a per module array (see
+ * -count-calls). A constructor passes the array and the names of the callers and callees to the
+ * LLTap runtime. The counters are incremented atomically, as -inst-budget relies on the counts of
+ * multithreaded runs as well.
  */
-void LLTap::InstrumentationPass::initializeInstConfig() {
+void LLTap::InstrumentationPass::addCallCounters(Module& M) {
+  MapVector<std::pair<Function*, Function*>, SmallVector<CallInst*, 2>> sites;
+  for (Function& F : M) {
+    if (F.isDeclaration() || F.getName().find("lltap") != string::npos) {
+      continue;
+    }
+    for (Instruction& I : instructions(F)) {
+      CallInst* call = dyn_cast<CallInst>(&I);
+      Function* callee = (call != nullptr) ? call->getCalledFunction() : nullptr;
+      if (callee != nullptr && ! callee->isIntrinsic()) {
+        sites[std::make_pair(&F, callee)].push_back(call);
+      }
+    }
+  }
+  if (sites.empty()) {
+    return;
+  }
 
-  DEBUG(dbgs() << "Initializing instrumentation configuration\n");
+  LLVMContext& C = M.getContext();
+  IntegerType* i64 = IntegerType::get(C, 64);
+  PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(C, 8));
+  ArrayType* countsty = ArrayType::get(i64, sites.size());
+  GlobalVariable* counts = new GlobalVariable(M, countsty, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(countsty), "__lltap_call_counts");
+  counts->setAlignment(Align(8));
+
+  // struct LLTapCallCountSite { const char* callee; const char* caller; };
+  StructType* sitety = StructType::get(C, {i8ptr, i8ptr});
+  auto getName = [&](Function* F) {
+    GlobalVariable* name = M.getNamedGlobal("__lltap_fname_" + F->getName().str());
+    if (name == nullptr) {
+      name = addFunctionNameAsStringConstant(F->getName(), M);
+    }
+    return ConstantExpr::getPointerCast(name, i8ptr);
+  };
 
-  DEBUG(dbgs() << "going to instrument calls to ");
-  for (StringRef s : InstrumentFunctions) {
-    instrumentCallsTo.insert(s);
-    DEBUG(dbgs() << s << ", ");
+  std::vector<Constant*> records;
+  unsigned index = 0;
+  for (auto& site : sites) {
+    records.push_back(ConstantStruct::get(sitety, {getName(site.first.second),
+          getName(site.first.first)}));
+    for (CallInst* call : site.second) {
+      IRBuilder<> irb(call);
+      Value* counter = irb.CreateConstInBoundsGEP2_32(countsty, counts, 0, index);
+      irb.CreateAtomicRMW(AtomicRMWInst::Add, counter, ConstantInt::get(i64, 1), MaybeAlign(8),
+          AtomicOrdering::Monotonic);
+    }
+    index++;
   }
-  DEBUG(dbgs() << "\n");
+  ArrayType* sitesty = ArrayType::get(sitety, records.size());
+  GlobalVariable* table = new GlobalVariable(M, sitesty, true, GlobalValue::InternalLinkage,
+      ConstantArray::get(sitesty, records), "__lltap_call_count_sites");
+
+  // void __lltap_inst_add_call_counts(unsigned long long* counts, LLTapCallCountSite* sites,
+  //                                   size_t size);
+  IntegerType* sizety = M.getDataLayout().getIntPtrType(C);
+  FunctionCallee add = M.getOrInsertFunction("__lltap_inst_add_call_counts",
+      Type::getVoidTy(C), PointerType::getUnqual(i64), PointerType::getUnqual(sitety), sizety);
+
+  Function* ctor = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+      GlobalValue::InternalLinkage, "__lltap_register_call_counts", &M);
+  IRBuilder<> irb(BasicBlock::Create(C, "entry", ctor));
+  irb.CreateCall(add, {irb.CreateConstInBoundsGEP2_32(countsty, counts, 0, 0),
+      irb.CreateConstInBoundsGEP2_32(sitesty, table, 0, 0),
+      ConstantInt::get(sizety, records.size())});
+  irb.CreateRetVoid();
+  addToGlobalCtors(M, ctor);
+
+  LLVM_DEBUG(dbgs() << "counting the calls of " << records.size() << " call sites\n");
+}
 
-  DEBUG(dbgs() << "going to skip instrumentation of calls to ");
-  for (StringRef s : NoInstrumentFunctions) {
-    noInstrumentCallsTo.insert(s);
-    DEBUG(dbgs() << s << ", ");
+
+/**
+ * Read the call counts written by the LLTap runtime of a -count-calls build, one
+ * "<count> <callee> <caller>" per line.
+ */
+void LLTap::InstrumentationPass::loadCallCounts() {
+  if (callCountsLoaded) {
+    return;
   }
-  DEBUG(dbgs() << "\n");
+  callCountsLoaded = true;
 
-  if (! InstrumentFunctionsRegexRaw.empty()) {
-    instrumentCallsRe = new Regex(InstrumentFunctionsRegexRaw);
-    DEBUG(dbgs() << "Function Whitelist Regex: " << InstrumentFunctionsRegexRaw << "\n");
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(CallCountsFile);
+  if (! buf) {
+    report_fatal_error(Twine("failed to read call counts from ") + CallCountsFile + ": "
+        + buf.getError().message());
   }
 
-  if (! NoInstrumentFunctionsRegexRaw.empty()) {
-    noInstrumentCallsRe = new Regex(NoInstrumentFunctionsRegexRaw);
-    DEBUG(dbgs() << "Function Blacklist Regex: " << NoInstrumentFunctionsRegexRaw << "\n");
+  for (line_iterator line(**buf, /*SkipBlanks=*/true, /*CommentMarker=*/'#');
+      ! line.is_at_eof(); ++line) {
+    StringRef rest = *line;
+    StringRef count, callee, caller;
+    std::tie(count, rest) = getToken(rest);
+    std::tie(callee, rest) = getToken(rest);
+    std::tie(caller, rest) = getToken(rest);
+
+    uint64_t n;
+    if (caller.empty() || ! rest.trim().empty() || count.getAsInteger(10, n)) {
+      errs() << "Warning: ignoring malformed call count " << CallCountsFile << ":"
+        << line.line_number() << "\n";
+      continue;
+    }
+    callCounts[(caller + " " + callee).str()] += n;
   }
+}
 
-  instConfigInitialized = true;
+
+/**
+ * Get the number of direct calls of each callee from each caller of the module, either from the
+ * -call-counts or from the PGO profile of the module. Returns false if there is no profile.
+ */
+bool LLTap::InstrumentationPass::getCallCounts(Module& M,
+    MapVector<std::pair<Function*, Function*>, uint64_t>& counts) {
+  if (! CallCountsFile.empty()) {
+    loadCallCounts();
+  }
+
+  bool found = false;
+  for (Function& F : M) {
+    if (F.isDeclaration() || F.getName().find("lltap") != string::npos) {
+      continue;
+    }
+
+    // the block frequencies scaled to the entry count of the function
+    std::unique_ptr<DominatorTree> DT;
+    std::unique_ptr<LoopInfo> LI;
+    std::unique_ptr<BranchProbabilityInfo> BPI;
+    std::unique_ptr<BlockFrequencyInfo> BFI;
+    if (CallCountsFile.empty() && F.getEntryCount().hasValue()) {
+      DT.reset(new DominatorTree(F));
+      LI.reset(new LoopInfo(*DT));
+      BPI.reset(new BranchProbabilityInfo(F, *LI));
+      BFI.reset(new BlockFrequencyInfo(F, *BPI, *LI));
+      found = true;
+    }
+
+    for (Instruction& I : instructions(F)) {
+      CallInst* call = dyn_cast<CallInst>(&I);
+      Function* callee = (call != nullptr) ? call->getCalledFunction() : nullptr;
+      if (callee == nullptr || callee->isIntrinsic()) {
+        continue;
+      }
+
+      auto pair = std::make_pair(&F, callee);
+      if (! CallCountsFile.empty()) {
+        // the counts are per caller and callee already
+        auto it = callCounts.find((F.getName() + " " + callee->getName()).str());
+        counts[pair] = (it != callCounts.end()) ? it->getValue() : 0;
+      } else if (BFI) {
+        counts[pair] += BFI->getBlockProfileCount(call->getParent()).getValueOr(0);
+      } else {
+        counts[pair] += 0;
+      }
+    }
+  }
+
+  return found || ! CallCountsFile.empty();
 }
 
 
 /**
- * Check whether the given Function matches the instrumentation mode and regexes.
+ * Exclude the hottest calls from instrumentation until the instrumented calls fit into the
+ * -inst-budget. The calls are grouped by caller and callee, which are admitted starting with the
+ * least called ones. This keeps the budget of every module and thereby of the whole program.
+ */
+void LLTap::InstrumentationPass::applyBudget(Module& M) {
+  if (InstrumentationBudget.getNumOccurrences() == 0) {
+    return;
+  }
+
+  MapVector<std::pair<Function*, Function*>, uint64_t> counts;
+  if (! getCallCounts(M, counts)) {
+    errs() << "Warning: ignoring -inst-budget, " << M.getModuleIdentifier()
+      << " has no profile and no -call-counts were given\n";
+    return;
+  }
+
+  // the callers and callees with at least one call, which would be instrumented
+  DenseSet<std::pair<Function*, Function*>> instrumentable;
+  for (Function& F : M) {
+    if (F.isDeclaration() || F.getName().find("lltap") != string::npos) {
+      continue;
+    }
+    for (Instruction& I : instructions(F)) {
+      CallInst* call = dyn_cast<CallInst>(&I);
+      Function* callee = (call != nullptr) ? call->getCalledFunction() : nullptr;
+      if (callee != nullptr && ! callee->isIntrinsic() && shouldBeInstrumented(*callee)
+          && ! useCalleeSideFor(*callee) && shouldInstrumentCall(callee, call, M)) {
+        instrumentable.insert(std::make_pair(&F, callee));
+      }
+    }
+  }
+
+  uint64_t total = 0;
+  std::vector<std::pair<std::pair<Function*, Function*>, uint64_t>> candidates;
+  for (auto& c : counts) {
+    total += c.second;
+    if (instrumentable.count(c.first) > 0) {
+      candidates.push_back(c);
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(), [](const std::pair<std::pair<Function*,
+        Function*>, uint64_t>& a, const std::pair<std::pair<Function*, Function*>, uint64_t>& b) {
+      if (a.second != b.second) {
+        return a.second < b.second;
+      }
+      int caller = a.first.first->getName().compare(b.first.first->getName());
+      return caller < 0 || (caller == 0 && a.first.second->getName() < b.first.second->getName());
+    });
+
+  double budget = total * InstrumentationBudget / 100.0;
+  uint64_t spent = 0;
+  string report;
+  raw_string_ostream out(report);
+  for (auto& c : candidates) {
+    if (spent + c.second <= budget) {
+      spent += c.second;
+      continue;
+    }
+
+    Function* caller = c.first.first;
+    Function* callee = c.first.second;
+    bool sled = InstrumentationBudgetAction == BudgetAction::sled && canUseSledFor(callee, M);
+    if (sled) {
+      sledTargets.insert(callee);
+    } else {
+      budgetExcluded.insert(c.first);
+    }
+    out << (sled ? "sled " : "skipped ") << callee->getName() << " from " << caller->getName()
+      << ": " << c.second << " calls, " << format("%.2f", 100.0 * c.second / total)
+      << "% of all calls\n";
+  }
+
+  LLVM_DEBUG(dbgs() << "budget of " << M.getModuleIdentifier() << ": " << spent << " of "
+      << total << " calls instrumented\n" << out.str());
+
+  if (InstrumentationBudgetReport.empty()) {
+    return;
+  }
+  string header;
+  raw_string_ostream head(header);
+  head << "# " << M.getModuleIdentifier() << ": " << spent << " of " << total
+    << " calls instrumented, budget " << format("%g", (double)InstrumentationBudget)
+    << "%\n";
+  if (InstrumentationBudgetReport == "-") {
+    errs() << head.str() << out.str();
+    return;
+  }
+
+  // the modules of a build are compiled concurrently, so the report is appended in one write
+  std::error_code EC;
+  raw_fd_ostream file(InstrumentationBudgetReport, EC, sys::fs::OF_Append | sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Warning: failed to write budget report to " << InstrumentationBudgetReport
+      << ": " << EC.message() << "\n";
+  } else {
+    file << head.str() << out.str();
+  }
+}
+
+
+/**
+ * Remember all indirect calls of the module (see -inst-indirect-calls). This happens before any
+ * code is generated, so calls in the generated hook wrappers are never instrumented.
+ */
+void LLTap::InstrumentationPass::collectIndirectCalls(Module& M) {
+  if (! InstrumentIndirectCalls) {
+    return;
+  }
+
+  for (Function& F : M) {
+    if (F.isDeclaration() || F.getName().find("lltap") != string::npos) {
+      continue;
+    }
+    for (Instruction& I : instructions(F)) {
+      CallInst* call = dyn_cast<CallInst>(&I);
+      if (call == nullptr || call->getCalledFunction() != nullptr || call->isInlineAsm()
+          || call->isMustTailCall()) {
+        continue;
+      }
+      // e.g. a call of a bitcasted function, which is not really indirect
+      if (isa<Function>(call->getCalledOperand()->stripPointerCasts())) {
+        continue;
+      }
+      if (call->getFunctionType()->isVarArg()) {
+        LLVM_DEBUG(dbgs() << "skipping indirect varargs call " << *call << "\n");
+        continue;
+      }
+      if (! shouldInstrumentCall(nullptr, call, M)) {
+        continue;
+      }
+      indirectCalls.push_back(call);
+    }
+  }
+
+  LLVM_DEBUG(dbgs() << "found " << indirectCalls.size() << " indirect calls\n");
+}
+
+
+/**
+ * struct LLTapIndirectTarget { void* addr; LLTapHookSlot slot; };
+ */
+StructType* LLTap::InstrumentationPass::getIndirectTargetType(Module& M) {
+  StructType* entryty = StructType::getTypeByName(M.getContext(), LLTAP_INDIRECT_TARGET_TYPENAME);
+
+  if (entryty == nullptr) {
+    Type* elems[] = {
+      PointerType::getUnqual(IntegerType::get(M.getContext(), 8)),
+      PointerType::getUnqual(getHookRegistryType(M)),
+    };
+    entryty = StructType::create(M.getContext(), elems, LLTAP_INDIRECT_TARGET_TYPENAME);
+  }
+
+  return entryty;
+}
+
+
+/**
+ * Returns the cold function which calls the hooks for indirect calls like the given one. It takes
+ * the arguments of the call, the LLTapHookRegistry of the callee and the callee itself. The
+ * arguments keep the attributes of the call, e.g. byval or zeroext, which are part of the ABI of
+ * the callee, and the callee is called with the calling convention of the call.
+ */
+Function* LLTap::InstrumentationPass::getIndirectSlowPathFor(CallInst* call, Module& M) {
+  FunctionType* FT = call->getFunctionType();
+  AttributeList attrs = call->getAttributes().removeFnAttributes(M.getContext());
+  Function*& slowFn = indirectSlowPaths[std::make_tuple(FT, attrs, call->getCallingConv())];
+  if (slowFn != nullptr) {
+    return slowFn;
+  }
+
+  std::vector<Type*> ftargs(FT->param_begin(), FT->param_end());
+  ftargs.push_back(PointerType::getUnqual(getHookRegistryType(M)));
+  ftargs.push_back(PointerType::getUnqual(FT));
+  FunctionType* slow_ft = FunctionType::get(FT->getReturnType(), ftargs, false);
+
+  slowFn = Function::Create(slow_ft, Function::InternalLinkage, "__lltap_hook_indirect", &M);
+  slowFn->setAttributes(attrs);
+  slowFn->addFnAttr(Attribute::Cold);
+  slowFn->addFnAttr(Attribute::NoInline);
+  createHookingCode(/*origFunc=*/nullptr, slowFn, M, /*registryArg=*/true);
+  lltapHookFunctions.insert(slowFn);
+
+  // setForwardedCallAttributes only knows the calling convention of direct callees
+  Argument* callee = slowFn->getArg(slowFn->arg_size() - 1);
+  for (User* user : callee->users()) {
+    CallInst* forwarded = dyn_cast<CallInst>(user);
+    if (forwarded != nullptr && forwarded->getCalledOperand() == callee) {
+      forwarded->setCallingConv(call->getCallingConv());
+    }
+  }
+
+  return slowFn;
+}
+
+
+/**
+ * Instrument an indirect call. The call site gets an inline cache of the LLTapIndirectTarget
+ * entries of the last callees, so usually finding the hook slot of the callee takes a load and a
+ * compare per cached callee. Only on a miss the runtime is asked, which also updates the cache:
+ *
+ *     entry = cache[i]                         ; for all i < -indirect-cache-size
+ *     if (entry != NULL && entry->addr == callee) goto found;
+ *     entry = __lltap_inst_lookup_indirect(callee, cache, size);
+ *   found:
+ *     if (entry->slot == NULL) ret = callee(args...);
+ *     else ret = __lltap_hook_indirect(args..., entry->slot, callee);
+ */
+bool LLTap::InstrumentationPass::instrumentIndirectCall(CallInst* call, Module& M) {
+  LLVMContext& C = M.getContext();
+  FunctionType* FT = call->getFunctionType();
+  Value* calleeVal = call->getCalledOperand();
+  unsigned cachesize = std::max(1u, (unsigned)IndirectCacheSize);
+
+  PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(C, 8));
+  StructType* entryty = getIndirectTargetType(M);
+  PointerType* entryptr = PointerType::getUnqual(entryty);
+  Align ptralign = M.getDataLayout().getPointerABIAlignment(0);
+  MDBuilder mdb(C);
+
+  ArrayType* cachety = ArrayType::get(entryptr, cachesize);
+  GlobalVariable* cache = new GlobalVariable(
+      /*Module=*/M,
+      /*Type=*/cachety,
+      /*isConstant=*/false,
+      /*Linkage=*/GlobalValue::InternalLinkage,
+      /*Initializer=*/ConstantAggregateZero::get(cachety),
+      /*Name=*/"__lltap_icache");
+  cache->setAlignment(ptralign);
+
+  // head --> probe_0 --> ... --> probe_n-1 --> miss --> found --> (call_plain|call_hooked) --> cont
+  BasicBlock* head = call->getParent();
+  Function* F = head->getParent();
+  BasicBlock* call_plain = head->splitBasicBlock(call, "lltap.icall.plain");
+  BasicBlock* cont = call_plain->splitBasicBlock(++BasicBlock::iterator(call), "lltap.icall.cont");
+  head->getTerminator()->eraseFromParent();
+
+  IRBuilder<> irb(head);
+  Value* callee = irb.CreateBitCast(calleeVal, i8ptr);
+  Value* cache_ptr = irb.CreateConstInBoundsGEP2_32(cachety, cache, 0, 0);
+
+  BasicBlock* found = BasicBlock::Create(C, "lltap.icall.found", F, call_plain);
+  BasicBlock* miss = BasicBlock::Create(C, "lltap.icall.miss", F, found);
+  IRBuilder<> found_irb(found);
+  PHINode* entry = found_irb.CreatePHI(entryptr, cachesize + 1, "entry");
+
+  for (unsigned i = 0; i < cachesize; ++i) {
+    BasicBlock* next = (i + 1 < cachesize)
+      ? BasicBlock::Create(C, "lltap.icall.probe", F, miss) : miss;
+
+    LoadInst* cached = irb.CreateLoad(entryptr,
+        irb.CreateConstInBoundsGEP1_32(entryptr, cache_ptr, i));
+    cached->setAtomic(AtomicOrdering::Acquire);
+    cached->setAlignment(ptralign);
+
+    BasicBlock* compare = BasicBlock::Create(C, "lltap.icall.compare", F, next);
+    irb.CreateCondBr(irb.CreateIsNull(cached), miss, compare);
+
+    IRBuilder<> cmp_irb(compare);
+    Value* addr = cmp_irb.CreateLoad(i8ptr, cmp_irb.CreateStructGEP(entryty, cached, 0));
+    cmp_irb.CreateCondBr(cmp_irb.CreateICmpEQ(addr, callee), found, next,
+        mdb.createBranchWeights(2000, 1));
+    entry->addIncoming(cached, compare);
+
+    if (next != miss) {
+      irb.SetInsertPoint(next);
+    }
+  }
+
+  IRBuilder<> miss_irb(miss);
+  Value* lookup_args[] = {
+    callee,
+    cache_ptr,
+    ConstantInt::get(IntegerType::get(C, 32), cachesize),
+  };
+  Value* looked_up = miss_irb.CreateCall(M.getFunction(fn_lltap_lookup_indirect), lookup_args);
+  miss_irb.CreateBr(found);
+  entry->addIncoming(looked_up, miss);
+
+  LoadInst* registry = found_irb.CreateLoad(entryty->getElementType(1),
+      found_irb.CreateStructGEP(entryty, entry, 1), "hooks");
+  registry->setAtomic(AtomicOrdering::Acquire);
+  registry->setAlignment(ptralign);
+
+  BasicBlock* call_hooked = BasicBlock::Create(C, "lltap.icall.hooked", F, cont);
+  found_irb.CreateCondBr(found_irb.CreateIsNull(registry), call_plain, call_hooked,
+      getUnlikelyHooksWeights(M));
+
+  IRBuilder<> hooked_irb(call_hooked);
+  SmallVector<Value*, 8> args(call->args().begin(), call->args().end());
+  args.push_back(registry);
+  args.push_back(calleeVal);
+  Function* slowFn = getIndirectSlowPathFor(call, M);
+  CallInst* hooked = hooked_irb.CreateCall(slowFn, args);
+  hooked->setAttributes(slowFn->getAttributes().removeFnAttributes(C));
+  hooked_irb.CreateBr(cont);
+
+  if (! FT->getReturnType()->isVoidTy()) {
+    PHINode* ret = PHINode::Create(FT->getReturnType(), 2, "ret", &cont->front());
+    call->replaceAllUsesWith(ret);
+    ret->addIncoming(call, call_plain);
+    ret->addIncoming(hooked, call_hooked);
+  }
+
+  LLVM_DEBUG(dbgs() << "instrumented indirect call " << *call << "\n");
+
+  return true;
+}
+
+
+/**
+ * Version the outermost loops with instrumented calls (see -version-hooked-loops). Versioning a
+ * loop changes the CFG, so the loops are looked up again by their header for each of them.
+ */
+void LLTap::InstrumentationPass::versionHookedLoops(Module& M) {
+  SetVector<Function*> functions;
+  for (auto& call : instrumentedCalls) {
+    functions.insert(call.first->getFunction());
+  }
+
+  for (Function* F : functions) {
+    SmallVector<BasicBlock*, 8> headers;
+    {
+      DominatorTree DT(*F);
+      LoopInfo LI(DT);
+      for (Loop* L : LI) {
+        headers.push_back(L->getHeader());
+      }
+    }
+
+    for (BasicBlock* header : headers) {
+      DominatorTree DT(*F);
+      LoopInfo LI(DT);
+      Loop* L = LI.getLoopFor(header);
+      if (L != nullptr && L->getHeader() == header) {
+        versionLoop(L, DT, LI, M);
+      }
+    }
+  }
+}
+
+
+/**
+ * Clone the given loop and make the clone call the targets of the instrumented calls directly. The
+ * preheader decides which version runs:
+ *
+ *     generation = __lltap_hook_generation
+ *     switch (state ^ (generation << 1)):
+ *       case 0: goto fast           ; no hooks at this generation
+ *       case 1: goto instrumented   ; hooks at this generation
+ *       default:                    ; the slots changed, check them again
+ *         hooked = slot_0 != NULL || ... || slot_n-1 != NULL
+ *         state = (generation << 1) | hooked
  *
+ * Hooks installed while the clone runs are called from the next entry of the loop on.
  */
-bool LLTap::InstrumentationPass::shouldBeInstrumented(Function& F) {
-
-  // skip all lltap functions
-  if (F.getName().find("lltap") != string::npos) {
+bool LLTap::InstrumentationPass::versionLoop(Loop* L, DominatorTree& DT, LoopInfo& LI, Module& M) {
+  SmallVector<CallInst*, 8> calls;
+  SetVector<Function*> targets;
+  size_t size = 0;
+  for (BasicBlock* BB : L->blocks()) {
+    size += BB->size();
+    for (Instruction& I : *BB) {
+      CallInst* call = dyn_cast<CallInst>(&I);
+      auto it = (call != nullptr) ? instrumentedCalls.find(call) : instrumentedCalls.end();
+      if (it != instrumentedCalls.end()) {
+        calls.push_back(call);
+        targets.insert(it->second);
+      }
+    }
+  }
+  if (calls.empty() || size > VersionHookedLoopsThreshold) {
     return false;
   }
 
-  if (lltapHookFunctions.count(&F) == 1) {
+  simplifyLoop(L, &DT, &LI, nullptr, nullptr, nullptr, /*PreserveLCSSA=*/false);
+  formLCSSARecursively(*L, DT, &LI, nullptr);
+  if (L->getLoopPreheader() == nullptr || ! L->hasDedicatedExits() || ! L->isSafeToClone()) {
+    LLVM_DEBUG(dbgs() << "can't version loop " << L->getHeader()->getName() << "\n");
     return false;
   }
 
-  if (! instConfigInitialized) {
-    initializeInstConfig();
+  // the preheader becomes the check, followed by the preheaders of both versions
+  LLVMContext& C = M.getContext();
+  Function* F = L->getHeader()->getParent();
+  BasicBlock* check = L->getLoopPreheader();
+  BasicBlock* hooked_ph = SplitBlock(check, check->getTerminator(), &DT, &LI, nullptr,
+      "lltap.loop.hooked");
+
+  ValueToValueMapTy VMap;
+  SmallVector<BasicBlock*, 16> fastBlocks;
+  Loop* fast = cloneLoopWithPreheader(hooked_ph, check, L, VMap, ".lltap.fast", &LI, &DT,
+      fastBlocks);
+  remapInstructionsInBlocks(fastBlocks, VMap);
+  BasicBlock* fast_ph = fast->getLoopPreheader();
+  fast_ph->setName("lltap.loop.fast");
+
+  // both versions leave through the same exits
+  SmallVector<BasicBlock*, 4> exits;
+  L->getUniqueExitBlocks(exits);
+  for (BasicBlock* exit : exits) {
+    for (PHINode& phi : exit->phis()) {
+      for (unsigned i = 0, n = phi.getNumIncomingValues(); i < n; ++i) {
+        BasicBlock* pred = phi.getIncomingBlock(i);
+        if (L->contains(pred)) {
+          Value* val = phi.getIncomingValue(i);
+          Value* cloned = VMap.lookup(val);
+          phi.addIncoming((cloned != nullptr) ? cloned : val, cast<BasicBlock>(VMap[pred]));
+        }
+      }
+    }
   }
 
-  bool instModeFits = false;
-
-  if (InstMode > InstrumentationMode::inst_ie) {
-    if (InstMode == InstrumentationMode::inst_i && (! F.isDeclaration())) {
-      instModeFits = true;
-    } else if (InstMode == InstrumentationMode::inst_e && (F.isDeclaration())) {
-      instModeFits = true;
+  for (CallInst* call : calls) {
+    Function* target = instrumentedCalls[call];
+    CallInst* direct = cast<CallInst>(VMap[call]);
+    if (siteArgCalls.count(call) > 0) {
+      // drop the call site record
+      SmallVector<Value*, 8> args(direct->args());
+      args.pop_back();
+      CallInst* site_call = direct;
+      direct = CallInst::Create(target->getFunctionType(), target, args, "", site_call);
+      direct->takeName(site_call);
+      direct->copyMetadata(*site_call);
+      direct->setAttributes(site_call->getAttributes());
+      direct->setTailCallKind(site_call->getTailCallKind());
+      site_call->replaceAllUsesWith(direct);
+      site_call->eraseFromParent();
     }
-  } else {
-    instModeFits = true;
+    direct->setCalledFunction(target->getFunctionType(), target);
+    direct->setCallingConv(target->getCallingConv());
   }
 
-  bool shouldInstrumentF = false;
+  IntegerType* i64 = IntegerType::get(C, 64);
+  GlobalVariable* generation = M.getNamedGlobal(LLTAP_HOOK_GENERATION);
+  if (generation == nullptr) {
+    generation = new GlobalVariable(M, i64, false, GlobalValue::ExternalLinkage, nullptr,
+        LLTAP_HOOK_GENERATION);
+  }
+  // an odd value, which no generation of the runtime maps to
+  GlobalVariable* state = new GlobalVariable(M, i64, false, GlobalValue::InternalLinkage,
+      ConstantInt::get(i64, -1), "__lltap_loop_state");
+  state->setAlignment(Align(8));
+
+  check->getTerminator()->eraseFromParent();
+  IRBuilder<> irb(check);
+  LoadInst* gen = irb.CreateLoad(i64, generation, "generation");
+  gen->setAtomic(AtomicOrdering::Acquire);
+  gen->setAlignment(Align(8));
+  LoadInst* cached = irb.CreateLoad(i64, state, "loop_state");
+  cached->setAtomic(AtomicOrdering::Monotonic);
+  cached->setAlignment(Align(8));
+  Value* unhooked_state = irb.CreateShl(gen, 1);
+
+  BasicBlock* recheck = BasicBlock::Create(C, "lltap.loop.recheck", F, hooked_ph);
+  SwitchInst* sw = irb.CreateSwitch(irb.CreateXor(cached, unhooked_state), recheck, 2);
+  sw->addCase(ConstantInt::get(i64, 0), fast_ph);
+  sw->addCase(ConstantInt::get(i64, 1), hooked_ph);
+  sw->setMetadata(LLVMContext::MD_prof,
+      MDBuilder(C).createBranchWeights(ArrayRef<uint32_t>({1, 2000, 1})));
+
+  IRBuilder<> recheck_irb(recheck);
+  Value* hooked = nullptr;
+  for (Function* target : targets) {
+    Value* has_hooks = recheck_irb.CreateIsNotNull(loadHookRegistry(recheck_irb, target, M));
+    hooked = (hooked == nullptr) ? has_hooks : recheck_irb.CreateOr(hooked, has_hooks);
+  }
+  StoreInst* update = recheck_irb.CreateStore(
+      recheck_irb.CreateOr(unhooked_state, recheck_irb.CreateZExt(hooked, i64)), state);
+  update->setAtomic(AtomicOrdering::Monotonic);
+  update->setAlignment(Align(8));
+  recheck_irb.CreateCondBr(hooked, hooked_ph, fast_ph, getUnlikelyHooksWeights(M));
 
-  // check if we have whitelist
-  if (instrumentCallsTo.size() == 0 && instrumentCallsRe == nullptr) {
-    // nothing was specified --> instrument all
-    shouldInstrumentF = true;
+  LLVM_DEBUG(dbgs() << "versioned loop " << L->getHeader()->getName() << " in " << F->getName()
+      << " with " << calls.size() << " instrumented calls\n");
 
-  } else {
-    // check the simple list
-    if (instrumentCallsTo.count(F.getName()) > 0) {
-      shouldInstrumentF = true;
-    }
+  return true;
+}
 
-    // check regex
-    if (instrumentCallsRe != nullptr
-        && instrumentCallsRe->match(F.getName())) {
-      shouldInstrumentF = true;
-    }
-  }
 
-  // check blacklist
-  if (noInstrumentCallsTo.size() > 0) {
-    if (noInstrumentCallsTo.count(F.getName())) {
-      shouldInstrumentF = false;
-    }
-  }
-  // and blacklist regex
-  if (noInstrumentCallsRe != nullptr) {
-    if (noInstrumentCallsRe->match(F.getName())) {
-      shouldInstrumentF = false;
-    }
+/**
+ * Whether the given call passes its LLTapCallSiteRecord to the wrapper (see -call-site-ids). Calls
+ * through a sled have the prototype of the target, and a musttail call must keep the prototype of
+ * its caller.
+ */
+bool LLTap::InstrumentationPass::useCallSiteIdsFor(CallInst* call, Function* calledFn,
+    Module& M) {
+  return CallSiteIds && (! useSledFor(calledFn, M)) && (! call->isMustTailCall());
+}
+
+
+/**
+ * Returns the LLTapCallSiteRecord of the given call. Until \ref addCallSiteTable emits the records
+ * it is a placeholder.
+ */
+Constant* LLTap::InstrumentationPass::addCallSite(CallInst* call, Function* calledFn, Module& M) {
+  StructType* recty = getCallSiteRecordType(M);
+  GlobalVariable* placeholder = new GlobalVariable(M, recty, false, GlobalValue::PrivateLinkage,
+      UndefValue::get(recty), "__lltap_call_site_record");
+
+  CallSite site = { placeholder, calledFn, call->getFunction(), "", 0, 0 };
+  if (const DILocation* loc = call->getDebugLoc().get()) {
+    site.file = loc->getFilename().str();
+    site.line = loc->getLine();
+    site.column = loc->getColumn();
   }
+  callSites.push_back(site);
 
-  return shouldInstrumentF && instModeFits;
+  return placeholder;
 }
 
 
 /**
- * Instrument all uses of the given function. For each function it is checked whether it should be
- * instrumented with \ref shouldBeInstrumented and for each use it is checked whether it is inside
- * a function generated by this pass.
+ * Emit the LLTapCallSiteRecords of the module as one array and replace the placeholders with its
+ * elements. The runtime assigns the IDs when the array is registered, so it is writable. With
+ * \ref useTargetSection the arrays of all modules end up in one section, which is registered as a
+ * whole like the target records.
  */
-bool LLTap::InstrumentationPass::runOnFunction(Function &F) {
+void LLTap::InstrumentationPass::addCallSiteTable(Module& M) {
+  if (callSites.empty()) {
+    return;
+  }
 
-  bool changed = false;
+  LLVMContext& C = M.getContext();
+  StructType* recty = getCallSiteRecordType(M);
+  PointerType* voidptr = PointerType::getUnqual(IntegerType::get(C, 8));
+  IntegerType* i32 = IntegerType::get(C, 32);
+
+  std::vector<Constant*> records;
+  for (CallSite& site : callSites) {
+    Constant* file = ConstantPointerNull::get(voidptr);
+    if (! site.file.empty()) {
+      Constant*& str = callSiteFiles[site.file];
+      if (str == nullptr) {
+        GlobalVariable* gvar = new GlobalVariable(M, ArrayType::get(IntegerType::get(C, 8),
+              site.file.size() + 1), true, GlobalValue::PrivateLinkage,
+            ConstantDataArray::getString(C, site.file, true), "__lltap_file");
+        gvar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        gvar->setAlignment(Align(1));
+        str = ConstantExpr::getPointerCast(gvar, voidptr);
+      }
+      file = str;
+    }
 
-  //++FunctionsVisited;
-  DEBUG(dbgs() << "Function: ");
-  DEBUG(dbgs().write_escaped(F.getName()) << '\n');
+    GlobalVariable* caller = M.getNamedGlobal("__lltap_fname_" + site.caller->getName().str());
+    if (caller == nullptr) {
+      caller = addFunctionNameAsStringConstant(site.caller->getName(), M);
+    }
 
-  if (! shouldBeInstrumented(F)) {
-    DEBUG(dbgs() << "...skipping\n");
-    return false;
+    Constant* fields[] = {
+      ConstantExpr::getPointerCast(site.target, voidptr),
+      ConstantExpr::getPointerCast(caller, voidptr),
+      file,
+      ConstantInt::get(i32, site.line),
+      ConstantInt::get(i32, site.column),
+      ConstantInt::get(i32, getTargetIdFor(getTargetNameFor(site.target))),
+      ConstantInt::get(i32, LLTAP_NO_CALL_SITE_ID),
+    };
+    records.push_back(ConstantStruct::get(recty, fields));
   }
 
-  DEBUG(dbgs() << "got " << F.getNumUses() << " uses\n");
-  SmallVector<User*, 16> worklist;
-  for (User* user : F.users()) {
-    DEBUG(dbgs() << "found user " << *user << "\n");
-    worklist.push_back(user);
+  ArrayType* tablety = ArrayType::get(recty, records.size());
+  GlobalVariable* table = new GlobalVariable(M, tablety, false, GlobalValue::PrivateLinkage,
+      ConstantArray::get(tablety, records), "__lltap_call_sites");
+  table->setAlignment(M.getDataLayout().getPointerABIAlignment(0));
+
+  IntegerType* i64 = IntegerType::get(C, 64);
+  for (size_t i = 0; i < callSites.size(); ++i) {
+    Constant* indices[] = { ConstantInt::get(i64, 0), ConstantInt::get(i64, i) };
+    GlobalVariable* placeholder = callSites[i].placeholder;
+    placeholder->replaceAllUsesWith(
+        ConstantExpr::getInBoundsGetElementPtr(tablety, table, indices));
+    placeholder->eraseFromParent();
   }
 
-  for (User* user : worklist) {
-    if (! isUseInLLTapHook(user)) {
-      if (isa<CallInst>(user)) {
-        CallSite CI(user);
-        //CallsFound++;
-        changed |= instrumentCall(&CI, *(F.getParent()));
-      } else if (! DoNotInstrumentUses) {
-        if (F.isVarArg()) {
-          errs() << "Warning: cannot replace function pointer to varargs function ("
-            << F.getName() << ")\n";
-        } else {
-          changed |= instrumentUse(user, *F.getParent());
-        }
-        //UsesFound++;
-      }
+  if (useTargetSection(M)) {
+    table->setSection(LLTAP_CALL_SITES_SECTION);
+
+    // the calls may be optimized away, the table stays complete
+    GlobalValue* used[] = { table };
+    appendToUsed(M, used);
+
+    if (M.getFunction(fn_lltap_register_call_sites) == nullptr) {
+      // provided by the linker for every section with a C identifier as name
+      GlobalVariable* start = new GlobalVariable(M, recty, false,
+          GlobalValue::ExternalWeakLinkage, nullptr, "__start_" + LLTAP_CALL_SITES_SECTION);
+      start->setVisibility(GlobalValue::HiddenVisibility);
+      GlobalVariable* stop = new GlobalVariable(M, recty, false,
+          GlobalValue::ExternalWeakLinkage, nullptr, "__stop_" + LLTAP_CALL_SITES_SECTION);
+      stop->setVisibility(GlobalValue::HiddenVisibility);
+
+      Function* regFn = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+          Function::LinkOnceODRLinkage, fn_lltap_register_call_sites, &M);
+      regFn->setVisibility(GlobalValue::HiddenVisibility);
+      regFn->setComdat(M.getOrInsertComdat(fn_lltap_register_call_sites));
+
+      IRBuilder<> irb(BasicBlock::Create(C, "entry", regFn));
+      Value* args[] = { start, stop };
+      irb.CreateCall(M.getFunction(fn_lltap_add_call_sites), args);
+      irb.CreateRetVoid();
+      addToGlobalCtors(M, regFn);
     }
+  } else {
+    Function* initfunc = getOrAddInitializerToModule(M);
+    IRBuilder<> irb(initfunc->getEntryBlock().getFirstNonPHIOrDbgOrLifetime());
+    Value* args[] = {
+      irb.CreateConstInBoundsGEP2_64(tablety, table, 0, 0),
+      irb.CreateConstInBoundsGEP2_64(tablety, table, 0, records.size()),
+    };
+    irb.CreateCall(M.getFunction(fn_lltap_add_call_sites), args);
   }
 
-  return changed;
+  LLVM_DEBUG(dbgs() << "emitted " << records.size() << " call site records\n");
+  callSites.clear();
+  callSiteFiles.clear();
 }
 
+
 /**
  * Instrument a CallSite in a given Module.
  *
  */
-bool LLTap::InstrumentationPass::instrumentCall(CallSite* call, Module& M) {
+bool LLTap::InstrumentationPass::instrumentCall(CallBase* call, Module& M) {
 
   bool mod = true;
 
-  Value* calledVal = call->getCalledValue();
+  Value* calledVal = call->getCalledOperand();
 
   if (! isa<Function>(calledVal)) {
-    errs() << "Callsite isn't a call to a known function " << *call->getInstruction() << "\n";
+    errs() << "Callsite isn't a call to a known function " << *call << "\n";
     return false;
   }
   Function* calledFn = call->getCalledFunction();
 
   if (calledFn->isIntrinsic()) {
-    DEBUG(dbgs() << "ignoring intrinsic function " << calledFn->getName() << "\n");
+    LLVM_DEBUG(dbgs() << "ignoring intrinsic function " << calledFn->getName() << "\n");
     return false;
   }
 
   addCallTarget(calledFn, M);
 
-  CallInst* inst = dyn_cast<CallInst>(call->getInstruction());
-  Function* hook_fn = getHookFunctionFor(call, M);
-  inst->setCalledFunction(hook_fn);
+  CallInst* inst = dyn_cast<CallInst>(call);
+  bool siteArg = useCallSiteIdsFor(inst, calledFn, M);
+  if (siteArg) {
+    // the wrapper takes the record of the call site as additional argument
+    Function* hook_fn = getHookFunctionFor(call, M, /*siteArg=*/true);
+    SmallVector<Value*, 8> args(inst->args());
+    args.push_back(addCallSite(inst, calledFn, M));
+    CallInst* site_call = CallInst::Create(hook_fn->getFunctionType(), hook_fn, args, "", inst);
+    site_call->takeName(inst);
+    site_call->copyMetadata(*inst);
+    site_call->setCallingConv(inst->getCallingConv());
+    site_call->setTailCallKind(inst->getTailCallKind());
+    site_call->setAttributes(inst->getAttributes());
+    inst->replaceAllUsesWith(site_call);
+    inst->eraseFromParent();
+    inst = site_call;
+    siteArgCalls.insert(inst);
+  } else {
+    Function* hook_fn = useSledFor(calledFn, M)
+      ? getOrAddSledFor(calledFn, M) : getHookFunctionFor(call, M);
+    inst->setCalledFunction(hook_fn);
+  }
+  inst->setAttributes(removeMemoryAttributes(inst->getAttributes(), M));
+  if (getStaticHooksFor(calledFn) == nullptr && ! useSledFor(calledFn, M)) {
+    instrumentedCalls[inst] = calledFn;
+  }
 
-  DEBUG(dbgs() << "hooked call to " << calledFn->getName() << "\n"
+  LLVM_DEBUG(dbgs() << "hooked call to " << calledFn->getName() << "\n"
       << "with type: " << *calledFn->getFunctionType() << "\n");
 
   return mod;
@@ -615,41 +3212,74 @@ bool LLTap::InstrumentationPass::instrumentUse(User* user, Module& M) {
     if (isa<Function>(val)) {
       Function* calledFn = cast<Function>(val);
       addCallTarget(calledFn, M);
-      Function* hookFn = getHookFunctionFor(calledFn, M);
-      StoreInst* SInew = new StoreInst(hookFn, SI->getPointerOperand(), SI);
-      DEBUG(dbgs() << "created new hooked store instruction " << *SInew
-          << " replacing " << *SI << "\n");
-      SI->eraseFromParent();
+      Function* hookFn = useSledFor(calledFn, M)
+        ? getOrAddSledFor(calledFn, M) : getHookFunctionFor(calledFn, M);
+      // replacing the stored value in place keeps volatile, alignment and ordering of the store
+      SI->setOperand(0, hookFn);
+      LLVM_DEBUG(dbgs() << "hooked store instruction " << *SI << "\n");
       changed = true;
     } else {
-      DEBUG(dbgs() << " stored value is not a function in " << *user << "\n");
+      LLVM_DEBUG(dbgs() << " stored value is not a function in " << *user << "\n");
     }
   }
 
   return changed;
 }
 
+/**
+ * Returns the suffix of the wrapper names in the given module. The wrappers of global functions
+ * are shared across modules, so modules whose wrappers get different bodies must name them
+ * differently, or the linker keeps an arbitrary one for all of them. The body depends on the
+ * options below and on whether the module uses exceptions, see createUnwindCleanup.
+ */
+string LLTap::InstrumentationPass::getWrapperVariant(Module& M) {
+  string flags;
+  if (NoHookSlots) {
+    flags += 'n';
+  }
+  if (CallContexts) {
+    flags += 'c';
+  }
+  if (TraceCalls) {
+    flags += 't';
+  }
+  bool exceptions = std::any_of(M.begin(), M.end(),
+      [](const Function& F) { return F.hasPersonalityFn(); });
+  if (exceptions && (CallSiteIds || CallContexts)) {
+    flags += 'u';
+  }
+
+  string variant = flags.empty() ? "" : "." + flags;
+  // the wrappers load the slot of the target from the namespace
+  if (! HookNamespace.empty()) {
+    variant += "." + HookNamespace;
+  }
+  return variant;
+}
+
 /**
  * Returns the name of the function that is replacing the original function in the original call.
  */
-string LLTap::InstrumentationPass::getHookFunctionNameFor(Function* origFunc, CallSite* CS) {
-  string hookfnname = string("__lltap_hook_") + string(origFunc->getName());
+string LLTap::InstrumentationPass::getHookFunctionNameFor(Function* origFunc, CallBase* CS,
+    bool siteArg) {
+  string hookfnname = string(siteArg ? "__lltap_site_hook_" : "__lltap_hook_")
+    + string(origFunc->getName());
   if (origFunc->isVarArg()) {
     hookfnname += "_" + mangleFunctionArgs(CS);
   }
-  return hookfnname;
+  return hookfnname + wrapperVariant;
 }
 
 /**
  * Get the hook function or create a new one if it doesn't exist.
  */
-Function* LLTap::InstrumentationPass::getHookFunctionFor(CallSite* CS, Module& M) {
+Function* LLTap::InstrumentationPass::getHookFunctionFor(CallBase* CS, Module& M, bool siteArg) {
   Function* origFunc = CS->getCalledFunction();
-  string hookfnname = getHookFunctionNameFor(origFunc, CS);
+  string hookfnname = getHookFunctionNameFor(origFunc, CS, siteArg);
   if (M.getFunction(hookfnname) != NULL) {
     return M.getFunction(hookfnname);
   } else {
-    return createHookFunction(StringRef(hookfnname), CS, origFunc, M);
+    return createHookFunction(StringRef(hookfnname), CS, origFunc, M, siteArg);
   }
 }
 
@@ -666,19 +3296,225 @@ Function* LLTap::InstrumentationPass::getHookFunctionFor(Function* origFunc, Mod
 }
 
 
+/**
+ * Create the function with the given name and type which replaces calls to origFunc.
+ *
+ * With -split-hook-wrappers it only checks whether there are any hooks and directly calls the
+ * original function if not. It is internal and always inlined, so an instrumented call without
+ * hooks costs a load and a branch. The hooks are called from an outlined cold function, which
+ * additionally receives the LLTapHookRegistry.
+ *
+ * With siteArg the wrapper takes the LLTapCallSiteRecord of the call as last parameter, after the
+ * parameters of FT. It is only passed on to the hooks, so after inlining the fast path the call
+ * site only materializes it when there are hooks.
+ */
+Function* LLTap::InstrumentationPass::createHookWrapper(StringRef name, FunctionType* FT,
+    Function* origFunc, Module& M, CallBase* CS, bool siteArg) {
+
+  AttributeList attrs = getForwardedAttributes(origFunc, CS, M);
+  size_t numparams = FT->getNumParams();
+  if (siteArg) {
+    std::vector<Type*> params(FT->param_begin(), FT->param_end());
+    params.push_back(PointerType::getUnqual(getCallSiteRecordType(M)));
+    FT = FunctionType::get(FT->getReturnType(), params, false);
+  }
+
+  auto createWrapper = [&](FunctionType* wrapperFT, GlobalValue::LinkageTypes linkage,
+      const Twine& wrapperName) {
+    Function* fn = Function::Create(wrapperFT, linkage, wrapperName, &M);
+    fn->setAttributes(attrs);
+    if (origFunc->doesNotThrow()) {
+      fn->setDoesNotThrow();
+    }
+    lltapHookFunctions.insert(fn);
+    return fn;
+  };
+
+  if (getStaticHooksFor(origFunc) != nullptr || useSledFor(origFunc, M)) {
+    // static hooks are called directly, so there is nothing to outline. With a sled the wrapper
+    // is only entered while the target has hooks, so it is never inlined.
+    Function* hookFn = createWrapper(FT, Function::InternalLinkage, name);
+    hookFn->setCallingConv(origFunc->getCallingConv());
+    createHookingCode(origFunc, hookFn, M, /*registryArg=*/false, /*impl=*/nullptr, siteArg);
+    return hookFn;
+  }
+
+  if (! SplitHookWrappers) {
+    Function* hookFn = createWrapper(FT, Function::InternalLinkage, name);
+    hookFn->setCallingConv(origFunc->getCallingConv());
+    // identical in every module, unless it is the wrapper of a local function
+    if (! origFunc->hasLocalLinkage()) {
+      shareAcrossModules(hookFn, M);
+    }
+    createHookingCode(origFunc, hookFn, M, /*registryArg=*/false, /*impl=*/nullptr, siteArg);
+    return hookFn;
+  }
+
+  StructType* regty = getHookRegistryType(M);
+  std::vector<Type*> ftargs(FT->param_begin(), FT->param_end());
+  ftargs.push_back(PointerType::getUnqual(regty));
+  FunctionType* slow_ft = FunctionType::get(FT->getReturnType(), ftargs, false);
+
+  Function* slowFn = createWrapper(slow_ft, Function::InternalLinkage, name + "_slow");
+  slowFn->addFnAttr(Attribute::Cold);
+  slowFn->addFnAttr(Attribute::NoInline);
+  createHookingCode(origFunc, slowFn, M, /*registryArg=*/true, /*impl=*/nullptr, siteArg);
+
+  Function* hookFn = createWrapper(FT, Function::InternalLinkage, name);
+  hookFn->setCallingConv(origFunc->getCallingConv());
+  hookFn->addFnAttr(Attribute::AlwaysInline);
+
+  BasicBlock* entry_bb = BasicBlock::Create(M.getContext(), "entry", hookFn);
+  BasicBlock* call_orig_bb = BasicBlock::Create(M.getContext(), "call_orig", hookFn);
+  BasicBlock* call_slow_bb = BasicBlock::Create(M.getContext(), "call_slow", hookFn);
+
+  IRBuilder<> entry(entry_bb);
+  Value* registry = loadHookRegistry(entry, origFunc, M);
+  entry.CreateCondBr(entry.CreateIsNull(registry), call_orig_bb, call_slow_bb,
+      getUnlikelyHooksWeights(M));
+
+  SmallVector<Value*, 8> args;
+  for (auto arg = hookFn->arg_begin(); arg != hookFn->arg_end(); arg++) {
+    args.push_back(&*arg);
+  }
+
+  IRBuilder<> call_orig(call_orig_bb);
+  IRBuilder<> call_slow(call_slow_bb);
+  CallInst* orig_ret = call_orig.CreateCall(origFunc->getFunctionType(), origFunc,
+      makeArrayRef(args).take_front(numparams));
+  orig_ret->setAttributes(attrs);
+  orig_ret->setCallingConv(origFunc->getCallingConv());
+  markForwardingTailCall(orig_ret, hookFn);
+  args.push_back(registry);
+  CallInst* slow_ret = call_slow.CreateCall(slowFn, args);
+  slow_ret->setAttributes(attrs);
+  markForwardingTailCall(slow_ret, hookFn);
+
+  if (FT->getReturnType()->isVoidTy()) {
+    call_orig.CreateRetVoid();
+    call_slow.CreateRetVoid();
+  } else {
+    call_orig.CreateRet(orig_ret);
+    call_slow.CreateRet(slow_ret);
+  }
+
+  return hookFn;
+}
+
+
+/**
+ * Returns the parameter and return attributes a wrapper for origFunc and the calls it forwards to
+ * must have. Wrappers for calls of varargs functions are specific to the call site, so they take
+ * the attributes of the call. Function attributes are not forwarded, e.g. a readnone target does
+ * not make calling its hooks readnone.
+ */
+AttributeList LLTap::InstrumentationPass::getForwardedAttributes(Function* origFunc, CallBase* CS,
+    Module& M) {
+  AttributeList attrs = (CS != nullptr && origFunc->isVarArg())
+    ? CS->getAttributes() : origFunc->getAttributes();
+  return attrs.removeFnAttributes(M.getContext());
+}
+
+
+/**
+ * Give a call which forwards the parameters of the wrapper F the parameter and return attributes
+ * of F and the calling convention of the callee.
+ */
+void LLTap::InstrumentationPass::setForwardedCallAttributes(CallInst* call, Function* F,
+    Module& M) {
+  AttributeList attrs = F->getAttributes();
+  call->setAttributes(attrs.removeFnAttributes(M.getContext()));
+  if (Function* callee = call->getCalledFunction()) {
+    call->setCallingConv(callee->getCallingConv());
+  }
+}
+
+
+/**
+ * Hooks may access any memory, so calls which may end up in them must not be readnone or
+ * readonly anymore.
+ */
+AttributeList LLTap::InstrumentationPass::removeMemoryAttributes(AttributeList attrs, Module& M) {
+  Attribute::AttrKind kinds[] = {
+    Attribute::ReadNone,
+    Attribute::ReadOnly,
+    Attribute::ArgMemOnly,
+  };
+  for (Attribute::AttrKind kind : kinds) {
+    attrs = attrs.removeFnAttribute(M.getContext(), kind);
+  }
+  return attrs;
+}
+
+
+/**
+ * Mark a call in F, whose result is returned right away, as tail call. If it has the same
+ * prototype as F it can even be a musttail call, which guarantees that forwarding the call through
+ * the wrapper doesn't grow the stack. Calls in wrappers, which are always inlined, stay plain tail
+ * calls, as they are not in tail position after inlining.
+ */
+void LLTap::InstrumentationPass::markForwardingTailCall(CallInst* call, Function* F) {
+  // the callee would access the byval copies in the frame of F
+  for (Argument& arg : F->args()) {
+    if (arg.hasPassPointeeByValueCopyAttr()) {
+      return;
+    }
+  }
+
+  bool same_proto = call->getFunctionType() == F->getFunctionType()
+    && call->getCallingConv() == F->getCallingConv()
+    && call->getAttributes().getRetAttrs() == F->getAttributes().getRetAttrs()
+    && (! F->hasFnAttribute(Attribute::AlwaysInline));
+  call->setTailCallKind(same_proto ? CallInst::TCK_MustTail : CallInst::TCK_Tail);
+}
+
+
+/**
+ * Load the LLTapHookRegistry of origFunc, either from its dispatch slot or by asking the runtime.
+ * NULL means that no hooks are installed.
+ */
+Value* LLTap::InstrumentationPass::loadHookRegistry(IRBuilder<>& irb, Function* origFunc,
+    Module& M) {
+
+  GlobalVariable* slot = getHookSlotFor(origFunc, M);
+  if (slot != nullptr) {
+    // a single load of the slot tells whether there are any hooks
+    LoadInst* slotval = irb.CreateLoad(slot->getValueType(), slot, "hooks");
+    slotval->setAtomic(AtomicOrdering::Acquire);
+    slotval->setAlignment(M.getDataLayout().getPointerABIAlignment(0));
+    return slotval;
+  }
+
+  // a single runtime call returns a consistent snapshot of all hooks
+  PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
+  Value* args[] = { ConstantExpr::getCast(Instruction::BitCast, origFunc, i8ptr) };
+  return irb.CreateCall(M.getFunction(fn_lltap_get_hooks), args, "hooks");
+}
+
+
+/**
+ * Branch weights for a branch on the registry being NULL. Hooks are expected to be installed for
+ * only a few of the instrumented targets.
+ */
+MDNode* LLTap::InstrumentationPass::getUnlikelyHooksWeights(Module& M) {
+  return MDBuilder(M.getContext()).createBranchWeights(2000, 1);
+}
+
+
 /**
  * Same as \ref createHookFunction but takes a callsite as parameter. This is useful for functions
  * with variable number of arguments.
  */
-Function* LLTap::InstrumentationPass::createHookFunction(StringRef name, CallSite* call, Function* origFunc, Module& M) {
+Function* LLTap::InstrumentationPass::createHookFunction(StringRef name, CallBase* call, Function* origFunc, Module& M,
+    bool siteArg) {
 
   std::vector<Type*> ftargs;
   FunctionType* FT = nullptr;
   if (! call->getCalledFunction()->isVarArg()) {
     FT = origFunc->getFunctionType();
   } else {
-    for (size_t i = 0; i < call->getNumArgOperands(); ++i) {
-      ftargs.push_back(call->getArgument(i)->getType());
+    for (size_t i = 0; i < call->arg_size(); ++i) {
+      ftargs.push_back(call->getArgOperand(i)->getType());
     }
     FT = FunctionType::get(
         origFunc->getReturnType(),
@@ -688,17 +3524,10 @@ Function* LLTap::InstrumentationPass::createHookFunction(StringRef name, CallSit
     ftargs.clear();
   }
 
-  DEBUG(dbgs() << "creating hook function " << name << " with type " << *FT <<
+  LLVM_DEBUG(dbgs() << "creating hook function " << name << " with type " << *FT <<
       " numparams " << FT->getNumParams() << "\n");
 
-  // create function
-  Function* hookFn = Function::Create(FT, Function::ExternalLinkage, name, &M);
-  createHookingCode(origFunc, hookFn, M);
-
-  // add to set of lltap generated functions
-  lltapHookFunctions.insert(hookFn);
-
-  return hookFn;
+  return createHookWrapper(name, FT, origFunc, M, call, siteArg);
 }
 
 
@@ -711,124 +3540,166 @@ Function* LLTap::InstrumentationPass::createHookFunction(StringRef name, Functio
   std::vector<Type*> ftargs;
   FunctionType* FT = origFunc->getFunctionType();
 
-  DEBUG(dbgs() << "creating hook function " << name << " with type " << *FT <<
+  LLVM_DEBUG(dbgs() << "creating hook function " << name << " with type " << *FT <<
       " numparams " << FT->getNumParams() << "\n");
 
-  // create function
-  Function* hookFn = Function::Create(FT, Function::ExternalLinkage, name, &M);
-  createHookingCode(origFunc, hookFn, M);
-
-  // add to set of lltap generated functions
-  lltapHookFunctions.insert(hookFn);
-
-  return hookFn;
+  return createHookWrapper(name, FT, origFunc, M);
 }
 
 
 /**
- * Generate the code that allocates space for the parameters of the original call and queries the
- * LLTap runtime for the enabled hooks and calls these with the respective parameters.
+ * Generate the code that queries the LLTap runtime for the enabled hooks and calls these with the
+ * respective parameters. The parameters stay in registers, only the pre hook and the post hook
+ * need them in memory, because they receive pointers to them.
+ *
+ * Without origFunc the code is generated for an indirect call: registryArg must be set and the
+ * called function pointer is passed after the registry.
+ *
+ * With siteArg the LLTapCallSiteRecord of the call follows the parameters of the target. It is
+ * published in __lltap_call_site while the hooks and the target run.
  */
-bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function* F, Module& M) {
+bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function* F, Module& M,
+    bool registryArg, Function* impl, bool siteArg) {
 
-  FunctionType* origFT = origFunc->getFunctionType();
   FunctionType* FT = F->getFunctionType();
-  size_t numparams = FT->getNumParams();
+  bool indirect = (origFunc == nullptr);
+  // with registryArg the last parameter is the LLTapHookRegistry and not passed on
+  size_t numparams = FT->getNumParams() - (registryArg ? 1 : 0) - (indirect ? 1 : 0)
+    - (siteArg ? 1 : 0);
   bool fn_returns_void = FT->getReturnType()->isVoidTy();
 
-  DEBUG(dbgs() << "instrumenting call to function " << origFunc->getName()
+  FunctionType* origFT = nullptr;
+  Value* callee = nullptr;
+  StaticHooks* statics = nullptr;
+  if (indirect) {
+    std::vector<Type*> params(FT->param_begin(), FT->param_begin() + numparams);
+    origFT = FunctionType::get(FT->getReturnType(), params, false);
+    callee = F->getArg(F->arg_size() - 1);
+  } else {
+    origFT = origFunc->getFunctionType();
+    // with impl the hooks are looked up for origFunc, but impl is called instead
+    callee = (impl != nullptr) ? impl : origFunc;
+    // static hooks are called directly and only guarded by the optional kill switch
+    statics = getStaticHooksFor(origFunc);
+  }
+  bool check_hooks = (statics == nullptr) ? (! registryArg) : (bool)StaticHooksKillSwitch;
+
+  LLVM_DEBUG(dbgs() << "instrumenting call to function "
+      << (indirect ? StringRef("<indirect>") : origFunc->getName())
       << " with type " << *FT << "\n");
 
   // append basicblocks for the hook calling
   // --> entry
-  // entry --> init
+  // entry --> call_unhooked (if there are no hooks)
+  //       --> check_pre
   BasicBlock *entry_BB = BasicBlock::Create(M.getContext(), "entry", F);
-  // init --> check_pre (if hooks bitmap != 0)
-  //      --> call_orig (if hooks bitmap == 0)
-  BasicBlock* init_bb = BasicBlock::Create(M.getContext(), "init", F);
+  // call_unhooked --> return
+  BasicBlock* call_unhooked_bb = nullptr;
+  if (check_hooks) {
+    call_unhooked_bb = BasicBlock::Create(M.getContext(), "call_unhooked", F);
+  }
 
-  // check_pre --> call_pre (if hooks bitmap & PRE_HOOK != 0)
+  // check_pre --> call_pre (if there is a pre hook)
   //           --> check_rh
   BasicBlock* check_pre_bb = BasicBlock::Create(M.getContext(), "check_pre", F);
   // call_pre --> check_rh
   BasicBlock* call_pre_bb = BasicBlock::Create(M.getContext(), "call_pre", F);
 
-  // check_rh --> call_rh (if hooks bitmap & REPLACE_HOOK != 0)
+  // check_rh --> call_rh (if there is a replace hook)
   //          --> call_orig
   BasicBlock* check_rh_bb = BasicBlock::Create(M.getContext(), "check_rh", F);
   // call_rh --> check_post
   BasicBlock* call_rh_bb = BasicBlock::Create(M.getContext(), "call_rh", F);
-  // call_orig --> return (if hooks bitmap == 0)
-  //           --> check_post
+  // call_orig --> check_post
   BasicBlock* call_orig_bb = BasicBlock::Create(M.getContext(), "call_orig", F);
 
-  // check_post --> call_post (if hooks bitmap & POST_HOOK != 0)
+  // check_post --> check_post_abi (if there is a post hook)
   //                return
   BasicBlock* check_post_bb = BasicBlock::Create(M.getContext(), "check_post", F);
+  // check_post_abi --> call_post_byref (if the post hook takes pointers)
+  //                --> call_post
+  BasicBlock* check_post_abi_bb = BasicBlock::Create(M.getContext(), "check_post_abi", F);
   // call_post --> return
   BasicBlock* call_post_bb = BasicBlock::Create(M.getContext(), "call_post", F);
+  // call_post_byref --> return
+  BasicBlock* call_post_byref_bb = BasicBlock::Create(M.getContext(), "call_post_byref", F);
 
   BasicBlock *return_bb = BasicBlock::Create(M.getContext(), "return", F);
 
 
   // some "constants" used below
   PointerType* i8ptr = PointerType::getUnqual(IntegerType::get(M.getContext(), 8));
-  Constant* orig_func_addr = ConstantExpr::getCast(Instruction::BitCast, origFunc, i8ptr);
-  //Value* i8ptr_null = ConstantPointerNull::get(i8ptr);
-  Value* i32_zero = ConstantInt::get(IntegerType::getInt32Ty(M.getContext()), 0);
+  Value* i8ptr_null = ConstantPointerNull::get(i8ptr);
 
 
   // create the instruction in the BBs
   //************************************************************
-  // entry and init
+  // entry
   SmallVector<Value*, 4> args;
-  Value* ret = nullptr;
+  SmallVector<Value*, 4> params;
+  SmallVector<AllocaInst*, 4> spills;
   AllocaInst* retval = nullptr;
-  AllocaInst** params = new AllocaInst*[numparams];
-  Value* hooks_avail = nullptr;
-  Value* no_hooks = nullptr;
+  Value* registry = nullptr;
+  Value* site = nullptr;
 
   {
     IRBuilder<> entry(entry_BB);
-    IRBuilder<> init(init_bb);
 
-    size_t i = 0;
-    for (auto arg = F->arg_begin(); arg != F->arg_end(); arg++) {
-      params[i] = entry.CreateAlloca(arg->getType(), nullptr, "arg");
-      init.CreateStore(&*arg, params[i]);
-      //DEBUG(dbgs() << "alloca for param " << i << " " << *params[i] << "\n");
-      i++;
+    // the stack slots are only written when calling the pre or post hook
+    auto arg = F->arg_begin();
+    for (size_t i = 0; i < numparams; ++i, ++arg) {
+      params.push_back(&*arg);
+      spills.push_back(entry.CreateAlloca(arg->getType(), nullptr, "arg"));
     }
 
     if (! fn_returns_void) {
       retval = entry.CreateAlloca(FT->getReturnType(), nullptr, "ret");
     }
 
-    // from entry BB jump to initialization BB
-    entry.CreateBr(init_bb);
+    if (siteArg) {
+      site = &*arg;
+      ++arg;
+    }
 
-    // get the hooks availability bitmap
-    Function* has_hooks = M.getFunction(fn_lltap_has_hooks);
-    args.push_back(orig_func_addr);
-    hooks_avail = init.CreateCall(has_hooks, args);
-    no_hooks = init.CreateICmpEQ(hooks_avail, i32_zero);
-    init.CreateCondBr(no_hooks, call_orig_bb, check_pre_bb);
+    if (! check_hooks) {
+      // the caller already checked that there are hooks or they are static
+      if (registryArg) {
+        registry = &*arg;
+      }
+      entry.CreateBr(check_pre_bb);
+    } else {
+      Value* no_hooks = nullptr;
+      if (statics != nullptr) {
+        no_hooks = entry.CreateIsNull(loadStaticHooksEnabled(entry, M));
+      } else {
+        registry = loadHookRegistry(entry, origFunc, M);
+        no_hooks = entry.CreateIsNull(registry);
+      }
+      entry.CreateCondBr(no_hooks, call_unhooked_bb, check_pre_bb,
+          (statics == nullptr) ? getUnlikelyHooksWeights(M) : nullptr);
+
+      IRBuilder<> call_unhooked(call_unhooked_bb);
+      CallInst* ret = call_unhooked.CreateCall(origFT, callee, params);
+      setForwardedCallAttributes(ret, F, M);
+      markForwardingTailCall(ret, F);
+      if (fn_returns_void) {
+        call_unhooked.CreateRetVoid();
+      } else {
+        call_unhooked.CreateRet(ret);
+      }
+    }
   }
 
 
   //************************************************************
   // pre hook
 
-  Function* get_hook = M.getFunction(fn_lltap_get_hook);
   std::vector<Type*> ftargs;
 
   {
     IRBuilder<> check_pre(check_pre_bb);
     IRBuilder<> call_pre(call_pre_bb);
 
-    Value* HookType_Enum_pre = ConstantInt::get(IntegerType::getInt32Ty(M.getContext()),
-        (uint64_t)HookType::PRE_HOOK);
-
     for (Type* param : origFT->params()) {
       PointerType* param_ptr = PointerType::getUnqual(param);
       ftargs.push_back(param_ptr);
@@ -837,28 +3708,33 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
     FunctionType* pre_ft = FunctionType::get(
         Type::getVoidTy(M.getContext()),
         ftargs,
-        origFunc->isVarArg());
+        origFT->isVarArg());
     PointerType* pre_ptrty = PointerType::getUnqual(pre_ft);
 
-    Value* has_pre_hook = check_pre.CreateICmpNE(
-        check_pre.CreateAnd(hooks_avail, HookType_Enum_pre),
-        i32_zero);
+    Value* preval = (statics != nullptr)
+      ? getStaticHook(statics, HookType::PRE_HOOK, pre_ft, M)
+      : loadHookFromRegistry(check_pre, registry, HookType::PRE_HOOK, M);
+    Value* has_pre_hook = check_pre.CreateICmpNE(preval, i8ptr_null);
     check_pre.CreateCondBr(has_pre_hook, call_pre_bb, check_rh_bb);
 
+    // the pre hook may modify the parameters, so they are reloaded afterwards and merged with the
+    // unmodified ones in check_rh
+    for (size_t i = 0; i < numparams; ++i) {
+      call_pre.CreateStore(params[i], spills[i]);
+    }
     args.clear();
-    args.push_back(orig_func_addr);
-    args.push_back(HookType_Enum_pre);
-    Value* preval = call_pre.CreateCall(get_hook, args);
+    args.append(spills.begin(), spills.end());
+    Value* pre = call_pre.CreateBitCast(preval, pre_ptrty);
+    call_pre.CreateCall(pre_ft, pre, args);
 
-    //DEBUG(dbgs() << "pre hook type = " << *pre_ft << "\n");
-    args.clear();
+    IRBuilder<> check_rh(check_rh_bb);
     for (size_t i = 0; i < numparams; ++i) {
-      args.push_back(params[i]);
-      //DEBUG(dbgs() << "arg " << i <<" type = " << *params[i]->getType()
-      //    << " expected " << *FT->getParamType(i) << "\n");
+      Value* reloaded = call_pre.CreateLoad(spills[i]->getAllocatedType(), spills[i]);
+      PHINode* phi = check_rh.CreatePHI(params[i]->getType(), 2, "arg");
+      phi->addIncoming(params[i], check_pre_bb);
+      phi->addIncoming(reloaded, call_pre_bb);
+      params[i] = phi;
     }
-    Value* pre = call_pre.CreateBitCast(preval, pre_ptrty);
-    call_pre.CreateCall(pre, args);
     call_pre.CreateBr(check_rh_bb);
   }
 
@@ -866,13 +3742,13 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
   //************************************************************
   // replace hook (rh)
 
+  Value* ret = nullptr;
+
   {
     IRBuilder<> call_rh(call_rh_bb);
     IRBuilder<> check_rh(check_rh_bb);
     IRBuilder<> call_orig(call_orig_bb);
-
-    Value* HookType_Enum_replace = ConstantInt::get(IntegerType::getInt32Ty(M.getContext()),
-        (uint64_t)HookType::REPLACE_HOOK);
+    IRBuilder<> check_post(check_post_bb);
 
     // create replace hook
     ftargs.clear();
@@ -884,46 +3760,34 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
     FunctionType* rh_ft = FunctionType::get(
         FT->getReturnType(),
         ftargs,
-        origFunc->isVarArg());
+        origFT->isVarArg());
     PointerType* rh_ptr = PointerType::getUnqual(rh_ft);
 
-    Value* has_replace_hook = check_rh.CreateICmpNE(
-        check_rh.CreateAnd(hooks_avail, HookType_Enum_replace),
-        i32_zero);
+    Value* rhval = (statics != nullptr)
+      ? getStaticHook(statics, HookType::REPLACE_HOOK, rh_ft, M)
+      : loadHookFromRegistry(check_rh, registry, HookType::REPLACE_HOOK, M);
+    Value* has_replace_hook = check_rh.CreateICmpNE(rhval, i8ptr_null);
     check_rh.CreateCondBr(has_replace_hook, call_rh_bb, call_orig_bb);
 
     // then call original function
-    args.clear();
-    for (size_t i = 0; i < numparams; ++i) {
-      Value* p = call_orig.CreateLoad(params[i]);
-      args.push_back(p);
-    }
-    ret = call_orig.CreateCall(origFunc, args);
-    if (!fn_returns_void) {
-      call_orig.CreateStore(ret, retval);
-    }
-
-    call_orig.CreateCondBr(no_hooks, return_bb, check_post_bb);
+    CallInst* orig_ret = call_orig.CreateCall(origFT, callee, params);
+    setForwardedCallAttributes(orig_ret, F, M);
+    call_orig.CreateBr(check_post_bb);
 
     // else call replace hook function
-    args.clear();
-    args.push_back(orig_func_addr);
-    args.push_back(HookType_Enum_replace);
-
-    Value* rhval = call_rh.CreateCall(get_hook, args);
-
-    //check_rh.CreateStore(rhval, rh);
-    args.clear();
-    for (size_t i = 0; i < numparams; ++i) {
-      Value* p = call_rh.CreateLoad(params[i]);
-      args.push_back(p);
-    }
     Value* rh = call_rh.CreateBitCast(rhval, rh_ptr);
-    ret = call_rh.CreateCall(rh, args);
-    if (!fn_returns_void) {
-      call_rh.CreateStore(ret, retval);
-    }
+    CallInst* rh_ret = call_rh.CreateCall(rh_ft, rh, params);
+    // the replace hook has the prototype of the target
+    setForwardedCallAttributes(rh_ret, F, M);
+    rh_ret->setCallingConv(CallingConv::C);
     call_rh.CreateBr(check_post_bb);
+
+    if (! fn_returns_void) {
+      PHINode* phi = check_post.CreatePHI(FT->getReturnType(), 2, "ret");
+      phi->addIncoming(orig_ret, call_orig_bb);
+      phi->addIncoming(rh_ret, call_rh_bb);
+      ret = phi;
+    }
   }
 
 
@@ -932,10 +3796,9 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
 
   {
     IRBuilder<> check_post(check_post_bb);
+    IRBuilder<> check_post_abi(check_post_abi_bb);
     IRBuilder<> call_post(call_post_bb);
-
-    Value* HookType_Enum_post = ConstantInt::get(IntegerType::getInt32Ty(M.getContext()),
-        (uint64_t)HookType::POST_HOOK);
+    IRBuilder<> call_post_byref(call_post_byref_bb);
 
     ftargs.clear();
     if (!fn_returns_void) {
@@ -949,41 +3812,118 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
     FunctionType* post_ft = FunctionType::get(
         Type::getVoidTy(M.getContext()),
         ftargs,
-        origFunc->isVarArg());
+        origFT->isVarArg());
     PointerType* post_ptrty = PointerType::getUnqual(post_ft);
 
+    // the by reference post hook gets pointers to the parameters. byval parameters already are
+    // pointers to a private copy, which are passed on unchanged.
+    SmallVector<bool, 8> byval;
+    for (size_t i = 0; i < numparams; ++i) {
+      byval.push_back(F->hasParamAttribute(i, Attribute::ByVal));
+    }
+    ftargs.clear();
+    if (!fn_returns_void) {
+      ftargs.push_back(PointerType::getUnqual(FT->getReturnType()));
+    }
+    for (size_t i = 0; i < origFT->getNumParams(); ++i) {
+      Type* param = origFT->getParamType(i);
+      ftargs.push_back(byval[i] ? param : PointerType::getUnqual(param));
+    }
+    FunctionType* post_byref_ft = FunctionType::get(
+        Type::getVoidTy(M.getContext()),
+        ftargs,
+        origFT->isVarArg());
+    PointerType* post_byref_ptrty = PointerType::getUnqual(post_byref_ft);
+
     // check for post
-    Value* has_post_hook = check_post.CreateICmpNE(
-        check_post.CreateAnd(hooks_avail, HookType_Enum_post),
-        i32_zero);
-    check_post.CreateCondBr(has_post_hook, call_post_bb, return_bb);
+    Value* postval = nullptr;
+    Value* post_is_byref = nullptr;
+    if (statics != nullptr) {
+      if (statics->post_hook_byref) {
+        postval = getStaticHook(statics, HookType::POST_HOOK_BYREF, post_byref_ft, M);
+      } else {
+        postval = getStaticHook(statics, HookType::POST_HOOK, post_ft, M);
+      }
+      post_is_byref = ConstantInt::get(Type::getInt1Ty(M.getContext()), statics->post_hook_byref);
+    } else {
+      postval = loadHookFromRegistry(check_post, registry, HookType::POST_HOOK, M);
+      StructType* regty = getHookRegistryType(M);
+      Value* bitmap = check_post_abi.CreateLoad(regty->getElementType(0),
+          check_post_abi.CreateStructGEP(regty, registry, 0));
+      post_is_byref = check_post_abi.CreateICmpNE(
+          check_post_abi.CreateAnd(bitmap, (uint64_t)HookType::POST_HOOK_BYREF),
+          ConstantInt::get(bitmap->getType(), 0));
+    }
+    Value* has_post_hook = check_post.CreateICmpNE(postval, i8ptr_null);
+    check_post.CreateCondBr(has_post_hook, check_post_abi_bb, return_bb);
+    check_post_abi.CreateCondBr(post_is_byref, call_post_byref_bb, call_post_bb);
 
-    // call post hook
+    // call post hook, which receives the return value by pointer and may modify it
     args.clear();
-    args.push_back(orig_func_addr);
-    args.push_back(HookType_Enum_post);
-    Value* postval = call_post.CreateCall(get_hook, args);
+    if (!fn_returns_void) {
+      call_post.CreateStore(ret, retval);
+      args.push_back(retval);
+    }
+    args.append(params.begin(), params.end());
+    Value* post = call_post.CreateBitCast(postval, post_ptrty);
+    call_post.CreateCall(post_ft, post, args);
 
+    // or with pointers to the parameters, which are only spilled here and not copied again
     args.clear();
     if (!fn_returns_void) {
+      call_post_byref.CreateStore(ret, retval);
       args.push_back(retval);
     }
     for (size_t i = 0; i < numparams; ++i) {
-      Value* p = call_post.CreateLoad(params[i]);
-      args.push_back(p);
+      if (byval[i]) {
+        args.push_back(params[i]);
+      } else {
+        call_post_byref.CreateStore(params[i], spills[i]);
+        args.push_back(spills[i]);
+      }
+    }
+    Value* post_byref = call_post_byref.CreateBitCast(postval, post_byref_ptrty);
+    call_post_byref.CreateCall(post_byref_ft, post_byref, args);
+
+    if (!fn_returns_void) {
+      Value* post_ret = call_post.CreateLoad(FT->getReturnType(), retval);
+      Value* post_byref_ret = call_post_byref.CreateLoad(FT->getReturnType(), retval);
+      IRBuilder<> return_irb(return_bb);
+      PHINode* phi = return_irb.CreatePHI(FT->getReturnType(), 3, "ret");
+      phi->addIncoming(ret, check_post_bb);
+      phi->addIncoming(post_ret, call_post_bb);
+      phi->addIncoming(post_byref_ret, call_post_byref_bb);
+      ret = phi;
     }
-    Value* post = call_post.CreateBitCast(postval, post_ptrty);
-    call_post.CreateCall(post, args);
     call_post.CreateBr(return_bb);
+    call_post_byref.CreateBr(return_bb);
+  }
+
+  //************************************************************
+  // call site, which check_pre publishes for everything up to the return. It is restored
+  // afterwards, as the hooks and the target may make instrumented calls themselves.
+  SmallVector<std::pair<GlobalVariable*, Instruction*>, 2> restores;
+  if (site != nullptr) {
+    GlobalVariable* current = M.getNamedGlobal(LLTAP_CALL_SITE);
+    IRBuilder<> check_pre(check_pre_bb, check_pre_bb->getFirstInsertionPt());
+    LoadInst* outer = check_pre.CreateLoad(current->getValueType(), current, "outer_site");
+    check_pre.CreateStore(site, current);
+    IRBuilder<> return_irb(return_bb, return_bb->getFirstInsertionPt());
+    return_irb.CreateStore(outer, current);
+    restores.push_back(std::make_pair(current, outer));
+  }
+
+  if (CallContexts) {
+    Instruction* outer = createCallContext(entry_BB, check_pre_bb, return_bb, site, M);
+    restores.push_back(std::make_pair(M.getNamedGlobal(LLTAP_CALL_CONTEXT), outer));
   }
 
   //************************************************************
-  // load retval and return
+  // return
   {
     IRBuilder<> return_irb(return_bb);
 
     if (!fn_returns_void) {
-      ret = return_irb.CreateLoad(retval);
       return_irb.CreateRet(ret);
     } else {
       return_irb.CreateRetVoid();
@@ -991,10 +3931,18 @@ bool LLTap::InstrumentationPass::createHookingCode(Function* origFunc, Function*
   }
 
   //************************************************************
+  // built-in tracer, which only runs for targets with a registry
+  if (TraceCalls && registry != nullptr) {
+    createTraceCode(entry_BB, check_pre_bb, return_bb, registry, params, ret, site, M);
+  }
+
+  if (! restores.empty()) {
+    createUnwindCleanup(F, restores, M);
+  }
 
-  //DEBUG(dbgs() << "updated function to contain hooking logic\n" << *F << "\n\n");
+  //************************************************************
 
-  delete[] params;
+  //LLVM_DEBUG(dbgs() << "updated function to contain hooking logic\n" << *F << "\n\n");
 
   return true;
 }
@@ -39,6 +39,14 @@ def construct_argparser():
                         choices=["libclang"],
                         default="libclang",
                         help="parsing backend to use to parse header files")
+    parser.add_argument("--post-hook-byref",
+                        action='store_true',
+                        help="generate post hooks which receive pointers to "
+                        "the arguments instead of copies")
+    parser.add_argument("--signatures",
+                        type=argparse.FileType('w'),
+                        help="also write the argument types of the functions "
+                        "to this file, for lltap-decode --signatures")
     parser.add_argument("--from-lists",
                         action='store_true',
                         help="instead of parsing ")
@@ -60,6 +68,7 @@ def do_it(argv):
     args = ap.parse_args(argv)
     if args.parser == "libclang":
         from tracergen.withclang import generate_hooks_from_headers
+        from tracergen.withclang import generate_signatures_from_headers
     else:
         raise NotImplemented("such a parsing backend is not available")
     if not args.headers or len(args.headers) == 0:
@@ -85,7 +94,9 @@ def do_it(argv):
                         headers.append(line)
     else:
         headers = args.headers
-    s = generate_hooks_from_headers(headers, module)
+    if args.signatures:
+        args.signatures.write(generate_signatures_from_headers(headers))
+    s = generate_hooks_from_headers(headers, module, args.post_hook_byref)
     if args.output:
         args.output.write(s)
     else:
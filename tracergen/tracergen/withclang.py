@@ -205,10 +205,12 @@ class HookFunction:
     Class that represents a generated hook function.
     """
 
-    def __init__(self, node, hooktype):
+    def __init__(self, node, hooktype, post_byref=False):
         self.node = node
         self.origfunc = node
         self.type = hooktype
+        # post hook receives pointers to the arguments (LLTAP_POST_HOOK_BYREF)
+        self.post_byref = post_byref
         self.code = None
         self.globalvars = []
         self.includes = []
@@ -238,7 +240,7 @@ class HookFunction:
         if self.type == "post":
             args.append("{}* ret".format(self.node.result_type.spelling))
         for i, arg in enumerate(self.node.get_arguments()):
-            if self.type != "replace":
+            if self.type == "pre" or (self.type == "post" and self.post_byref):
                 argt = ArgType(arg.type)
                 args.append("{}* arg{}".format(argt.argtype_spelling, i))
             else:
@@ -319,18 +321,20 @@ class HookFunction:
         if self.type == "pre":
             return "LLTAP_PRE_HOOK"
         elif self.type == "post":
+            if self.post_byref:
+                return "LLTAP_POST_HOOK_BYREF"
             return "LLTAP_POST_HOOK"
         elif self.type == "replace":
             return "LLTAP_REPLACE_HOOK"
 
 
-def generate_hooks(node, tu):
+def generate_hooks(node, tu, post_byref=False):
     """for a given declaration (node) create pre and post hook functions"""
     log.debug("Generating hooks for function %s %s", node.result_type.spelling,
               node.displayname)
     d = []
     for t in ("pre", "post"):
-        hook = HookFunction(node, t)
+        hook = HookFunction(node, t, post_byref)
         hook.generate_code()
         d.append(hook)
     return d
@@ -349,6 +353,69 @@ def find_decls(node):
     return decls
 
 
+SIGNED_KINDS = ("CHAR_S", "SCHAR", "WCHAR", "SHORT", "INT", "LONG", "LONGLONG")
+UNSIGNED_KINDS = ("BOOL", "CHAR_U", "UCHAR", "CHAR16", "CHAR32", "USHORT", "UINT",
+                  "ULONG", "ULONGLONG")
+POINTER_KINDS = ("POINTER", "BLOCKPOINTER", "INCOMPLETEARRAY", "CONSTANTARRAY",
+                 "VARIABLEARRAY", "DEPENDENTSIZEDARRAY")
+
+
+def signature_kind(t):
+    """
+    Type of a raw argument word of the built-in tracer as understood by
+    lltap-decode: void, i<bits>, u<bits>, f32, f64, ptr or ? if unknown.
+    """
+    t = t.get_canonical()
+    if t.kind == TypeKind.ENUM:
+        t = t.get_declaration().enum_type.get_canonical()
+    kind = t.kind.name
+    if kind == "VOID":
+        return "void"
+    if kind in POINTER_KINDS:
+        return "ptr"
+    if kind == "FLOAT":
+        return "f32"
+    if kind == "DOUBLE":
+        return "f64"
+    size = t.get_size()
+    if 0 < size <= 8:
+        if kind in SIGNED_KINDS:
+            return "i{}".format(size * 8)
+        if kind in UNSIGNED_KINDS:
+            return "u{}".format(size * 8)
+    return "?"
+
+
+def generate_signatures_from_headers(headerfiles):
+    """
+    Tab separated argument types of the functions declared in the headers,
+    which lltap-decode --signatures uses to print the arguments of traces.
+    """
+    lines = ["# generated by lltaptracergen from " + ", ".join(headerfiles)]
+    seen = set()
+    for headerfile in headerfiles:
+        if not os.path.exists(headerfile):
+            log.error("Failed to open headerfile '%s'", headerfile)
+            continue
+        index = clang.cindex.Index.create()
+        tu = index.parse(headerfile)
+        if not tu:
+            log.error("failed to parse '%s'", headerfile)
+            continue
+        for node in find_decls(tu.cursor):
+            if node.spelling in seen:
+                continue
+            seen.add(node.spelling)
+            fields = [node.spelling, signature_kind(node.result_type)]
+            fields.extend(signature_kind(arg.type)
+                          for arg in node.get_arguments())
+            if node.type.kind != TypeKind.FUNCTIONNOPROTO \
+                    and node.type.is_function_variadic():
+                fields.append("...")
+            lines.append("\t".join(fields))
+    return "\n".join(lines) + "\n"
+
+
 def main(argv):
     if len(argv) != 3:
         print("Invalid number of arguments")
@@ -361,7 +428,7 @@ def main(argv):
     return 0
 
 
-def generate_hooks_from_headers(headerfiles, module=None):
+def generate_hooks_from_headers(headerfiles, module=None, post_byref=False):
     includes = ["liblltap.h"]
     globalvars = []
     hooks = []
@@ -376,7 +443,7 @@ def generate_hooks_from_headers(headerfiles, module=None):
             log.error("failed to parse '%s'", headerfile)
         hooknames = {"pre": {}, "post": {}, "replace": {}}
         for node in find_decls(tu.cursor):
-            for h in generate_hooks(node, tu):
+            for h in generate_hooks(node, tu, post_byref):
                 if h.target not in hooknames[h.type]:
                     hooknames[h.type][h.target] = h.name
                     includes.extend(h.get_includes())